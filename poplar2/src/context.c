@@ -0,0 +1,127 @@
+// context.c - Block closures and lazily materialized contexts for Poplar2
+
+#include "context.h"
+#include "object.h"
+#include "gc.h"
+
+// The Context of a frame, created if it has none yet
+Value context_for_frame(Frame* frame) {
+    if (is_object(frame->context)) {
+        return frame->context;
+    }
+
+    // Frames never move, but their method and block may
+    uint16_t slot_count = frame->method->num_args + frame->method->num_locals;
+    Context* context = (Context*)object_new(vm->class_Context, CONTEXT_FIELDS(slot_count));
+
+    context->frame = make_int((int32_t)((Value*)frame - vm->stack_base));
+    context->outer = frame->is_block_invocation ? frame_block(frame)->outer : vm->nil;
+    frame->context = make_object(&context->object);
+
+    return frame->context;
+}
+
+// Copy a returning frame's variables into its Context, if it has one
+void context_detach(Frame* frame) {
+    if (!is_object(frame->context)) {
+        return;
+    }
+
+    Context* context = (Context*)as_object(frame->context);
+    uint8_t num_args = frame->method->num_args;
+
+    for (uint16_t i = 0; i < num_args; i++) {
+        gc_write_barrier(&context->object, frame->arguments[i]);
+        context->slots[i] = frame->arguments[i];
+    }
+    for (uint16_t i = 0; i < frame->method->num_locals; i++) {
+        gc_write_barrier(&context->object, frame->stack[i]);
+        context->slots[num_args + i] = frame->stack[i];
+    }
+
+    context->frame = vm->nil;
+}
+
+// The slot of variable 'index' (arguments, then locals) of a context's frame
+Value* context_slot(Context* context, uint16_t index) {
+    if (index >= context->object.size - CONTEXT_FIELDS(0)) {
+        return NULL;
+    }
+
+    Frame* frame = context_frame(context);
+    if (frame == NULL) {
+        return &context->slots[index];
+    }
+
+    uint8_t num_args = frame->method->num_args;
+    return index < num_args ? &frame->arguments[index] : &frame->stack[index - num_args];
+}
+
+// The Context 'level' lexical levels out from a block frame
+Context* context_outer(Frame* frame, uint8_t level) {
+    Value outer = frame->is_block_invocation ? frame_block(frame)->outer : vm->nil;
+
+    while (level > 1 && is_object(outer)) {
+        outer = ((Context*)as_object(outer))->outer;
+        level--;
+    }
+
+    return level == 1 && is_object(outer) ? (Context*)as_object(outer) : NULL;
+}
+
+// The frame a non-local return from a block frame returns from
+//
+// Following the outer contexts ends at the context of the method frame the
+// outermost block was created in.
+Frame* context_home_frame(Frame* frame) {
+    Value outer = frame->is_block_invocation ? frame_block(frame)->outer : vm->nil;
+    if (!is_object(outer)) {
+        return NULL;
+    }
+
+    Context* context = (Context*)as_object(outer);
+    while (is_object(context->outer)) {
+        context = (Context*)as_object(context->outer);
+    }
+
+    return context_frame(context);
+}
+
+// Create a closure of a block Method
+Value block_new(Value method, Value receiver, Value outer) {
+    gc_push_root(&method);
+    gc_push_root(&receiver);
+    gc_push_root(&outer);
+    Block* block = (Block*)object_new(vm->class_Block, BLOCK_FIELDS);
+    gc_pop_roots(3);
+
+    block->method = method;
+    block->receiver = receiver;
+    block->outer = outer;
+
+    return make_object(&block->object);
+}
+
+// Create the closure for block literal 'index' of a frame's method
+//
+// Clean blocks were built by the compiler and are shared; the rest capture
+// the frame's Context and receiver.
+Value block_for_frame(Frame* frame, uint16_t index) {
+    Value literals = frame->method->literals;
+    Value literal = is_object(literals) && index < as_object(literals)->size ? as_object(literals)->fields[index] : vm->nil;
+    if (!is_object(literal) || (as_object(literal)->class_index != CLASS_INDEX_BLOCK &&
+                                as_object(literal)->class_index != CLASS_INDEX_METHOD)) {
+        vm_error("Invalid block index: %d", index);
+        return vm->nil;
+    }
+
+    if (as_object(literal)->class_index == CLASS_INDEX_BLOCK) {
+        return literal;
+    }
+
+    // Creating the context may move the method (and its literals)
+    Value outer = context_for_frame(frame);
+    literal = as_object(frame->method->literals)->fields[index];
+
+    return block_new(literal, frame->receiver, outer);
+}
@@ -0,0 +1,63 @@
+// context.h - Block closures and lazily materialized contexts for Poplar2
+
+#ifndef POPLAR2_CONTEXT_H
+#define POPLAR2_CONTEXT_H
+
+#include "vm.h"
+
+// A block literal compiles to a Method of its own, kept in the enclosing
+// method's literals. The compiler works out which blocks refer to
+// their enclosing frames (outer variables, self, or a non-local return):
+//
+//   clean      nothing: the Block is built once, at compile time, and
+//              BC_PUSH_BLOCK pushes it as it is
+//   capturing  BC_PUSH_BLOCK makes a Block pointing at the frame's Context,
+//              which is created on the first such push
+//
+// A Context starts out holding only its frame's position, and blocks reach
+// the frame's own argument and local slots through it (BC_PUSH_OUTER,
+// BC_STORE_OUTER). Only when the frame returns are its variables copied
+// into the Context, so blocks that do not outlive their frame never have
+// their variables moved to the heap.
+//
+// Frames otherwise stay on the frame stack. Besides capturing blocks, only
+// thisContext (BC_PUSH_CONTEXT) and reflection on a context's sender
+// create Contexts, so plain sends never allocate.
+
+// The Context of a frame, created if it has none yet (may collect garbage)
+Value context_for_frame(Frame* frame);
+
+// The frame a context belongs to, or NULL once that frame has returned
+static inline Frame* context_frame(Context* context) {
+    return is_int(context->frame) ? (Frame*)(vm->stack_base + as_int(context->frame)) : NULL;
+}
+
+// Copy a returning frame's variables into its Context, if it has one
+void context_detach(Frame* frame);
+
+// The slot of variable 'index' (arguments, then locals) of a context's
+// frame while it runs, or of the context itself afterwards; NULL if out of
+// range
+Value* context_slot(Context* context, uint16_t index);
+
+// The Context 'level' lexical levels out from a block frame (1 is the
+// frame that created the block), or NULL if there is none
+Context* context_outer(Frame* frame, uint8_t level);
+
+// The frame a non-local return from a block frame returns from, or NULL if
+// that frame has already returned
+Frame* context_home_frame(Frame* frame);
+
+// Create a closure of a block Method
+Value block_new(Value method, Value receiver, Value outer);
+
+// Create the closure for block literal 'index' of a frame's method
+// (may collect garbage)
+Value block_for_frame(Frame* frame, uint16_t index);
+
+// The Block a block frame is running
+static inline Block* frame_block(Frame* frame) {
+    return (Block*)as_object(frame->arguments[-1]);
+}
+
+#endif /* POPLAR2_CONTEXT_H */
@@ -1,77 +1,464 @@
-// gc.c - Simple garbage collector implementation for Poplar2
+// gc.c - Generational garbage collector implementation for Poplar2
+
+// mmap's MAP_ANONYMOUS is not part of C99
+#define _DEFAULT_SOURCE
 
 #include "gc.h"
 #include "vm.h"
+#include "object.h"
+#include "method_cache.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#define USE_MMAP 1
+#else
+#define USE_MMAP 0
+#endif
+
+// Heap layout
+//
+// New objects are bump-allocated in a small nursery. When it fills up, a
+// scavenge copies the nursery objects that are still reachable into old
+// space, Cheney style, and empties the nursery:
+//
+//   nursery:   | new objects ...                | free |
+//   old space: | promoted and pretenured objects ... | free |
+//
+// The roots of a scavenge are the VM roots plus the remembered set: old
+// objects that had a nursery reference stored into them, as recorded by
+// gc_write_barrier. Everything that survives a scavenge is promoted.
+//
+// While the GC is disabled (the compiler holds Values it cannot see), nothing
+// may move, so when old space fills up it grows in place instead, into
+// address space reserved up to the maximum heap size (see gc_grow_in_place).
+//
+// When old space could not absorb another scavenge, a full collection marks
+// from the roots and moves the marked objects of both spaces, in address
+// order, to the bottom of old space. By default this is done in place by
+// sliding compaction (gc_compact); building with -DPOPLAR2_GC_EVACUATE
+// instead copies them into a freshly allocated old space (gc_evacuate),
+// which is simpler but needs twice the old space while it runs.
+//
+// Building with -DPOPLAR2_GC_MARK_SWEEP replaces all of this with a
+// non-moving heap of segregated free lists, swept lazily (see "Segregated
+// free lists" below).
+//
+// Full collections are paced by allocation volume: once as much has been
+// allocated in or promoted to old space since the last one as the target
+// live ratio leaves free (see GcConfig), the next scavenge becomes a full
+// collection instead. When the live data would exceed that ratio, the full
+// collection evacuates into a larger old space rather than compacting.
+//
+// While an object is being evacuated its header holds its new address, which
+// reads as format FORMAT_NONE; a real object never has that format.
+//
+// Object headers refer to classes by index, and the class table is a root,
+// so classes are never traced through their instances.
+//
+// Values hold object addresses in 30 bits, so the nursery and old space are
+// allocated below VALUE_ADDRESS_LIMIT (see gc_allocate_space).
+
+#define GC_MAX_ROOTS 32
+#define MARK_STACK_SIZE 256   // Objects waiting to be scanned
+#define COMPACT_BLOCK_SIZE 128 // Heap bytes per live_bitmap word (32 words)
+#define SPACE_HINT_START 0x04000000 // Lowest address heap spaces are mapped at (64MB)
+#define SPACE_HINT_STEP  0x01000000 // Distance between the addresses tried (16MB)
+
+// Leading fields of a Method that hold Values (name, holder, send_caches,
+// literals); the counts and bytecode after them are raw bytes
+#define METHOD_POINTER_FIELDS ((offsetof(Method, num_args) - sizeof(Object)) / sizeof(Value))
+
+// Nursery
+static char* nursery_start = NULL;
+static char* nursery_next = NULL;
+static char* nursery_end = NULL;
+
+// Old space
+static char* old_start = NULL;
+static char* old_next = NULL;
+static char* old_end = NULL;
+static char* old_limit = NULL;   // End of the address space old space can grow into in place
 
-// Simple bump allocator for now
-static void* heap_start = NULL;
-static void* heap_next = NULL;
-static void* heap_end = NULL;
+// Remembered set (old objects that may point into the nursery)
+static Object** remembered = NULL;
+static size_t remembered_count = 0;
+static size_t remembered_capacity = 0;
+
+// Extra roots registered by C code
+static Value* extra_roots[GC_MAX_ROOTS];
+static int extra_root_count = 0;
+
+// Nothing moves while this is non-zero
+static int disable_depth = 0;
+
+// Mark stack and what the current full collection has marked
+static Object* mark_stack[MARK_STACK_SIZE];
+static int mark_stack_top = 0;
+static bool mark_stack_overflowed = false;
+static size_t marked_objects = 0;
+static size_t marked_bytes = 0;
+
+// Heap configuration and pacing
+static GcConfig config = {HEAP_SIZE, HEAP_MAX_SIZE, HEAP_GROWTH_PERCENT, HEAP_TARGET_LIVE, GC_PAUSE_BUDGET_US};
+static size_t full_gc_budget = 0;        // Old-space bytes allowed before the next full GC
+static size_t allocated_since_full = 0;  // Old-space bytes allocated or promoted since
+
+// Mark-compact forwarding table (see gc_compact)
+static uint32_t* live_bitmap = NULL;
+static uint32_t* block_destination = NULL;
 
 // GC statistics
 static size_t total_allocated = 0;
-static size_t current_allocated = 0;
 static int collection_count = 0;
+static int scavenge_count = 0;
+
+static void gc_init_pages();
+static void gc_rescan_pages();
+
+// Heap configuration
+void gc_get_config(GcConfig* out) {
+    *out = config;
+}
+
+bool gc_configure(const GcConfig* new_config) {
+    if (new_config->initial_size < 2 * NURSERY_SIZE ||
+        new_config->max_size < new_config->initial_size ||
+        new_config->growth_percent <= 100 ||
+        new_config->target_live_percent < 1 || new_config->target_live_percent > 99) {
+        return false;
+    }
+
+    config = *new_config;
+
+    // Old space is a whole number of compaction blocks
+    config.initial_size &= ~(size_t)(COMPACT_BLOCK_SIZE - 1);
+    config.max_size &= ~(size_t)(COMPACT_BLOCK_SIZE - 1);
+    return true;
+}
+
+// Largest old space the heap may have
+static inline size_t gc_max_old_size() {
+    return config.max_size - (USE_FREE_LISTS ? 0 : NURSERY_SIZE);
+}
+
+// Allocate a heap space of 'size' bytes that Values can address, or answer
+// NULL if there is none
+//
+// malloc is no use on 64-bit hosts: glibc maps large blocks near the top of
+// the address space, and address space randomization can put even the data
+// segment above 1GB. So spaces are mapped at hinted low addresses, trying
+// one after another until the kernel takes a hint.
+static char* gc_allocate_space(size_t size) {
+#if USE_MMAP
+    for (uintptr_t hint = SPACE_HINT_START; hint + size <= VALUE_ADDRESS_LIMIT; hint += SPACE_HINT_STEP) {
+        void* space = mmap((void*)hint, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (space == MAP_FAILED) {
+            return NULL;
+        }
+        if ((uintptr_t)space + size <= VALUE_ADDRESS_LIMIT) {
+            return space;
+        }
+        munmap(space, size);
+    }
+    return NULL;
+#else
+    char* space = malloc(size);
+    if (space != NULL && (uintptr_t)space + size > VALUE_ADDRESS_LIMIT) {
+        free(space);
+        return NULL;
+    }
+    return space;
+#endif
+}
+
+// Allocate an old space of 'size' bytes and set 'limit' to how far it can
+// grow in place: with mmap, address space is reserved up to the maximum
+// heap size, which costs nothing until it is touched
+static char* gc_allocate_old_space(size_t size, char** limit) {
+    size_t reserve = USE_MMAP ? gc_max_old_size() : size;
+    char* space = reserve > size ? gc_allocate_space(reserve) : NULL;
+
+    if (space == NULL) {
+        reserve = size;
+        space = gc_allocate_space(size);
+    }
+
+    *limit = space != NULL ? space + reserve : NULL;
+    return space;
+}
+
+static void gc_free_space(char* space, size_t size) {
+    if (space == NULL) {
+        return;
+    }
+#if USE_MMAP
+    munmap(space, size);
+#else
+    (void)size;
+    free(space);
+#endif
+}
+
+// (Re)allocate the mark-compact forwarding table for the current old space
+static void gc_allocate_forwarding_table() {
+    if (USE_MARK_COMPACT) {
+        size_t blocks = (size_t)(old_end - old_start + NURSERY_SIZE) / COMPACT_BLOCK_SIZE;
+
+        free(live_bitmap);
+        free(block_destination);
+        live_bitmap = malloc(blocks * sizeof(uint32_t));
+        block_destination = malloc(blocks * sizeof(uint32_t));
+
+        if (live_bitmap == NULL || block_destination == NULL) {
+            fprintf(stderr, "Failed to allocate heap\n");
+            exit(1);
+        }
+    }
+}
 
 // Initialize GC
 void gc_init() {
-    // Allocate a fixed-size heap
-    size_t heap_size = HEAP_SIZE;
-    heap_start = malloc(heap_size);
+    // Allocate the nursery and old space (without a nursery, the whole heap
+    // is old space)
+    size_t nursery_size = USE_FREE_LISTS ? 0 : NURSERY_SIZE;
+    size_t old_size = config.initial_size - nursery_size;
+    old_start = gc_allocate_old_space(old_size, &old_limit);
 
-    if (heap_start == NULL) {
-        fprintf(stderr, "Failed to allocate heap\n");
+    if (nursery_size > 0) {
+        nursery_start = gc_allocate_space(nursery_size);
+        nursery_end = nursery_start + nursery_size;
+    }
+
+    if ((nursery_size > 0 && nursery_start == NULL) || old_start == NULL) {
+        fprintf(stderr, "Failed to allocate a %zu byte heap in the lowest %zuMB of memory\n",
+                config.initial_size, (size_t)(VALUE_ADDRESS_LIMIT >> 20));
         exit(1);
     }
 
-    heap_next = heap_start;
-    heap_end = (char*)heap_start + heap_size;
+    nursery_next = nursery_start;
+    old_next = old_start;
+    old_end = old_start + old_size;
+    full_gc_budget = old_size;
+    allocated_since_full = 0;
+
+    if (USE_FREE_LISTS) {
+        gc_init_pages();
+    }
+    gc_allocate_forwarding_table();
 
     // Store heap pointers in VM
-    vm->heap_start = heap_start;
-    vm->heap_next = heap_next;
-    vm->heap_end = heap_end;
+    vm->heap_start = old_start;
+    vm->heap_next = old_next;
+    vm->heap_end = old_end;
+    vm->nursery_start = nursery_start;
+    vm->nursery_end = nursery_end;
 
-    printf("GC initialized with heap size: %d bytes\n", heap_size);
+    if (DBUG) {
+        printf("GC initialized with heap size: %zu bytes\n", config.initial_size);
+    }
 }
 
-// Simple allocator - just bump the pointer
-void* gc_allocate(size_t size) {
-    // Align size to 4 bytes
-    size = (size + 3) & ~3;
+// Size in bytes of an object, header included
+static inline size_t gc_object_size(Object* obj) {
+    return sizeof(Object) + obj->size * sizeof(Value);
+}
 
-    // Check if we need to collect garbage
-    if ((char*)heap_next + size > (char*)heap_end) {
-        gc_collect();
+// Number of leading fields that hold Values; the rest are raw bytes
+static inline uint16_t gc_pointer_fields(Object* obj) {
+    switch (obj->format) {
+    case FORMAT_BYTES:
+        return 0; // Length, hash and characters
+    case FORMAT_METHOD:
+        return METHOD_POINTER_FIELDS;
+    default:
+        return obj->size;
+    }
+}
 
-        // If still not enough space, allocation fails
-        if ((char*)heap_next + size > (char*)heap_end) {
-            fprintf(stderr, "Out of memory: cannot allocate %d bytes\n", size);
-            exit(1);
+// Forwarding addresses
+static inline bool gc_is_forwarded(Object* obj) {
+    return obj->format == FORMAT_NONE;
+}
+
+static inline Object* gc_forwarding_address(Object* obj) {
+    return (Object*)(uintptr_t)obj->header;
+}
+
+static inline void gc_set_forwarding_address(Object* obj, Object* copy) {
+    obj->header = (uint32_t)(uintptr_t)copy;
+}
+
+// Visit every root slot
+static void gc_visit_roots(GcVisitor visit) {
+    visit(&vm->globals);
+
+    // Core classes
+    visit(&vm->class_Object);
+    visit(&vm->class_Class);
+    visit(&vm->class_Method);
+    visit(&vm->class_Array);
+    visit(&vm->class_String);
+    visit(&vm->class_Symbol);
+    visit(&vm->class_Integer);
+    visit(&vm->class_Block);
+    visit(&vm->class_StringBuilder);
+    visit(&vm->class_LargeInteger);
+    visit(&vm->class_Context);
+    visit(&vm->class_Association);
+    visit(&vm->class_Nil);
+    visit(&vm->class_True);
+    visit(&vm->class_False);
+
+    // Selectors of the special send bytecodes
+    for (int i = 0; i < SPECIAL_SELECTOR_COUNT; i++) {
+        visit(&vm->special_selectors[i]);
+    }
+
+    // Every class, by index
+    for (int i = 0; i < vm->class_count; i++) {
+        visit(&vm->class_table[i]);
+    }
+
+    // Interned symbols
+    symbol_table_visit(visit);
+
+    // Values held by C code
+    for (int i = 0; i < extra_root_count; i++) {
+        visit(extra_roots[i]);
+    }
+
+    // Stack frames
+    for (Frame* frame = vm->current_frame; frame != NULL; frame = frame->sender) {
+        visit(&frame->receiver);
+        visit(&frame->context);
+
+        // The bottom frame's receiver and arguments have no sender (read
+        // num_args first: once visited, frame->method may hold an address
+        // the method has not been moved to yet)
+        if (frame->sender == NULL) {
+            for (Value* slot = vm->stack_base; slot < frame->arguments + frame->method->num_args; slot++) {
+                visit(slot);
+            }
+        }
+
+        if (frame->method != NULL) {
+            Value method = make_object((Object*)frame->method);
+            visit(&method);
+            frame->method = (Method*)as_object(method);
+        }
+
+        // Locals and operands (a frame's arguments are part of its sender's
+        // operands)
+        for (Value* slot = frame->stack; slot < frame->stack_pointer; slot++) {
+            visit(slot);
         }
     }
+}
 
-    // Allocate memory
-    void* result = heap_next;
-    heap_next = (char*)heap_next + size;
+// Pause timing
 
-    // Update statistics
-    total_allocated += size;
-    current_allocated += size;
+// Microseconds of CPU time since 'start'
+static uint32_t gc_elapsed_us(clock_t start) {
+    return (uint32_t)((uint64_t)(clock() - start) * 1000000 / CLOCKS_PER_SEC);
+}
 
-    // Update VM heap pointer
-    vm->heap_next = heap_next;
+// Count a pause that began at 'start' in the VM's pause histogram
+static void gc_record_pause(clock_t start) {
+    uint32_t us = gc_elapsed_us(start);
+    int bucket = 0;
 
-    // Clear the allocated memory
-    memset(result, 0, size);
+    while (bucket < GC_PAUSE_BUCKETS - 1 && (1u << bucket) <= us) {
+        bucket++;
+    }
 
-    return result;
+    vm->gc_pauses[bucket]++;
+    if (us > vm->gc_pause_max_us) {
+        vm->gc_pause_max_us = us;
+    }
+}
+
+// Scavenging
+
+// Copy a nursery object into old space (once) and point the slot at the copy
+static void gc_scavenge_slot(Value* slot) {
+    if (!is_object(*slot)) {
+        return;
+    }
+
+    Object* obj = as_object(*slot);
+    if (!gc_in_nursery(obj)) {
+        return;
+    }
+
+    if (!gc_is_forwarded(obj)) {
+        size_t size = gc_object_size(obj);
+        Object* copy = (Object*)old_next;
+
+        memcpy(copy, obj, size);
+        old_next += size;
+        gc_set_forwarding_address(obj, copy);
+    }
+
+    *slot = make_object(gc_forwarding_address(obj));
+}
+
+static void gc_scavenge_fields(Object* obj) {
+    uint16_t count = gc_pointer_fields(obj);
+
+    for (uint16_t i = 0; i < count; i++) {
+        gc_scavenge_slot(&obj->fields[i]);
+    }
+}
+
+// Evacuate the live part of the nursery into old space
+//
+// The caller guarantees old space has room for the whole nursery.
+static void gc_scavenge() {
+    clock_t start = clock();
+    char* scan = old_next;
+    char* promoted = old_next;
+
+    gc_visit_roots(gc_scavenge_slot);
+
+    for (size_t i = 0; i < remembered_count; i++) {
+        remembered[i]->flags &= ~FLAG_REMEMBERED;
+        gc_scavenge_fields(remembered[i]);
+    }
+    remembered_count = 0;
+
+    // Copied objects may point at more nursery objects
+    while (scan < old_next) {
+        Object* obj = (Object*)scan;
+        gc_scavenge_fields(obj);
+        scan += gc_object_size(obj);
+    }
+
+    nursery_next = nursery_start;
+    vm->heap_next = old_next;
+    allocated_since_full += old_next - promoted;
+
+    // Only nursery objects have moved, and the method cache holds none
+
+    scavenge_count++;
+    vm->gc_minor_count = scavenge_count;
+    gc_record_pause(start);
 }
 
-// Mark an object as reachable
+// Full collection
+
+// Marking
+//
+// Marking is driven by an explicit stack of objects that are marked but
+// whose fields have not been scanned yet, so deep object graphs cannot
+// overflow the C stack. When the mark stack is full, an object is marked
+// but not pushed; once the stack drains, the heap is rescanned for marked
+// objects with unmarked children until no push was dropped.
+
+// Mark an object as reachable and queue it for scanning
 void gc_mark_object(void* object) {
     if (object == NULL) return;
 
@@ -82,158 +469,988 @@ void gc_mark_object(void* object) {
 
     // Mark the object
     obj->flags |= FLAG_GC_MARK;
+    marked_objects++;
+    marked_bytes += gc_object_size(obj);
 
-    // Mark class
-    if (is_object(obj->class)) {
-        gc_mark_object(as_object(obj->class));
+    // Strings and symbols have nothing to scan
+    if (gc_pointer_fields(obj) == 0) {
+        return;
     }
 
-    // Mark fields
-    for (int i = 0; i < obj->size; i++) {
-        Value value = obj->fields[i];
-        if (is_object(value)) {
-            gc_mark_object(as_object(value));
-        }
+    if (mark_stack_top < MARK_STACK_SIZE) {
+        mark_stack[mark_stack_top++] = obj;
+    } else {
+        mark_stack_overflowed = true;
     }
 }
 
-// Mark phase - mark all reachable objects
-static void gc_mark_roots() {
-    // Mark VM roots
-    for (int i = 0; i < MAX_GLOBALS; i++) {
-        if (is_object(vm->globals[i])) {
-            gc_mark_object(as_object(vm->globals[i]));
+// Mark everything an object refers to
+static void gc_mark_children(Object* obj) {
+    uint16_t count = gc_pointer_fields(obj);
+
+    for (uint16_t i = 0; i < count; i++) {
+        if (is_object(obj->fields[i])) {
+            gc_mark_object(as_object(obj->fields[i]));
         }
     }
+}
+
+static void gc_drain_mark_stack() {
+    while (mark_stack_top > 0) {
+        gc_mark_children(mark_stack[--mark_stack_top]);
+    }
+}
 
-    for (int i = 0; i < MAX_LITERALS; i++) {
-        if (is_object(vm->literals[i])) {
-            gc_mark_object(as_object(vm->literals[i]));
+static void gc_mark_slot(Value* slot) {
+    if (is_object(*slot)) {
+        gc_mark_object(as_object(*slot));
+        gc_drain_mark_stack();
+    }
+}
+
+// Scan the marked objects of [from, limit) for unmarked children
+static void gc_rescan_marked(char* from, char* limit) {
+    while (from < limit) {
+        Object* obj = (Object*)from;
+
+        if (obj->flags & FLAG_GC_MARK) {
+            gc_mark_children(obj);
+            gc_drain_mark_stack();
         }
+
+        from += gc_object_size(obj);
     }
+}
 
-    // Mark stack frames
-    Frame* frame = vm->current_frame;
-    while (frame != NULL) {
-        // Mark receiver
-        if (is_object(frame->receiver)) {
-            gc_mark_object(as_object(frame->receiver));
+// Drain the mark stack, rescanning the heap until no push was dropped
+static void gc_complete_marking() {
+    gc_drain_mark_stack();
+
+    while (mark_stack_overflowed) {
+        mark_stack_overflowed = false;
+        vm->gc_mark_overflows++;
+
+        if (USE_FREE_LISTS) {
+            gc_rescan_pages();
+        } else {
+            gc_rescan_marked(old_start, old_next);
+            gc_rescan_marked(nursery_start, nursery_next);
         }
+    }
 
-        // Mark method
-        if (frame->method != NULL) {
-            gc_mark_object((Object*)frame->method);
+    vm->gc_marked_objects += marked_objects;
+    vm->gc_marked_bytes += marked_bytes;
+}
+
+// Mark everything reachable from the roots
+static void gc_mark_phase() {
+    clock_t start = clock();
+
+    marked_objects = 0;
+    marked_bytes = 0;
+    mark_stack_overflowed = false;
+
+    gc_visit_roots(gc_mark_slot);
+    gc_complete_marking();
+
+    vm->gc_mark_time_us += gc_elapsed_us(start);
+}
+
+// Copy the marked objects of [from, limit) to 'to', leaving forwarding
+// addresses behind; returns the new end of the copies
+static char* gc_evacuate_marked(char* from, char* limit, char* to) {
+    while (from < limit) {
+        Object* obj = (Object*)from;
+        size_t size = gc_object_size(obj);
+
+        if (obj->flags & FLAG_GC_MARK) {
+            Object* copy = (Object*)to;
+
+            memcpy(copy, obj, size);
+            copy->flags &= ~(FLAG_GC_MARK | FLAG_REMEMBERED);
+            gc_set_forwarding_address(obj, copy);
+            to += size;
         }
 
-        // Mark stack values
-        Value* slot = frame->stack;
-        while (slot < frame->stack_pointer) {
-            if (is_object(*slot)) {
-                gc_mark_object(as_object(*slot));
-            }
-            slot++;
+        from += size;
+    }
+
+    return to;
+}
+
+static void gc_forward_slot(Value* slot) {
+    if (is_object(*slot) && gc_is_forwarded(as_object(*slot))) {
+        *slot = make_object(gc_forwarding_address(as_object(*slot)));
+    }
+}
+
+// Evacuating full collection: copy the marked objects of both spaces into
+// 'new_space', a fresh old space of 'new_size' bytes that can grow in place
+// up to 'new_limit', then free the old one
+static void gc_evacuate(char* new_space, size_t new_size, char* new_limit) {
+    // Copy phase: old space first, then the nursery, keeping address order
+    char* new_next = gc_evacuate_marked(old_start, old_next, new_space);
+    new_next = gc_evacuate_marked(nursery_start, nursery_next, new_next);
+
+    // Fix every reference to a moved object
+    gc_visit_roots(gc_forward_slot);
+
+    for (char* scan = new_space; scan < new_next; scan += gc_object_size((Object*)scan)) {
+        Object* obj = (Object*)scan;
+        uint16_t count = gc_pointer_fields(obj);
+
+        for (uint16_t i = 0; i < count; i++) {
+            gc_forward_slot(&obj->fields[i]);
         }
+    }
+
+    gc_free_space(old_start, old_limit - old_start);
+    old_start = new_space;
+    old_next = new_next;
+    old_end = new_space + new_size;
+    old_limit = new_limit;
+}
+
+// Sliding mark-compact
+//
+// Marked objects slide down to the bottom of old space in address order,
+// followed by the marked nursery objects, without a second heap. New
+// addresses are not stored in the objects (their headers are still needed) but come from a small side table, Lisp-2 style:
+//
+//   live_bitmap         one bit per heap word, set for every word of a
+//                       marked object
+//   block_destination   for each COMPACT_BLOCK_SIZE bytes of heap, the new
+//                       offset (from old_start) of its first live word
+//
+// so an object's new address is its block's destination plus the live
+// words before it in the block. Words of old space come first, then those
+// of the nursery. The table costs 1/16 of the heap.
+
+// Find the word index of a heap address (old space, then the nursery)
+static inline size_t gc_heap_word(const char* address) {
+    if (address >= nursery_start && address < nursery_end) {
+        return ((size_t)(old_end - old_start) + (size_t)(address - nursery_start)) / sizeof(Value);
+    }
+    return (size_t)(address - old_start) / sizeof(Value);
+}
 
-        frame = frame->sender;
+static inline int gc_popcount(uint32_t bits) {
+#if defined(__GNUC__)
+    return __builtin_popcount(bits);
+#else
+    int count = 0;
+    for (; bits != 0; bits &= bits - 1) {
+        count++;
     }
+    return count;
+#endif
+}
 
-    // Mark special values
-    if (is_object(vm->nil)) gc_mark_object(as_object(vm->nil));
-    if (is_object(vm->true_obj)) gc_mark_object(as_object(vm->true_obj));
-    if (is_object(vm->false_obj)) gc_mark_object(as_object(vm->false_obj));
+// New address of a marked object
+static inline Object* gc_compacted_address(Object* obj) {
+    size_t word = gc_heap_word((char*)obj);
+    uint32_t before = live_bitmap[word / 32] & ((1u << (word % 32)) - 1);
 
-    // Mark core classes
-    if (is_object(vm->class_Object)) gc_mark_object(as_object(vm->class_Object));
-    if (is_object(vm->class_Class)) gc_mark_object(as_object(vm->class_Class));
-    if (is_object(vm->class_Method)) gc_mark_object(as_object(vm->class_Method));
-    if (is_object(vm->class_Array)) gc_mark_object(as_object(vm->class_Array));
-    if (is_object(vm->class_String)) gc_mark_object(as_object(vm->class_String));
-    if (is_object(vm->class_Symbol)) gc_mark_object(as_object(vm->class_Symbol));
-    if (is_object(vm->class_Integer)) gc_mark_object(as_object(vm->class_Integer));
-    if (is_object(vm->class_Block)) gc_mark_object(as_object(vm->class_Block));
+    return (Object*)(old_start + block_destination[word / 32] + gc_popcount(before) * sizeof(Value));
 }
 
-// Sweep phase - free unreachable objects
-static void gc_sweep() {
-    // For a simple bump allocator, we just reset the heap
-    // This is a stop-the-world collector that copies all live objects
+// Set the live bits of the marked objects in [from, limit)
+static void gc_compact_map(char* from, char* limit) {
+    while (from < limit) {
+        Object* obj = (Object*)from;
+        size_t size = gc_object_size(obj);
 
-    // Create a temporary buffer to hold live objects
-    void* new_heap = malloc(HEAP_SIZE);
-    if (new_heap == NULL) {
-        fprintf(stderr, "Failed to allocate temporary heap for GC\n");
-        exit(1);
+        if (obj->flags & FLAG_GC_MARK) {
+            size_t first = gc_heap_word(from);
+            size_t last = first + size / sizeof(Value);
+
+            for (size_t word = first; word < last; word++) {
+                live_bitmap[word / 32] |= 1u << (word % 32);
+            }
+        }
+
+        from += size;
     }
+}
 
-    void* new_next = new_heap;
-    size_t new_allocated = 0;
+static void gc_compact_slot(Value* slot) {
+    if (is_object(*slot)) {
+        *slot = make_object(gc_compacted_address(as_object(*slot)));
+    }
+}
 
-    // Copy all marked objects
-    Object* obj = (Object*)heap_start;
-    while ((void*)obj < heap_next) {
-        size_t size = sizeof(Object) + obj->size * sizeof(Value);
-        size = (size + 3) & ~3; // Align to 4 bytes
+// Point the fields of the marked objects in [from, limit) at the new addresses
+static void gc_compact_fields(char* from, char* limit) {
+    while (from < limit) {
+        Object* obj = (Object*)from;
 
         if (obj->flags & FLAG_GC_MARK) {
-            // Copy the object
-            memcpy(new_next, obj, size);
+            uint16_t count = gc_pointer_fields(obj);
 
-            // Unmark for next collection
-            ((Object*)new_next)->flags &= ~FLAG_GC_MARK;
+            for (uint16_t i = 0; i < count; i++) {
+                gc_compact_slot(&obj->fields[i]);
+            }
+        }
 
-            // Move to next position in new heap
-            new_next = (char*)new_next + size;
-            new_allocated += size;
+        from += gc_object_size(obj);
+    }
+}
+
+// Move the marked objects of [from, limit) to their new addresses, which are
+// never above their current ones, and return the new end of old space
+static char* gc_compact_move(char* from, char* limit, char* to) {
+    while (from < limit) {
+        Object* obj = (Object*)from;
+        size_t size = gc_object_size(obj);
+
+        if (obj->flags & FLAG_GC_MARK) {
+            Object* copy = gc_compacted_address(obj);
+
+            obj->flags &= ~(FLAG_GC_MARK | FLAG_REMEMBERED);
+            memmove(copy, obj, size);
+            to = (char*)copy + size;
         }
 
-        // Move to next object in old heap
-        obj = (Object*)((char*)obj + size);
+        from += size;
     }
 
-    // Free old heap and use the new one
-    free(heap_start);
-    heap_start = new_heap;
-    heap_next = new_next;
-    heap_end = (char*)heap_start + HEAP_SIZE;
+    return to;
+}
+
+static void gc_compact() {
+    size_t blocks = (size_t)(old_end - old_start + NURSERY_SIZE) / COMPACT_BLOCK_SIZE;
+
+    // Compute new addresses
+    memset(live_bitmap, 0, blocks * sizeof(uint32_t));
+    gc_compact_map(old_start, old_next);
+    gc_compact_map(nursery_start, nursery_next);
+
+    uint32_t destination = 0;
+    for (size_t block = 0; block < blocks; block++) {
+        block_destination[block] = destination;
+        destination += gc_popcount(live_bitmap[block]) * sizeof(Value);
+    }
+
+    // Fix every reference while the objects are still in place
+    gc_visit_roots(gc_compact_slot);
+    gc_compact_fields(old_start, old_next);
+    gc_compact_fields(nursery_start, nursery_next);
+
+    // Slide old space down, then bring in the nursery survivors
+    char* new_next = gc_compact_move(old_start, old_next, old_start);
+    old_next = gc_compact_move(nursery_start, nursery_next, new_next);
+}
+
+// Pace the next full collection: allow as much allocation as the target
+// live ratio leaves free (at least a nursery's worth)
+static void gc_pace(size_t live) {
+    full_gc_budget = live / config.target_live_percent * (100 - config.target_live_percent);
+    if (full_gc_budget < NURSERY_SIZE) {
+        full_gc_budget = NURSERY_SIZE;
+    }
+    allocated_since_full = 0;
+}
+
+// Size old space should have to hold 'needed' bytes at the target live
+// ratio: the current size if that is enough, otherwise grown by at least
+// the growth factor (but not beyond the maximum heap size)
+static size_t gc_wanted_old_size(size_t needed) {
+    size_t old_size = old_end - old_start;
+    size_t wanted = needed / config.target_live_percent * 100;
+
+    if (wanted <= old_size) {
+        return old_size;
+    }
+
+    size_t grown = old_size / 100 * config.growth_percent;
+    if (wanted < grown) {
+        wanted = grown;
+    }
+    if (wanted > gc_max_old_size()) {
+        wanted = gc_max_old_size();
+    }
+
+    return (wanted + COMPACT_BLOCK_SIZE - 1) & ~(size_t)(COMPACT_BLOCK_SIZE - 1);
+}
+
+// Full collection that leaves room for a 'request' byte allocation in old
+// space if it can, growing the heap when the live data needs it
+static void gc_full_collection(size_t request) {
+    if (disable_depth > 0) {
+        return;
+    }
+
+    clock_t start = clock();
+    size_t old_size = old_end - old_start;
+
+    // Mark phase
+    gc_mark_phase();
+
+    // Grow by evacuating into a larger old space; if there is no memory for
+    // one, carry on in the current space as long as the live data fits
+    size_t new_size = gc_wanted_old_size(marked_bytes + request);
+    char* new_space = NULL;
+    char* new_limit = NULL;
+
+    if (new_size > old_size) {
+        new_space = gc_allocate_old_space(new_size, &new_limit);
+    }
+
+    if (new_space != NULL) {
+        gc_evacuate(new_space, new_size, new_limit);
+        gc_allocate_forwarding_table();
+        vm->gc_heap_grows++;
+    } else if (marked_bytes > old_size) {
+        fprintf(stderr, "Out of memory: %zu bytes live\n", marked_bytes);
+        exit(1);
+    } else if (USE_MARK_COMPACT) {
+        gc_compact();
+    } else {
+        new_space = gc_allocate_old_space(old_size, &new_limit);
+        if (new_space == NULL) {
+            fprintf(stderr, "Failed to allocate old space for GC\n");
+            exit(1);
+        }
+        gc_evacuate(new_space, old_size, new_limit);
+    }
+
+    gc_pace(old_next - old_start);
+
+    // The nursery and remembered set are empty
+    nursery_next = nursery_start;
+    remembered_count = 0;
 
     // Update VM heap pointers
-    vm->heap_start = heap_start;
-    vm->heap_next = heap_next;
-    vm->heap_end = heap_end;
+    vm->heap_start = old_start;
+    vm->heap_next = old_next;
+    vm->heap_end = old_end;
+
+    // Live objects have moved, so cached addresses are stale
+    method_cache_flush();
 
     // Update statistics
-    current_allocated = new_allocated;
+    collection_count++;
+    vm->gc_count = collection_count;
+    gc_record_pause(start);
+}
+
+// Segregated free lists
+//
+// In the non-moving mode (-DPOPLAR2_GC_MARK_SWEEP) there is no nursery: the
+// whole heap is divided into PAGE_SIZE pages, each holding cells of a
+// single size class, and objects never move. The small size classes fit
+// objects of 0 to 8 fields exactly; larger ones round up (strings,
+// methods). Objects bigger than MAX_CELL_SIZE get a run of whole pages.
+//
+// A free cell's header holds the next free cell of its size class, like a
+// forwarding address, so live and free cells can be told apart by format
+// when a page is walked.
+//
+// A full collection only marks. Pages are then swept lazily: allocating
+// from an empty free list sweeps the next unswept page of that size class,
+// and a page left with no live cells goes back to the pool of free pages.
+// Whatever is still unswept is swept before the next marking, or when the
+// pool runs dry. When a collection cannot make room for an allocation, the
+// heap grows in place (see gc_grow_in_place).
+
+#define PAGE_SIZE 1024
+#define MAX_CELL_SIZE 512
+#define NUM_SIZE_CLASSES 19
+
+// Page kinds
+#define PAGE_FREE 0        // In the pool
+#define PAGE_CELLS 1       // Cells of one size class
+#define PAGE_LARGE 2       // First page of a large object's run
+#define PAGE_LARGE_TAIL 3  // Rest of the run
+
+typedef struct {
+    uint8_t kind;
+    uint8_t size_class;
+    bool swept;            // Reclaimed since the last marking
+    uint16_t run;          // Pages in a large object's run
+} PageInfo;
+
+#define CELL_SIZE(fields) (sizeof(Object) + (fields) * sizeof(Value))
+
+static const uint16_t cell_sizes[NUM_SIZE_CLASSES] = {
+    CELL_SIZE(0), CELL_SIZE(1), CELL_SIZE(2), CELL_SIZE(3), CELL_SIZE(4),  // Objects of 0..8 fields
+    CELL_SIZE(5), CELL_SIZE(6), CELL_SIZE(7), CELL_SIZE(8),
+    48, 64, 80, 96, 128, 160, 192, 256, 320, 512
+};
+
+static PageInfo* pages = NULL;
+static size_t page_count = 0;
+static Object* free_lists[NUM_SIZE_CLASSES];
+static size_t sweep_cursors[NUM_SIZE_CLASSES];        // Next page to try sweeping
+static uint8_t size_class_of[MAX_CELL_SIZE / 4 + 1];  // Indexed by size / 4
+
+static inline char* gc_page_address(size_t page) {
+    return old_start + page * PAGE_SIZE;
+}
+
+static inline Object* gc_next_free_cell(Object* cell) {
+    return (Object*)(uintptr_t)cell->header;
+}
+
+static inline void gc_link_free_cell(Object* cell, Object* next) {
+    cell->header = (uint32_t)(uintptr_t)next;
+}
+
+static void gc_init_pages() {
+    page_count = (size_t)(old_end - old_start) / PAGE_SIZE;
+    pages = calloc(page_count, sizeof(PageInfo));
+    if (pages == NULL) {
+        fprintf(stderr, "Failed to allocate heap\n");
+        exit(1);
+    }
+
+    uint8_t size_class = 0;
+    for (size_t words = 0; words <= MAX_CELL_SIZE / 4; words++) {
+        while (cell_sizes[size_class] < words * 4) {
+            size_class++;
+        }
+        size_class_of[words] = size_class;
+    }
+}
+
+// Sweep a page of cells: live cells are unmarked and dead ones go on the
+// free list, unless nothing survived and the page can go back to the pool
+static void gc_sweep_cells(size_t page) {
+    uint8_t size_class = pages[page].size_class;
+    size_t cell_size = cell_sizes[size_class];
+    char* cell = gc_page_address(page);
+    char* end = cell + PAGE_SIZE / cell_size * cell_size;
+    Object* head = free_lists[size_class];
+    bool any_live = false;
+
+    for (; cell < end; cell += cell_size) {
+        Object* obj = (Object*)cell;
+
+        if (obj->format != FORMAT_NONE && (obj->flags & FLAG_GC_MARK)) {
+            obj->flags &= ~FLAG_GC_MARK;
+            any_live = true;
+        } else {
+            gc_link_free_cell(obj, head);
+            head = obj;
+        }
+    }
+
+    pages[page].swept = true;
+
+    if (any_live) {
+        free_lists[size_class] = head;
+    } else {
+        pages[page].kind = PAGE_FREE;
+    }
+}
+
+// Sweep a large object's run, returning it to the pool if the object died
+static void gc_sweep_large(size_t page) {
+    Object* obj = (Object*)gc_page_address(page);
+
+    pages[page].swept = true;
+
+    if (obj->flags & FLAG_GC_MARK) {
+        obj->flags &= ~FLAG_GC_MARK;
+    } else {
+        for (size_t i = 0; i < pages[page].run; i++) {
+            pages[page + i].kind = PAGE_FREE;
+        }
+    }
+}
+
+// Finish the lazy sweep
+static void gc_sweep_all() {
+    for (size_t page = 0; page < page_count; page++) {
+        if (pages[page].swept) {
+            continue;
+        }
+
+        if (pages[page].kind == PAGE_CELLS) {
+            gc_sweep_cells(page);
+        } else if (pages[page].kind == PAGE_LARGE) {
+            gc_sweep_large(page);
+        }
+    }
+
+    for (int i = 0; i < NUM_SIZE_CLASSES; i++) {
+        sweep_cursors[i] = page_count;
+    }
+}
+
+static bool gc_find_free_pages(size_t count, size_t* first) {
+    size_t run = 0;
+
+    for (size_t page = 0; page < page_count; page++) {
+        run = pages[page].kind == PAGE_FREE ? run + 1 : 0;
+
+        if (run == count) {
+            *first = page + 1 - count;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Take a run of 'count' free pages, finishing the sweep if there is none
+static bool gc_take_pages(size_t count, size_t* first) {
+    if (gc_find_free_pages(count, first)) {
+        return true;
+    }
+
+    gc_sweep_all();
+    return gc_find_free_pages(count, first);
+}
+
+// Refill an empty free list: sweep the next unswept page of the size class,
+// or carve up a fresh page
+static bool gc_refill_free_list(uint8_t size_class) {
+    while (sweep_cursors[size_class] < page_count) {
+        size_t page = sweep_cursors[size_class]++;
+
+        if (pages[page].kind == PAGE_CELLS && pages[page].size_class == size_class &&
+            !pages[page].swept) {
+            gc_sweep_cells(page);
+
+            if (free_lists[size_class] != NULL) {
+                return true;
+            }
+        }
+    }
+
+    size_t page;
+    if (!gc_take_pages(1, &page)) {
+        return false;
+    }
+
+    pages[page].kind = PAGE_CELLS;
+    pages[page].size_class = size_class;
+    pages[page].swept = true;
+
+    // Every cell is free; the list keeps them in address order
+    size_t cell_size = cell_sizes[size_class];
+    char* start = gc_page_address(page);
+    Object* head = free_lists[size_class];
+
+    for (size_t i = PAGE_SIZE / cell_size; i > 0; i--) {
+        Object* cell = (Object*)(start + (i - 1) * cell_size);
+        gc_link_free_cell(cell, head);
+        head = cell;
+    }
+
+    free_lists[size_class] = head;
+    return true;
+}
+
+// Allocate a cell, or a run of pages for a large object; NULL if the heap is
+// full
+static void* gc_allocate_cell(size_t size) {
+    if (size <= MAX_CELL_SIZE) {
+        uint8_t size_class = size_class_of[size / 4];
+
+        if (free_lists[size_class] == NULL && !gc_refill_free_list(size_class)) {
+            return NULL;
+        }
+
+        Object* cell = free_lists[size_class];
+        free_lists[size_class] = gc_next_free_cell(cell);
+        allocated_since_full += cell_sizes[size_class];
+        return cell;
+    }
+
+    size_t run = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+    size_t first;
+
+    if (!gc_take_pages(run, &first)) {
+        return NULL;
+    }
+
+    pages[first].kind = PAGE_LARGE;
+    pages[first].swept = true;
+    pages[first].run = (uint16_t)run;
+    for (size_t i = 1; i < run; i++) {
+        pages[first + i].kind = PAGE_LARGE_TAIL;
+    }
+
+    allocated_since_full += run * PAGE_SIZE;
+    return gc_page_address(first);
+}
+
+// Scan the marked objects on all pages for unmarked children
+static void gc_rescan_pages() {
+    for (size_t page = 0; page < page_count; page++) {
+        if (pages[page].kind == PAGE_CELLS) {
+            size_t cell_size = cell_sizes[pages[page].size_class];
+            char* cell = gc_page_address(page);
+            char* end = cell + PAGE_SIZE / cell_size * cell_size;
+
+            for (; cell < end; cell += cell_size) {
+                Object* obj = (Object*)cell;
+
+                if (obj->format != FORMAT_NONE && (obj->flags & FLAG_GC_MARK)) {
+                    gc_mark_children(obj);
+                    gc_drain_mark_stack();
+                }
+            }
+        } else if (pages[page].kind == PAGE_LARGE) {
+            Object* obj = (Object*)gc_page_address(page);
+
+            if (obj->flags & FLAG_GC_MARK) {
+                gc_mark_children(obj);
+                gc_drain_mark_stack();
+            }
+        }
+    }
+}
+
+// Incremental marking
+//
+// With a pause budget configured, the non-moving heap is marked a step at a
+// time. A cycle starts when the allocation budget is spent: the last sweep
+// is finished and the roots are shaded (marked and queued). After that,
+// every MARK_STEP_BYTES of allocation scans queued objects until the pause
+// budget runs out. Once the queue is empty, the roots are marked again (the
+// frame stack and the globals table are written without barriers) along with the
+// objects allocated during the cycle, and the heap is left to be swept.
+//
+// Marked objects are grey while queued and black once scanned; the rest
+// are white. No black object may point at a white one:
+//
+// - gc_write_barrier shades whatever is stored into a marked object
+// - objects allocated during the cycle are marked at once, and remembered
+//   so the fields C code initializes without barriers are scanned at the
+//   end (see gc_remember)
+
+#define MARK_STEP_BYTES 1024  // Allocation between marking steps
+
+static size_t allocated_since_step = 0;
+
+// Shade a root without scanning it yet
+static void gc_shade_slot(Value* slot) {
+    if (is_object(*slot)) {
+        gc_mark_object(as_object(*slot));
+    }
+}
+
+static void gc_start_marking() {
+    clock_t start = clock();
+
+    gc_sweep_all();
+
+    marked_objects = 0;
+    marked_bytes = 0;
+    mark_stack_overflowed = false;
+    allocated_since_step = 0;
+    vm->gc_marking = true;
+
+    gc_visit_roots(gc_shade_slot);
+
+    vm->gc_mark_time_us += gc_elapsed_us(start);
+    gc_record_pause(start);
+}
+
+// Mark the roots again and everything allocated during the cycle
+static void gc_finish_marking() {
+    gc_visit_roots(gc_mark_slot);
+
+    for (size_t i = 0; i < remembered_count; i++) {
+        remembered[i]->flags &= ~FLAG_REMEMBERED;
+        gc_mark_children(remembered[i]);
+        gc_drain_mark_stack();
+    }
+    remembered_count = 0;
+
+    gc_complete_marking();
+    vm->gc_marking = false;
+}
+
+static void gc_mark_sweep_collection();
+
+// Scan queued objects until the pause budget is spent
+static void gc_mark_step() {
+    clock_t start = clock();
+    clock_t limit = start + (clock_t)((uint64_t)config.pause_budget_us * CLOCKS_PER_SEC / 1000000);
+    int scanned = 0;
+
+    allocated_since_step = 0;
+
+    while (mark_stack_top > 0) {
+        gc_mark_children(mark_stack[--mark_stack_top]);
+
+        if (++scanned % 32 == 0 && clock() >= limit) {
+            break;
+        }
+    }
+
+    vm->gc_mark_time_us += gc_elapsed_us(start);
+    gc_record_pause(start);
+
+    // Nothing is freed while C code holds Values the GC cannot see
+    if (mark_stack_top == 0 && disable_depth == 0) {
+        gc_mark_sweep_collection();
+    }
+}
+
+// Non-moving full collection: finish the last sweep and mark (or finish the
+// incremental marking in progress), then leave every page to be swept
+// lazily
+static void gc_mark_sweep_collection() {
+    if (disable_depth > 0) {
+        return;
+    }
+
+    clock_t start = clock();
+
+    if (vm->gc_marking) {
+        gc_finish_marking();
+        vm->gc_mark_time_us += gc_elapsed_us(start);
+    } else {
+        gc_sweep_all();
+        gc_mark_phase();
+    }
+
+    for (size_t page = 0; page < page_count; page++) {
+        pages[page].swept = false;
+    }
+    for (int i = 0; i < NUM_SIZE_CLASSES; i++) {
+        free_lists[i] = NULL;
+        sweep_cursors[i] = 0;
+    }
+
+    gc_pace(marked_bytes);
+
+    // Dead methods and classes may be replaced at the same addresses
+    method_cache_flush();
+
+    collection_count++;
+    vm->gc_count = collection_count;
+    vm->heap_next = old_start + marked_bytes;
+    gc_record_pause(start);
 }
 
 // Run a full garbage collection cycle
 void gc_collect() {
-    size_t before = current_allocated;
+    if (USE_FREE_LISTS) {
+        gc_mark_sweep_collection();
+    } else {
+        gc_full_collection(0);
+    }
+}
 
-    // Mark phase
-    gc_mark_roots();
+// Allocation
+
+// Grow old space in place, up to old_limit, to make room for a 'request'
+// byte allocation. This is for while the GC is disabled, when nothing may
+// move, so neither a full collection nor evacuating into a larger space can
+// make room; and for the free-list heap, which has no other way to grow.
+// Answers false if the reservation is used up.
+static bool gc_grow_in_place(size_t request) {
+    size_t unit = USE_FREE_LISTS ? PAGE_SIZE : COMPACT_BLOCK_SIZE;
+    size_t old_size = old_end - old_start;
+    size_t needed = (USE_FREE_LISTS ? old_size : (size_t)(old_next - old_start)) + request;
+    size_t new_size = old_size / 100 * config.growth_percent;
+    size_t limit = (size_t)(old_limit - old_start) / unit * unit;
+
+    if (new_size < needed) {
+        new_size = needed;
+    }
+    new_size = (new_size + unit - 1) / unit * unit;
+    if (new_size > limit) {
+        new_size = limit;
+    }
+    if (new_size < needed || new_size <= old_size) {
+        return false;
+    }
+
+    if (USE_FREE_LISTS) {
+        // The new pages join the pool
+        size_t new_count = new_size / PAGE_SIZE;
+        PageInfo* new_pages = realloc(pages, new_count * sizeof(PageInfo));
+        if (new_pages == NULL) {
+            return false;
+        }
+        memset(new_pages + page_count, 0, (new_count - page_count) * sizeof(PageInfo));
+        pages = new_pages;
+        page_count = new_count;
+    }
+
+    old_end = old_start + new_size;
+    vm->heap_end = old_end;
+    gc_allocate_forwarding_table();
+    vm->gc_heap_grows++;
+    return true;
+}
+
+// Bump-allocate in old space, collecting if it is full or the allocation
+// budget is spent (or growing in place if the GC is disabled)
+static void* gc_allocate_old(size_t size) {
+    if (old_next + size > old_end || allocated_since_full >= full_gc_budget) {
+        gc_full_collection(size);
+
+        // If still not enough space, allocation fails
+        if (old_next + size > old_end && !(disable_depth > 0 && gc_grow_in_place(size))) {
+            fprintf(stderr, "Out of memory: cannot allocate %zu bytes\n", size);
+            exit(1);
+        }
+    }
 
-    // Sweep phase
-    gc_sweep();
+    void* result = old_next;
+    old_next += size;
+    vm->heap_next = old_next;
+    allocated_since_full += size;
+
+    return result;
+}
+
+// Bytes of the nursery that may be filled before the next scavenge: all of
+// it, unless old space has less room than that left for what survives
+static inline size_t gc_nursery_room() {
+    size_t old_free = old_end - old_next;
+    return old_free < NURSERY_SIZE ? old_free : NURSERY_SIZE;
+}
+
+// Allocate memory: new objects go to the nursery, large ones (and everything
+// while the GC is disabled) straight to old space
+void* gc_allocate(size_t size) {
+    void* result;
+
+    // Align size to 4 bytes
+    size = (size + 3) & ~3;
+
+    if (USE_FREE_LISTS) {
+        if (vm->gc_marking) {
+            allocated_since_step += size;
+            if (allocated_since_step >= MARK_STEP_BYTES) {
+                gc_mark_step();
+            }
+        } else if (allocated_since_full >= full_gc_budget && disable_depth == 0) {
+            if (config.pause_budget_us > 0) {
+                gc_start_marking();
+            } else {
+                gc_collect();
+            }
+        }
+
+        result = gc_allocate_cell(size);
+        if (result == NULL) {
+            gc_collect();
+            result = gc_allocate_cell(size);
+        }
+        if (result == NULL && gc_grow_in_place(size)) {
+            result = gc_allocate_cell(size);
+        }
+        if (result == NULL) {
+            fprintf(stderr, "Out of memory: cannot allocate %zu bytes\n", size);
+            exit(1);
+        }
+    } else if (disable_depth > 0 || size > NURSERY_SIZE / 4) {
+        result = gc_allocate_old(size);
+    } else {
+        // Only as much of the nursery is used as old space could take if
+        // all of it survived, so that a scavenge can always promote
+        if (nursery_next + size > nursery_start + gc_nursery_room()) {
+            size_t nursery_used = nursery_next - nursery_start;
+            if (nursery_used <= (size_t)(old_end - old_next) &&
+                allocated_since_full < full_gc_budget) {
+                gc_scavenge();
+            }
+
+            // A full collection promotes only the survivors, which it
+            // counts as live, so it is asked for room for this object alone
+            if (nursery_next + size > nursery_start + gc_nursery_room()) {
+                gc_full_collection(size);
+            }
+            if (nursery_next + size > nursery_start + gc_nursery_room()) {
+                fprintf(stderr, "Out of memory: cannot allocate %zu bytes\n", size);
+                exit(1);
+            }
+        }
+
+        result = nursery_next;
+        nursery_next += size;
+    }
 
     // Update statistics
-    collection_count++;
-    vm->gc_count = collection_count;
-    vm->allocated = current_allocated;
+    total_allocated += size;
+    vm->allocated = total_allocated;
+
+    // Clear the allocated memory
+    memset(result, 0, size);
 
-    printf("GC #%d: collected %zu bytes (from %zu to %zu) next: %p\n",
-           collection_count,
-           before - current_allocated,
-           before,
-           current_allocated,
-           heap_next);
+    return result;
+}
+
+// Keep objects still while C code holds unregistered Values
+void gc_disable() {
+    disable_depth++;
+}
+
+void gc_enable() {
+    disable_depth--;
+}
+
+// Register a C variable as an extra root
+void gc_push_root(Value* slot) {
+    if (extra_root_count >= GC_MAX_ROOTS) {
+        fprintf(stderr, "Too many GC roots registered\n");
+        exit(1);
+    }
+    extra_roots[extra_root_count++] = slot;
+}
+
+void gc_pop_roots(int count) {
+    extra_root_count -= count;
+}
+
+// Add an old object to the remembered set
+void gc_remember(Object* object) {
+    // Without a nursery, only objects allocated during incremental marking
+    // are remembered: they are allocated black (see gc_start_marking)
+    if (USE_FREE_LISTS) {
+        if (!vm->gc_marking) {
+            return;
+        }
+
+        object->flags |= FLAG_GC_MARK;
+        marked_objects++;
+        marked_bytes += gc_object_size(object);
+    }
+
+    if (remembered_count == remembered_capacity) {
+        size_t new_capacity = remembered_capacity ? remembered_capacity * 2 : 64;
+        Object** new_set = realloc(remembered, new_capacity * sizeof(Object*));
+
+        if (new_set == NULL) {
+            fprintf(stderr, "Failed to grow remembered set\n");
+            exit(1);
+        }
+
+        remembered = new_set;
+        remembered_capacity = new_capacity;
+    }
+
+    object->flags |= FLAG_REMEMBERED;
+    remembered[remembered_count++] = object;
 }
 
 // Clean up GC resources
 void gc_cleanup() {
-    if (heap_start != NULL) {
-        free(heap_start);
-        heap_start = NULL;
-        heap_next = NULL;
-        heap_end = NULL;
-    }
+    gc_free_space(nursery_start, nursery_end - nursery_start);
+    gc_free_space(old_start, old_limit - old_start);
+    free(remembered);
+    free(live_bitmap);
+    free(block_destination);
+    free(pages);
+
+    nursery_start = nursery_next = nursery_end = NULL;
+    old_start = old_next = old_end = old_limit = NULL;
+    remembered = NULL;
+    live_bitmap = block_destination = NULL;
+    pages = NULL;
+    page_count = 0;
+    remembered_count = remembered_capacity = 0;
+
+    vm->heap_start = vm->heap_next = vm->heap_end = NULL;
+    vm->nursery_start = vm->nursery_end = NULL;
 }
@@ -1,9 +1,33 @@
-// gc.h - Simple garbage collector for Poplar2
+// gc.h - Generational garbage collector for Poplar2
 
 #ifndef POPLAR2_GC_H
 #define POPLAR2_GC_H
 
 #include <stddef.h>
+#include "vm.h"
+
+// Called with the address of every root slot during a collection
+typedef void (*GcVisitor)(Value* slot);
+
+// Heap configuration, fixed once gc_init has run
+//
+// After each full collection the heap is sized so that the live data fills
+// at most target_live_percent of old space, growing by growth_percent at a
+// time up to max_size. The next full collection is due once as much has been
+// allocated in (or promoted to) old space as that ratio leaves free.
+typedef struct {
+    size_t initial_size;          // Bytes of heap to start with, nursery included
+    size_t max_size;              // Bytes the heap may grow to
+    uint16_t growth_percent;      // Size after growing, relative to before (> 100)
+    uint8_t target_live_percent;  // Live share of old space to aim for (1..99)
+    uint32_t pause_budget_us;     // Longest incremental marking step, or 0 to
+                                  // mark all at once (non-moving heap only)
+} GcConfig;
+
+// Read and replace the heap configuration (before gc_init); gc_configure
+// returns false, changing nothing, if the configuration is invalid
+void gc_get_config(GcConfig* config);
+bool gc_configure(const GcConfig* config);
 
 // Initialize the garbage collector
 void gc_init();
@@ -11,13 +35,52 @@ void gc_init();
 // Allocate memory that will be managed by the GC
 void* gc_allocate(size_t size);
 
-// Run the garbage collector
+// Run a full (major) garbage collection cycle
 void gc_collect();
 
-// Mark an object as reachable (during GC)
+// Mark an object as reachable and queue it for scanning (during GC)
 void gc_mark_object(void* object);
 
+// Keep objects still while C code holds Values the GC cannot see (bootstrap,
+// compilation). Allocations go straight to old space until re-enabled.
+void gc_disable();
+void gc_enable();
+
+// Register the address of a C variable holding a Value as an extra root, so
+// it is updated when objects move. Pop in reverse order of pushing.
+void gc_push_root(Value* slot);
+void gc_pop_roots(int count);
+
+// Add an old object to the remembered set (see gc_write_barrier)
+void gc_remember(Object* object);
+
 // Clean up the garbage collector
 void gc_cleanup();
 
-#endif /* POPLAR2_GC_H */
\ No newline at end of file
+// Whether an address lies in the nursery
+static inline bool gc_in_nursery(const void* address) {
+    return (const char*)address >= (const char*)vm->nursery_start &&
+           (const char*)address < (const char*)vm->nursery_end;
+}
+
+// Write barrier: call when storing 'value' into a field of 'object' (other
+// than by initializing a fresh object), so the old-to-young references the
+// nursery scavenger needs are recorded
+static inline void gc_write_barrier(Object* object, Value value) {
+    // The non-moving heap has no nursery, but incremental marking must not
+    // let a marked object point at an unmarked one
+    if (USE_FREE_LISTS) {
+        if (vm->gc_marking && (object->flags & FLAG_GC_MARK) && is_object(value) &&
+            !(as_object(value)->flags & FLAG_GC_MARK)) {
+            gc_mark_object(as_object(value));
+        }
+        return;
+    }
+
+    if (is_object(value) && gc_in_nursery(as_object(value)) &&
+        !gc_in_nursery(object) && !(object->flags & FLAG_REMEMBERED)) {
+        gc_remember(object);
+    }
+}
+
+#endif /* POPLAR2_GC_H */
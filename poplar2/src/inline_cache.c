@@ -0,0 +1,189 @@
+// inline_cache.c - Per-send-site inline caches for Poplar2
+
+#include "inline_cache.h"
+#include "interpreter.h"
+#include "method_cache.h"
+#include "object.h"
+#include "gc.h"
+#include <stdio.h>
+
+// Allocate the caches for a method with 'num_sites' send sites
+void inline_cache_init(Method* method, uint16_t num_sites) {
+    method->send_caches = num_sites > 0 ? array_new(2 * num_sites) : vm->nil;
+    method->cache_epoch = vm->cache_epoch;
+}
+
+// Forget everything cached by a method's send sites
+void inline_cache_reset(Method* method) {
+    if (is_object(method->send_caches)) {
+        Object* caches = as_object(method->send_caches);
+
+        for (uint16_t i = 0; i < caches->size; i++) {
+            caches->fields[i] = vm->nil;
+        }
+    }
+
+    method->cache_epoch = vm->cache_epoch;
+}
+
+// Slow path: look the send up and update the site's cache
+//
+// A monomorphic site that sees a second class becomes polymorphic, and a
+// polymorphic site that would need more than IC_PIC_SIZE entries gives up
+// and goes megamorphic for good (until the next reset).
+Method* inline_cache_miss(Method* method, uint16_t site, Value class, Value selector) {
+    if (method->cache_epoch != vm->cache_epoch) {
+        inline_cache_reset(method);
+    }
+
+    // Hand-assembled methods may have no caches at all
+    Value caches = method->send_caches;
+    if (!is_object(caches) || 2 * site + 1 >= as_object(caches)->size) {
+        vm->inline_cache_misses++;
+        return method_cache_lookup(class, selector);
+    }
+
+    Value state = array_at(caches, 2 * site);
+
+    // Polymorphic sites are searched here rather than in the fast path
+    if (is_int(state) && as_int(state) > 0) {
+        Value pic = array_at(caches, 2 * site + 1);
+
+        for (int i = 0; i < as_int(state); i++) {
+            if (array_at(pic, 2 * i).bits == class.bits) {
+                vm->inline_cache_hits++;
+                return (Method*)as_object(array_at(pic, 2 * i + 1));
+            }
+        }
+    }
+
+    vm->inline_cache_misses++;
+
+    Method* target = method_cache_lookup(class, selector);
+
+    // Failed lookups are not cached
+    if (target == NULL) {
+        return NULL;
+    }
+
+    Value target_value = make_object((Object*)target);
+
+    // Allocating the PIC may move everything
+    Value pic = vm->nil;
+    if (is_object(state)) {
+        Value method_value = make_object((Object*)method);
+        gc_push_root(&method_value);
+        gc_push_root(&class);
+        gc_push_root(&target_value);
+        pic = array_new(2 * IC_PIC_SIZE);
+        gc_pop_roots(3);
+
+        method = (Method*)as_object(method_value);
+        target = (Method*)as_object(target_value);
+        caches = method->send_caches;
+        state = array_at(caches, 2 * site);
+    }
+
+    if (is_nil(state)) {
+        // Empty: go monomorphic
+        array_at_put(caches, 2 * site, class);
+        array_at_put(caches, 2 * site + 1, target_value);
+    } else if (is_object(state)) {
+        // Monomorphic: move the existing entry and the new one into a PIC
+        array_at_put(pic, 0, state);
+        array_at_put(pic, 1, array_at(caches, 2 * site + 1));
+        array_at_put(pic, 2, class);
+        array_at_put(pic, 3, target_value);
+
+        array_at_put(caches, 2 * site, make_int(2));
+        array_at_put(caches, 2 * site + 1, pic);
+    } else if (as_int(state) > 0 && as_int(state) < IC_PIC_SIZE) {
+        // Polymorphic with room to spare
+        int count = as_int(state);
+        pic = array_at(caches, 2 * site + 1);
+        array_at_put(pic, 2 * count, class);
+        array_at_put(pic, 2 * count + 1, target_value);
+
+        array_at_put(caches, 2 * site, make_int(count + 1));
+    } else {
+        // Full PIC: megamorphic, sends go to the global method cache
+        array_at_put(caches, 2 * site, make_int(0));
+        array_at_put(caches, 2 * site + 1, vm->nil);
+    }
+
+    return target;
+}
+
+// Print "Class>>selector" for a cached target
+static void print_target(Value class, Value method) {
+    Value class_name = class_get_name(class);
+
+    printf("%s>>%s",
+           is_object(class_name) ? symbol_to_string(class_name) : "?",
+           symbol_to_string(((Method*)as_object(method))->name));
+}
+
+// Print the state of each of a method's send sites
+void inline_cache_dump(Method* method) {
+    if (!is_object(method->send_caches)) {
+        return;
+    }
+
+    Value holder_name = class_get_name(method->holder);
+    bool stale = method->cache_epoch != vm->cache_epoch;
+
+    printf("Inline caches for %s>>%s%s\n",
+           is_object(holder_name) ? symbol_to_string(holder_name) : "?",
+           symbol_to_string(method->name),
+           stale ? " (stale)" : "");
+
+    uint16_t pc = 0;
+    while (pc < method->bytecode_count) {
+        uint8_t* ip = &method->bytecode[pc];
+
+        // Wide sends (after BC_EXTEND) have two-byte selector and site, and
+        // BC_PUSH_LOCAL_SEND has its send operands after the local's index
+        bool wide = *ip == BC_EXTEND;
+        bool fused = *ip == BC_PUSH_LOCAL_SEND;
+        uint8_t* send = wide || fused ? ip + 1 : ip;
+        bool super = !fused && *send == BC_SUPER_SEND;
+
+        if (fused || *send == BC_SEND || super) {
+            uint16_t selector_index = wide ? (send[1] << 8 | send[2]) : send[1];
+            uint16_t site = wide ? (send[4] << 8 | send[5]) : send[3];
+
+            printf("  %4u: %s #%s, site %u: ",
+                   pc,
+                   super ? "super send" : "send",
+                   symbol_to_string(as_object(method->literals)->fields[selector_index]),
+                   site);
+
+            Value caches = method->send_caches;
+            if (!is_object(caches) || 2 * site + 1 >= as_object(caches)->size) {
+                printf("no cache\n");
+            } else {
+                Value state = array_at(caches, 2 * site);
+                Value target = array_at(caches, 2 * site + 1);
+
+                if (stale || is_nil(state)) {
+                    printf("empty\n");
+                } else if (is_object(state)) {
+                    printf("monomorphic ");
+                    print_target(state, target);
+                    printf("\n");
+                } else if (as_int(state) > 0) {
+                    printf("polymorphic (%d)", as_int(state));
+                    for (int i = 0; i < as_int(state); i++) {
+                        printf(i == 0 ? " " : ", ");
+                        print_target(array_at(target, 2 * i), array_at(target, 2 * i + 1));
+                    }
+                    printf("\n");
+                } else {
+                    printf("megamorphic\n");
+                }
+            }
+        }
+
+        pc += interpreter_instruction_length(ip);
+    }
+}
@@ -0,0 +1,49 @@
+// inline_cache.h - Per-send-site inline caches for Poplar2
+
+#ifndef POPLAR2_INLINE_CACHE_H
+#define POPLAR2_INLINE_CACHE_H
+
+#include "vm.h"
+
+// Every BC_SEND / BC_SUPER_SEND carries a site number indexing the method's
+// send_caches Array, which holds two slots per site:
+//
+//   empty         nil           nil
+//   monomorphic   class         method
+//   polymorphic   int n (2..4)  Array of n class/method pairs
+//   megamorphic   int 0         nil   (use the global method cache)
+//
+// A method's caches are only trusted while its cache_epoch matches the VM's,
+// which class_add_method bumps whenever any method is installed.
+
+// Allocate the caches for a method with 'num_sites' send sites
+void inline_cache_init(Method* method, uint16_t num_sites);
+
+// Slow path: look the send up and update the site's cache
+Method* inline_cache_miss(Method* method, uint16_t site, Value class, Value selector);
+
+// Forget everything cached by a method's send sites
+void inline_cache_reset(Method* method);
+
+// Print the state of each of a method's send sites
+void inline_cache_dump(Method* method);
+
+// Find the target of a send, hitting the site's monomorphic entry if possible
+static inline Method* inline_cache_lookup(Method* method, uint16_t site, Value class, Value selector) {
+    if (method->cache_epoch == vm->cache_epoch && is_object(method->send_caches)) {
+        Object* caches = as_object(method->send_caches);
+
+        if (2 * site + 1 < caches->size) {
+            Value* entry = &caches->fields[2 * site];
+
+            if (entry[0].bits == class.bits && is_object(entry[1])) {
+                vm->inline_cache_hits++;
+                return (Method*)as_object(entry[1]);
+            }
+        }
+    }
+
+    return inline_cache_miss(method, site, class, selector);
+}
+
+#endif /* POPLAR2_INLINE_CACHE_H */
@@ -0,0 +1,420 @@
+// integer.c - LargeInteger arithmetic for Poplar2
+
+#include "integer.h"
+#include "object.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// LargeIntegers hold a sign and a magnitude of 16-bit digits, so every digit
+// operation fits in 32 bits. The operations below read their operands'
+// digits in place, build the result's magnitude in a malloc'd scratch buffer
+// and only then allocate the result, so no operand has to survive a
+// collection.
+
+// An integer operand, whichever its representation
+typedef struct {
+    bool negative;
+    uint32_t count;           // Digits in use (0 for zero)
+    const uint16_t* digits;   // Least significant first
+    uint16_t small[2];        // Digits of a SmallInteger operand
+} Operand;
+
+// Read an integer's sign and magnitude
+static void operand_init(Operand* operand, Value value) {
+    if (is_int(value)) {
+        int32_t n = as_int(value);
+        uint32_t magnitude = n < 0 ? -(uint32_t)n : (uint32_t)n;
+
+        operand->negative = n < 0;
+        operand->small[0] = (uint16_t)magnitude;
+        operand->small[1] = (uint16_t)(magnitude >> 16);
+        operand->count = magnitude > 0xFFFF ? 2 : (magnitude ? 1 : 0);
+        operand->digits = operand->small;
+    } else {
+        LargeInteger* large = (LargeInteger*)as_object(value);
+
+        operand->negative = large->negative != 0;
+        operand->count = large->count;
+        operand->digits = large->digits;
+    }
+}
+
+// Scratch space for a result of up to 'count' digits
+static uint16_t* scratch_digits(uint32_t count) {
+    uint16_t* digits = calloc(count ? count : 1, sizeof(uint16_t));
+
+    if (digits == NULL) {
+        vm_error("Out of memory for integer arithmetic");
+        exit(1);
+    }
+
+    return digits;
+}
+
+// The integer with a magnitude of 'count' digits (leading zeros allowed):
+// a SmallInteger if it fits, otherwise a new LargeInteger. Frees 'digits'.
+static Value integer_from_digits(bool negative, uint16_t* digits, uint32_t count) {
+    while (count > 0 && digits[count - 1] == 0) {
+        count--;
+    }
+
+    if (count <= 2) {
+        uint32_t magnitude = count > 0 ? digits[0] : 0;
+        if (count == 2) {
+            magnitude |= (uint32_t)digits[1] << 16;
+        }
+
+        if (!negative && magnitude <= SMALL_INT_MAX) {
+            free(digits);
+            return make_int((int32_t)magnitude);
+        }
+        if (negative && magnitude <= (uint32_t)SMALL_INT_MAX + 1) {
+            free(digits);
+            return make_int(-(int32_t)(magnitude - 1) - 1);
+        }
+    }
+
+    uint32_t size = (offsetof(LargeInteger, digits) - sizeof(Object) +
+                     count * sizeof(uint16_t) + sizeof(Value) - 1) / sizeof(Value);
+    LargeInteger* large = (LargeInteger*)object_new(vm->class_LargeInteger, size);
+    if (large == NULL) {
+        free(digits);
+        return vm->nil; // Too many digits for one object
+    }
+    large->object.format = FORMAT_BYTES;
+    large->negative = negative;
+    large->count = count;
+    memcpy(large->digits, digits, count * sizeof(uint16_t));
+    free(digits);
+
+    return make_object(&large->object);
+}
+
+// Compare two magnitudes
+static int magnitude_compare(const Operand* a, const Operand* b) {
+    if (a->count != b->count) {
+        return a->count < b->count ? -1 : 1;
+    }
+
+    for (uint32_t i = a->count; i > 0; i--) {
+        if (a->digits[i - 1] != b->digits[i - 1]) {
+            return a->digits[i - 1] < b->digits[i - 1] ? -1 : 1;
+        }
+    }
+
+    return 0;
+}
+
+// Add two magnitudes into 'result' (room for the longer plus one digit)
+static void magnitude_add(const Operand* a, const Operand* b, uint16_t* result) {
+    uint32_t count = a->count > b->count ? a->count : b->count;
+    uint32_t carry = 0;
+
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t sum = carry;
+        if (i < a->count) sum += a->digits[i];
+        if (i < b->count) sum += b->digits[i];
+        result[i] = (uint16_t)sum;
+        carry = sum >> 16;
+    }
+    result[count] = (uint16_t)carry;
+}
+
+// Subtract the magnitude of b from the larger one of a into 'result'
+static void magnitude_sub(const Operand* a, const Operand* b, uint16_t* result) {
+    int32_t borrow = 0;
+
+    for (uint32_t i = 0; i < a->count; i++) {
+        int32_t difference = (int32_t)a->digits[i] - borrow - (i < b->count ? b->digits[i] : 0);
+        borrow = difference < 0;
+        result[i] = (uint16_t)(difference + (borrow << 16));
+    }
+}
+
+// Add or subtract (if b_negative is flipped) two signed integers
+static Value integer_add_signed(const Operand* a, const Operand* b, bool b_negative) {
+    uint32_t count = (a->count > b->count ? a->count : b->count) + 1;
+    uint16_t* result = scratch_digits(count);
+
+    if (a->negative == b_negative) {
+        magnitude_add(a, b, result);
+        return integer_from_digits(a->negative, result, count);
+    }
+
+    // Opposite signs: the larger magnitude decides the sign
+    if (magnitude_compare(a, b) >= 0) {
+        magnitude_sub(a, b, result);
+        return integer_from_digits(a->negative, result, count);
+    }
+    magnitude_sub(b, a, result);
+    return integer_from_digits(b_negative, result, count);
+}
+
+Value integer_add(Value a, Value b) {
+    Operand x, y;
+    operand_init(&x, a);
+    operand_init(&y, b);
+    return integer_add_signed(&x, &y, y.negative);
+}
+
+Value integer_sub(Value a, Value b) {
+    Operand x, y;
+    operand_init(&x, a);
+    operand_init(&y, b);
+    return integer_add_signed(&x, &y, !y.negative && y.count > 0);
+}
+
+Value integer_mul(Value a, Value b) {
+    Operand x, y;
+    operand_init(&x, a);
+    operand_init(&y, b);
+
+    uint32_t count = x.count + y.count;
+    uint16_t* result = scratch_digits(count);
+
+    for (uint32_t i = 0; i < x.count; i++) {
+        uint32_t carry = 0;
+
+        for (uint32_t j = 0; j < y.count; j++) {
+            uint32_t product = (uint32_t)x.digits[i] * y.digits[j] + result[i + j] + carry;
+            result[i + j] = (uint16_t)product;
+            carry = product >> 16;
+        }
+        result[i + y.count] = (uint16_t)carry;
+    }
+
+    return integer_from_digits(x.negative != y.negative, result, count);
+}
+
+// Number of leading zero bits in a nonzero digit
+static int digit_leading_zeros(uint16_t digit) {
+    int zeros = 0;
+
+    while (!(digit & 0x8000)) {
+        digit <<= 1;
+        zeros++;
+    }
+
+    return zeros;
+}
+
+// Divide magnitude u (m digits) by v (n digits, n <= m, top digit nonzero)
+// into quotient q (m - n + 1 digits) and remainder r (n digits): Knuth's
+// algorithm D, after Hacker's Delight
+static void magnitude_divide(const uint16_t* u, uint32_t m, const uint16_t* v, uint32_t n,
+                             uint16_t* q, uint16_t* r) {
+    const uint32_t base = 0x10000;
+
+    if (n == 1) {
+        uint32_t remainder = 0;
+
+        for (uint32_t j = m; j > 0; j--) {
+            uint32_t dividend = remainder * base + u[j - 1];
+            q[j - 1] = (uint16_t)(dividend / v[0]);
+            remainder = dividend - q[j - 1] * v[0];
+        }
+        r[0] = (uint16_t)remainder;
+        return;
+    }
+
+    // Normalize so the divisor's top digit has its high bit set
+    int shift = digit_leading_zeros(v[n - 1]);
+    uint16_t* vn = scratch_digits(n);
+    uint16_t* un = scratch_digits(m + 1);
+
+    for (uint32_t i = n - 1; i > 0; i--) {
+        vn[i] = (uint16_t)((v[i] << shift) | ((uint32_t)v[i - 1] >> (16 - shift)));
+    }
+    vn[0] = (uint16_t)(v[0] << shift);
+
+    un[m] = (uint16_t)((uint32_t)u[m - 1] >> (16 - shift));
+    for (uint32_t i = m - 1; i > 0; i--) {
+        un[i] = (uint16_t)((u[i] << shift) | ((uint32_t)u[i - 1] >> (16 - shift)));
+    }
+    un[0] = (uint16_t)(u[0] << shift);
+
+    for (uint32_t j = m - n + 1; j > 0; j--) {
+        uint32_t k = j - 1;
+
+        // Estimate the quotient digit from the top two digits, then correct it
+        uint32_t top = un[k + n] * base + un[k + n - 1];
+        uint32_t qhat = top / vn[n - 1];
+        uint32_t rhat = top - qhat * vn[n - 1];
+
+        while (qhat >= base || qhat * vn[n - 2] > base * rhat + un[k + n - 2]) {
+            qhat--;
+            rhat += vn[n - 1];
+            if (rhat >= base) {
+                break;
+            }
+        }
+
+        // Multiply and subtract
+        int32_t borrow = 0;
+        int32_t t;
+        for (uint32_t i = 0; i < n; i++) {
+            uint32_t product = qhat * vn[i];
+            t = un[i + k] - borrow - (int32_t)(product & 0xFFFF);
+            un[i + k] = (uint16_t)t;
+            borrow = (int32_t)(product >> 16) - (t >> 16);
+        }
+        t = un[k + n] - borrow;
+        un[k + n] = (uint16_t)t;
+
+        // Subtracted too much: add one divisor back
+        q[k] = (uint16_t)qhat;
+        if (t < 0) {
+            q[k]--;
+            uint32_t carry = 0;
+            for (uint32_t i = 0; i < n; i++) {
+                uint32_t sum = (uint32_t)un[i + k] + vn[i] + carry;
+                un[i + k] = (uint16_t)sum;
+                carry = sum >> 16;
+            }
+            un[k + n] = (uint16_t)(un[k + n] + carry);
+        }
+    }
+
+    // Unnormalize the remainder
+    for (uint32_t i = 0; i < n; i++) {
+        r[i] = (uint16_t)((un[i] >> shift) | ((uint32_t)un[i + 1] << (16 - shift)));
+    }
+
+    free(vn);
+    free(un);
+}
+
+// Divide two integers, answering the quotient or the remainder
+static Value integer_divide(Value a, Value b, bool want_remainder) {
+    Operand x, y;
+    operand_init(&x, a);
+    operand_init(&y, b);
+
+    if (y.count == 0) {
+        vm_error("Division by zero");
+        return vm->nil;
+    }
+
+    if (magnitude_compare(&x, &y) < 0) {
+        return want_remainder ? a : make_int(0);
+    }
+
+    uint16_t* quotient = scratch_digits(x.count - y.count + 1);
+    uint16_t* remainder = scratch_digits(y.count);
+    magnitude_divide(x.digits, x.count, y.digits, y.count, quotient, remainder);
+
+    if (want_remainder) {
+        free(quotient);
+        return integer_from_digits(x.negative, remainder, y.count);
+    }
+    free(remainder);
+    return integer_from_digits(x.negative != y.negative, quotient, x.count - y.count + 1);
+}
+
+Value integer_div(Value a, Value b) {
+    return integer_divide(a, b, false);
+}
+
+Value integer_mod(Value a, Value b) {
+    return integer_divide(a, b, true);
+}
+
+int integer_compare(Value a, Value b) {
+    if (is_int(a) && is_int(b)) {
+        return as_int(a) < as_int(b) ? -1 : as_int(a) > as_int(b);
+    }
+
+    Operand x, y;
+    operand_init(&x, a);
+    operand_init(&y, b);
+
+    if (x.negative != y.negative) {
+        return x.negative ? -1 : 1;
+    }
+
+    int order = magnitude_compare(&x, &y);
+    return x.negative ? -order : order;
+}
+
+Value integer_from_int64(int64_t value) {
+    if (value >= SMALL_INT_MIN && value <= SMALL_INT_MAX) {
+        return make_int((int32_t)value);
+    }
+
+    uint64_t magnitude = value < 0 ? -(uint64_t)value : (uint64_t)value;
+    uint16_t* digits = scratch_digits(4);
+
+    for (int i = 0; i < 4; i++) {
+        digits[i] = (uint16_t)(magnitude >> (16 * i));
+    }
+
+    return integer_from_digits(value < 0, digits, 4);
+}
+
+// Parse decimal digits (an optional leading '-' allowed)
+Value integer_parse(const char* chars, uint32_t length) {
+    bool negative = length > 0 && chars[0] == '-';
+    uint32_t start = negative ? 1 : 0;
+
+    // Each decimal digit needs under four bits
+    uint32_t count = (length - start) / 4 + 2;
+    uint16_t* digits = scratch_digits(count);
+    uint32_t used = 0;
+
+    for (uint32_t i = start; i < length; i++) {
+        uint32_t carry = (uint32_t)(chars[i] - '0');
+
+        for (uint32_t j = 0; j < used; j++) {
+            uint32_t product = digits[j] * 10u + carry;
+            digits[j] = (uint16_t)product;
+            carry = product >> 16;
+        }
+        if (carry) {
+            digits[used++] = (uint16_t)carry;
+        }
+    }
+
+    return integer_from_digits(negative, digits, count);
+}
+
+void integer_print(Value value) {
+    if (is_int(value)) {
+        printf("%d", as_int(value));
+        return;
+    }
+
+    Operand x;
+    operand_init(&x, value);
+
+    // Peel off four decimal digits at a time, least significant first
+    uint16_t* magnitude = scratch_digits(x.count);
+    uint16_t* chunks = scratch_digits(x.count * 2 + 1);
+    uint32_t count = x.count;
+    uint32_t chunk_count = 0;
+
+    memcpy(magnitude, x.digits, x.count * sizeof(uint16_t));
+
+    while (count > 0) {
+        uint32_t remainder = 0;
+
+        for (uint32_t j = count; j > 0; j--) {
+            uint32_t dividend = (remainder << 16) | magnitude[j - 1];
+            magnitude[j - 1] = (uint16_t)(dividend / 10000);
+            remainder = dividend % 10000;
+        }
+        chunks[chunk_count++] = (uint16_t)remainder;
+
+        while (count > 0 && magnitude[count - 1] == 0) {
+            count--;
+        }
+    }
+
+    printf("%s%u", x.negative ? "-" : "", chunks[chunk_count - 1]);
+    for (uint32_t i = chunk_count - 1; i > 0; i--) {
+        printf("%04u", chunks[i - 1]);
+    }
+
+    free(magnitude);
+    free(chunks);
+}
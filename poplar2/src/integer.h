@@ -0,0 +1,99 @@
+// integer.h - SmallInteger fast paths and LargeInteger arithmetic for Poplar2
+
+#ifndef POPLAR2_INTEGER_H
+#define POPLAR2_INTEGER_H
+
+#include "vm.h"
+
+// Whether a value is an integer of either representation
+static inline bool is_integer(Value value) {
+    return is_int(value) ||
+           (is_object(value) && as_object(value)->class_index == CLASS_INDEX_LARGE_INTEGER);
+}
+
+// SmallInteger arithmetic that reports overflow out of the 30-bit range
+// instead of wrapping. Scaling one operand by 4 moves the payload to the top
+// of an int32_t, so the compiler's overflow check is exactly the range check.
+static inline bool small_int_add(int32_t a, int32_t b, int32_t* result) {
+#if defined(__GNUC__)
+    int32_t scaled;
+    if (__builtin_add_overflow(a * 4, b * 4, &scaled)) {
+        return false;
+    }
+    *result = scaled / 4;
+    return true;
+#else
+    int32_t sum = a + b;
+    *result = sum;
+    return sum >= SMALL_INT_MIN && sum <= SMALL_INT_MAX;
+#endif
+}
+
+static inline bool small_int_sub(int32_t a, int32_t b, int32_t* result) {
+#if defined(__GNUC__)
+    int32_t scaled;
+    if (__builtin_sub_overflow(a * 4, b * 4, &scaled)) {
+        return false;
+    }
+    *result = scaled / 4;
+    return true;
+#else
+    int32_t difference = a - b;
+    *result = difference;
+    return difference >= SMALL_INT_MIN && difference <= SMALL_INT_MAX;
+#endif
+}
+
+static inline bool small_int_mul(int32_t a, int32_t b, int32_t* result) {
+#if defined(__GNUC__)
+    int32_t scaled;
+    if (__builtin_mul_overflow(a * 4, b, &scaled)) {
+        return false;
+    }
+    *result = scaled / 4;
+    return true;
+#else
+    int64_t product = (int64_t)a * b;
+    *result = (int32_t)product;
+    return product >= SMALL_INT_MIN && product <= SMALL_INT_MAX;
+#endif
+}
+
+// SmallInteger division, truncating as in C; fails on a zero divisor and on
+// the one overflowing quotient, SMALL_INT_MIN / -1
+static inline bool small_int_div(int32_t a, int32_t b, int32_t* result) {
+    if (b == 0) {
+        return false;
+    }
+    *result = a / b;
+    return *result <= SMALL_INT_MAX;
+}
+
+static inline bool small_int_mod(int32_t a, int32_t b, int32_t* result) {
+    if (b == 0) {
+        return false;
+    }
+    *result = a % b;
+    return true;
+}
+
+// Integer arithmetic on SmallIntegers and LargeIntegers alike. Results that
+// fit are SmallIntegers. Division truncates toward zero and the remainder
+// takes the dividend's sign, as in C; the divisor must not be zero.
+Value integer_add(Value a, Value b);
+Value integer_sub(Value a, Value b);
+Value integer_mul(Value a, Value b);
+Value integer_div(Value a, Value b);
+Value integer_mod(Value a, Value b);
+
+// Negative, zero or positive as a is less than, equal to or greater than b
+int integer_compare(Value a, Value b);
+
+// Create an integer from a machine integer, or from decimal digits
+Value integer_from_int64(int64_t value);
+Value integer_parse(const char* digits, uint32_t length);
+
+// Print an integer in decimal
+void integer_print(Value value);
+
+#endif /* POPLAR2_INTEGER_H */
@@ -3,57 +3,106 @@
 #include "interpreter.h"
 #include "object.h"
 #include "gc.h"
+#include "method_cache.h"
+#include "inline_cache.h"
+#include "integer.h"
+#include "context.h"
 #include <stdio.h>
 #include <stdlib.h>
 
+static Value interpreter_run(Frame* frame);
+static Value interpreter_activate(Method* method, Value* arguments);
+static Value interpreter_enter(Frame* frame);
+static Value interpreter_class_of(Value receiver);
+static Method* interpreter_lookup(Value receiver, Value selector);
+
 // Execute a method
+//
+// Entry point for C callers: the receiver and arguments are pushed onto the
+// frame stack (on top of the current frame's operands, if any) so that the
+// method can be activated exactly like a send from bytecode.
 Value interpreter_execute_method(Method* method, Value receiver, Value* arguments, int arg_count) {
-    // Push new frame
-    Frame* frame = vm_push_frame(method, receiver);
-    
-    // Copy arguments to frame
-    for (int i = 0; i < arg_count && i < method->num_args; i++) {
-        frame->stack[i] = arguments[i];
+    Frame* sender = vm->current_frame;
+    Value* base = sender != NULL ? sender->stack_pointer : vm->stack_base;
+
+    if (base + 1 + method->num_args > vm->stack_limit) {
+        vm_error("Stack overflow: maximum call depth exceeded");
+        return vm->nil;
     }
-    
-    // Initialize locals to nil
-    for (int i = arg_count; i < method->num_args + method->num_locals; i++) {
-        frame->stack[i] = vm->nil;
+
+    // Receiver, then arguments (missing arguments are nil)
+    base[0] = receiver;
+    for (int i = 0; i < method->num_args; i++) {
+        base[1 + i] = i < arg_count ? arguments[i] : vm->nil;
     }
-    
-    // Set stack pointer after locals
-    frame->stack_pointer = &frame->stack[method->num_args + method->num_locals];
-    
-    // Execute bytecodes
-    while (frame->bytecode_index < method->bytecode_count) {
-        uint8_t bytecode = method->bytecode[frame->bytecode_index++];
-        interpreter_handle_bytecode(bytecode);
-        
-        // Check if frame changed (due to return or new message)
-        if (vm->current_frame != frame) {
-            break;
-        }
+
+    // Keep them visible to the GC as part of the sender's operands
+    if (sender != NULL) {
+        sender->stack_pointer = base + 1 + method->num_args;
     }
-    
-    // Get return value (top of stack)
-    Value result = vm->current_frame->stack_pointer > vm->current_frame->stack
-                  ? *(vm->current_frame->stack_pointer - 1)
-                  : vm->nil;
-    
-    // Restore sender frame if we're still in the current frame
-    if (vm->current_frame == frame) {
-        vm_pop_frame();
+
+    Value result = interpreter_activate(method, base + 1);
+
+    if (sender != NULL) {
+        sender->stack_pointer = base;
     }
-    
+
     return result;
 }
 
+// Activate a method whose receiver and arguments are already on the frame
+// stack, with the receiver at arguments[-1]
+static Value interpreter_activate(Method* method, Value* arguments) {
+    Frame* frame = vm_push_frame(method, arguments[-1], arguments);
+    if (frame == NULL) {
+        return vm->nil;
+    }
+
+    return interpreter_enter(frame);
+}
+
+// Evaluate a block whose arguments are already on the frame stack, with the
+// block at arguments[-1]
+Value interpreter_block_value(Value* arguments, int arg_count) {
+    Block* block = (Block*)as_object(arguments[-1]);
+    Method* method = (Method*)as_object(block->method);
+
+    if (method->num_args != arg_count) {
+        vm_error("Wrong argument count for block: %d", arg_count);
+        return vm->nil;
+    }
+
+    Frame* frame = vm_push_frame(method, block->receiver, arguments);
+    if (frame == NULL) {
+        return vm->nil;
+    }
+    frame->is_block_invocation = true;
+
+    return interpreter_enter(frame);
+}
+
+// Run a freshly pushed frame
+static Value interpreter_enter(Frame* frame) {
+    Method* method = frame->method;
+
+    // Initialize locals to nil
+    for (int i = 0; i < method->num_locals; i++) {
+        frame->stack[i] = vm->nil;
+    }
+
+    // Set stack pointer after locals
+    frame->stack_pointer = &frame->stack[method->num_locals];
+
+    // Execute bytecodes until the method returns
+    return interpreter_run(frame);
+}
+
 // Push value onto the stack
 void interpreter_push(Value value) {
     Frame* frame = vm->current_frame;
     
     // Check for stack overflow
-    if (frame->stack_pointer >= &frame->stack[STACK_SIZE]) {
+    if (frame->stack_pointer >= frame->stack_limit) {
         vm_error("Stack overflow");
         return;
     }
@@ -87,367 +136,735 @@ Value interpreter_peek() {
     return *(frame->stack_pointer - 1);
 }
 
-// Handle a single bytecode instruction
-void interpreter_handle_bytecode(uint8_t bytecode) {
-    Frame* frame = vm->current_frame;
+// Dispatch engine
+//
+// The frame, method, instruction pointer and stack pointer live in locals
+// for the whole activation. They are written back to the frame only before
+// anything that can look at the frame from outside the loop (sends,
+// primitives, errors, returns) and reloaded afterwards, since a garbage
+// collection in between may have moved the method.
+//
+// With USE_THREADED_DISPATCH every handler jumps straight to the next one
+// through a table of label addresses (GCC/Clang labels-as-values). Otherwise
+// the same handlers are compiled as the cases of a plain switch loop.
+//
+// Methods are verified when installed (see verifier.h): indices are in
+// range, the operand stack stays within the frame and every path ends in a
+// return, so the loop checks none of these.
+
+#define READ_BYTE()     (*ip++)
+#define READ_SHORT()    (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
+
+#define SAVE_STATE()    (frame->bytecode_index = (uint16_t)(ip - method->bytecode), \
+                         frame->stack_pointer = sp)
+#define LOAD_STATE()    (method = frame->method, \
+                         ip = &method->bytecode[frame->bytecode_index], \
+                         sp = frame->stack_pointer)
+
+#define PUSH(value)     (*sp++ = (value))
+#define POP()           (*--sp)
+#define PEEK()          (sp[-1])
+
+// After a send or primitive returns: if a non-local return is on its way
+// out, this frame returns too, with the same result
+#define UNWIND_IF_RETURNING(result) \
+                        do { \
+                            if (vm->return_target != NULL) { \
+                                return interpreter_unwind(frame, result); \
+                            } \
+                        } while (0)
+
+#ifdef POPLAR2_PROFILE_PAIRS
+#define PROFILE_PAIR()  (pair_counts[previous_opcode][*ip]++, previous_opcode = *ip)
+#else
+#define PROFILE_PAIR()  ((void)0)
+#endif
+
+#if USE_THREADED_DISPATCH
+#define DISPATCH()      do { PROFILE_PAIR(); goto *dispatch_table[*ip++]; } while (0)
+#define INTERPRET()     DISPATCH();
+#define CASE(label, op) label:
+#define NEXT()          DISPATCH()
+#define DEFAULT()       op_unknown:
+#else
+#define INTERPRET()     for (;;) switch (PROFILE_PAIR(), *ip++)
+#define CASE(label, op) case op:
+#define NEXT()          continue
+#define DEFAULT()       default:
+#endif
+
+#ifdef POPLAR2_PROFILE_PAIRS
+// Executions of each bytecode (second index) right after each other one
+static uint32_t pair_counts[256][256];
+static uint8_t previous_opcode;
+
+// Print the most frequently executed bytecode pairs
+void interpreter_print_pair_profile() {
+    enum { TOP_PAIRS = 24 };
+    uint16_t top[TOP_PAIRS];
+    int count = 0;
+    uint64_t total = 0;
+
+    // Insertion into a short list sorted by count, most frequent first
+    for (int pair = 0; pair < 256 * 256; pair++) {
+        uint32_t n = pair_counts[pair >> 8][pair & 0xFF];
+        total += n;
+        if (n == 0) {
+            continue;
+        }
+
+        int i = count < TOP_PAIRS ? count++ : TOP_PAIRS;
+        while (i > 0 && pair_counts[top[i - 1] >> 8][top[i - 1] & 0xFF] < n) {
+            if (i < TOP_PAIRS) {
+                top[i] = top[i - 1];
+            }
+            i--;
+        }
+        if (i < TOP_PAIRS) {
+            top[i] = (uint16_t)pair;
+        }
+    }
+
+    printf("Bytecode pairs: %llu dispatches\n", (unsigned long long)total);
+    for (int i = 0; i < count; i++) {
+        uint32_t n = pair_counts[top[i] >> 8][top[i] & 0xFF];
+        printf("  0x%02X 0x%02X: %u (%u%%)\n", top[i] >> 8, top[i] & 0xFF, n,
+               (unsigned)((uint64_t)n * 100 / total));
+    }
+}
+#endif
+
+// Return from a frame a non-local return is unwinding through, stopping
+// the unwinding if it is the home frame
+static Value interpreter_unwind(Frame* frame, Value result) {
+    if (frame == vm->return_target) {
+        vm->return_target = NULL;
+    }
+    vm_pop_frame();
+    return result;
+}
+
+// Run a freshly pushed frame until it returns, then pop it
+static Value interpreter_run(Frame* frame) {
     Method* method = frame->method;
-    uint8_t arg;
-    
-    switch (bytecode) {
-        case BC_PUSH_LOCAL: {
+    uint8_t* ip;
+    Value* sp;
+
+    // Operands, decoded by each instruction or, for the wide form after
+    // BC_EXTEND and for superinstructions, by a handler that then jumps
+    // past the instruction's own decoding (the *_decoded labels)
+    uint16_t arg;
+    uint8_t level;
+    uint8_t arg_count;
+    uint16_t site;
+
+#if USE_THREADED_DISPATCH
+    // Unassigned opcodes fall back to op_unknown, then the real handlers
+    // override their slots
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Woverride-init"
+    static void* dispatch_table[256] = {
+        [0 ... 255]          = &&op_unknown,
+        [BC_PUSH_LOCAL]      = &&op_push_local,
+        [BC_PUSH_ARGUMENT]   = &&op_push_argument,
+        [BC_PUSH_FIELD]      = &&op_push_field,
+        [BC_PUSH_BLOCK]      = &&op_push_block,
+        [BC_PUSH_CONSTANT]   = &&op_push_constant,
+        [BC_PUSH_GLOBAL]     = &&op_push_global,
+        [BC_PUSH_SPECIAL]    = &&op_push_special,
+        [BC_PUSH_OUTER]      = &&op_push_outer,
+        [BC_PUSH_CONTEXT]    = &&op_push_context,
+        [BC_POP]             = &&op_pop,
+        [BC_DUP]             = &&op_dup,
+        [BC_PUSH_THIS]       = &&op_push_this,
+        [BC_STORE_LOCAL]     = &&op_store_local,
+        [BC_STORE_ARGUMENT]  = &&op_store_argument,
+        [BC_STORE_FIELD]     = &&op_store_field,
+        [BC_STORE_GLOBAL]    = &&op_store_global,
+        [BC_STORE_OUTER]     = &&op_store_outer,
+        [BC_SEND]            = &&op_send,
+        [BC_SUPER_SEND]      = &&op_super_send,
+        [BC_RETURN_LOCAL]    = &&op_return_local,
+        [BC_RETURN_NON_LOCAL] = &&op_return_non_local,
+        [BC_JUMP]            = &&op_jump,
+        [BC_JUMP_IF_TRUE]    = &&op_jump_if_true,
+        [BC_JUMP_IF_FALSE]   = &&op_jump_if_false,
+        [BC_PRIMITIVE]       = &&op_primitive,
+        [BC_EXTEND]          = &&op_extend,
+        [BC_ADD]             = &&op_add,
+        [BC_SUB]             = &&op_sub,
+        [BC_MUL]             = &&op_mul,
+        [BC_DIV]             = &&op_div,
+        [BC_MOD]             = &&op_mod,
+        [BC_LT]              = &&op_lt,
+        [BC_GT]              = &&op_gt,
+        [BC_LE]              = &&op_le,
+        [BC_GE]              = &&op_ge,
+        [BC_EQ]              = &&op_eq,
+        [BC_NE]              = &&op_ne,
+        [BC_STORE_LOCAL_POP] = &&op_store_local_pop,
+        [BC_RETURN_SELF]     = &&op_return_self,
+        [BC_PUSH_FIELD_RETURN] = &&op_push_field_return,
+        [BC_PUSH_LOCAL_SEND] = &&op_push_local_send,
+    };
+#pragma GCC diagnostic pop
+#endif
+
+    LOAD_STATE();
+
+    INTERPRET() {
+        CASE(op_push_local, BC_PUSH_LOCAL) {
             // Next byte is local index
-            arg = method->bytecode[frame->bytecode_index++];
-            
-            // Calculate local index (offset from frame base)
-            uint8_t local_index = method->num_args + arg;
-            
-            // Push local onto stack
-            if (local_index < method->num_args + method->num_locals) {
-                interpreter_push(frame->stack[local_index]);
-            } else {
-                vm_error("Invalid local variable index: %d", arg);
-                interpreter_push(vm->nil);
-            }
-            break;
+            arg = READ_BYTE();
+        push_local_decoded:;
+
+            PUSH(frame->stack[arg]);
+            NEXT();
         }
-        
-        case BC_PUSH_ARGUMENT: {
-            // Next byte is argument index
-            arg = method->bytecode[frame->bytecode_index++];
-            
-            // Push argument onto stack
-            if (arg < method->num_args) {
-                interpreter_push(frame->stack[arg]);
-            } else {
-                vm_error("Invalid argument index: %d", arg);
-                interpreter_push(vm->nil);
-            }
-            break;
+
+        CASE(op_push_argument, BC_PUSH_ARGUMENT) {
+            arg = READ_BYTE();
+        push_argument_decoded:;
+
+            PUSH(frame->arguments[arg]);
+            NEXT();
         }
-        
-        case BC_PUSH_FIELD: {
-            // Next byte is field index
-            arg = method->bytecode[frame->bytecode_index++];
-            
-            // Get receiver
-            Object* receiver_obj = as_object(frame->receiver);
-            
-            // Push field onto stack
-            if (arg < receiver_obj->size) {
-                interpreter_push(receiver_obj->fields[arg]);
-            } else {
-                vm_error("Invalid field index: %d", arg);
-                interpreter_push(vm->nil);
-            }
-            break;
+
+        CASE(op_push_field, BC_PUSH_FIELD) {
+            arg = READ_BYTE();
+        push_field_decoded:;
+
+            PUSH(as_object(frame->receiver)->fields[arg]);
+            NEXT();
         }
-        
-        case BC_PUSH_BLOCK: {
-            // Next byte is block size (bytecode length)
-            uint8_t block_size = method->bytecode[frame->bytecode_index++];
-            
-            // Skip the block for now (we'll handle blocks later)
-            frame->bytecode_index += block_size;
-            
-            // Push a placeholder block object
-            interpreter_push(vm->nil);
-            break;
+
+        CASE(op_push_block, BC_PUSH_BLOCK) {
+            // Next byte indexes the method's literals
+            arg = READ_BYTE();
+        push_block_decoded:;
+
+            SAVE_STATE();
+            Value block = block_for_frame(frame, arg);
+            LOAD_STATE();
+
+            PUSH(block);
+            NEXT();
         }
-        
-        case BC_PUSH_CONSTANT: {
-            // Next byte is constant index
-            arg = method->bytecode[frame->bytecode_index++];
-            
-            // Push constant onto stack
-            if (arg < MAX_LITERALS) {
-                interpreter_push(vm->literals[arg]);
-            } else {
-                vm_error("Invalid constant index: %d", arg);
-                interpreter_push(vm->nil);
-            }
-            break;
+
+        CASE(op_push_constant, BC_PUSH_CONSTANT) {
+            arg = READ_BYTE();
+        push_constant_decoded:;
+
+            PUSH(as_object(method->literals)->fields[arg]);
+            NEXT();
         }
-        
-        case BC_PUSH_GLOBAL: {
-            // Next byte is global index
-            arg = method->bytecode[frame->bytecode_index++];
-            
-            // Push global onto stack
-            if (arg < MAX_GLOBALS) {
-                interpreter_push(vm->globals[arg]);
-            } else {
-                vm_error("Invalid global index: %d", arg);
-                interpreter_push(vm->nil);
-            }
-            break;
+
+        CASE(op_push_global, BC_PUSH_GLOBAL) {
+            // Next byte indexes the global's Association in the literals
+            arg = READ_BYTE();
+        push_global_decoded:;
+
+            Association* association = (Association*)as_object(as_object(method->literals)->fields[arg]);
+            PUSH(association->value);
+            NEXT();
         }
-        
-        case BC_PUSH_SPECIAL: {
+
+        CASE(op_push_special, BC_PUSH_SPECIAL) {
             // Next byte is special value code (nil, true, false)
-            arg = method->bytecode[frame->bytecode_index++];
-            
-            // Push special value onto stack
+            arg = READ_BYTE();
+
             switch (arg) {
                 case SPECIAL_NIL:
-                    interpreter_push(vm->nil);
+                    PUSH(vm->nil);
                     break;
                 case SPECIAL_TRUE:
-                    interpreter_push(vm->true_obj);
+                    PUSH(vm->true_obj);
                     break;
                 case SPECIAL_FALSE:
-                    interpreter_push(vm->false_obj);
+                    PUSH(vm->false_obj);
                     break;
                 default:
+                    SAVE_STATE();
                     vm_error("Invalid special value: %d", arg);
-                    interpreter_push(vm->nil);
+                    PUSH(vm->nil);
             }
-            break;
+            NEXT();
         }
-        
-        case BC_POP: {
-            // Pop and discard top of stack
-            interpreter_pop();
-            break;
+
+        CASE(op_push_outer, BC_PUSH_OUTER) {
+            // Next bytes are the lexical level and the variable's slot
+            level = READ_BYTE();
+            arg = READ_BYTE();
+        push_outer_decoded:;
+            Context* context = context_outer(frame, level);
+            Value* slot = context != NULL ? context_slot(context, arg) : NULL;
+
+            if (slot != NULL) {
+                PUSH(*slot);
+            } else {
+                SAVE_STATE();
+                vm_error("Invalid outer variable: %d at level %d", arg, level);
+                PUSH(vm->nil);
+            }
+            NEXT();
         }
-        
-        case BC_DUP: {
-            // Duplicate top of stack
-            Value value = interpreter_peek();
-            interpreter_push(value);
-            break;
+
+        CASE(op_push_context, BC_PUSH_CONTEXT) {
+            SAVE_STATE();
+            Value context = context_for_frame(frame);
+            LOAD_STATE();
+
+            PUSH(context);
+            NEXT();
         }
-        
-        case BC_PUSH_THIS: {
-            // Push receiver
-            interpreter_push(frame->receiver);
-            break;
+
+        CASE(op_pop, BC_POP) {
+            (void)POP();
+            NEXT();
         }
-        
-        case BC_STORE_LOCAL: {
-            // Next byte is local index
-            arg = method->bytecode[frame->bytecode_index++];
-            
-            // Calculate local index
-            uint8_t local_index = method->num_args + arg;
-            
-            // Store top of stack to local
-            if (local_index < method->num_args + method->num_locals) {
-                frame->stack[local_index] = interpreter_peek();
-            } else {
-                vm_error("Invalid local variable index: %d", arg);
-            }
-            break;
+
+        CASE(op_dup, BC_DUP) {
+            Value value = PEEK();
+            PUSH(value);
+            NEXT();
         }
-        
-        case BC_STORE_ARGUMENT: {
-            // Next byte is argument index
-            arg = method->bytecode[frame->bytecode_index++];
-            
-            // Store top of stack to argument
-            if (arg < method->num_args) {
-                frame->stack[arg] = interpreter_peek();
-            } else {
-                vm_error("Invalid argument index: %d", arg);
-            }
-            break;
+
+        CASE(op_push_this, BC_PUSH_THIS) {
+            PUSH(frame->receiver);
+            NEXT();
         }
-        
-        case BC_STORE_FIELD: {
-            // Next byte is field index
-            arg = method->bytecode[frame->bytecode_index++];
-            
-            // Get receiver
+
+        CASE(op_store_local, BC_STORE_LOCAL) {
+            arg = READ_BYTE();
+        store_local_decoded:;
+
+            frame->stack[arg] = PEEK();
+            NEXT();
+        }
+
+        CASE(op_store_argument, BC_STORE_ARGUMENT) {
+            arg = READ_BYTE();
+        store_argument_decoded:;
+
+            frame->arguments[arg] = PEEK();
+            NEXT();
+        }
+
+        CASE(op_store_field, BC_STORE_FIELD) {
+            arg = READ_BYTE();
+        store_field_decoded:;
             Object* receiver_obj = as_object(frame->receiver);
-            
-            // Store top of stack to field
-            if (arg < receiver_obj->size) {
-                receiver_obj->fields[arg] = interpreter_peek();
-            } else {
-                vm_error("Invalid field index: %d", arg);
-            }
-            break;
+            Value value = PEEK();
+
+            gc_write_barrier(receiver_obj, value);
+            receiver_obj->fields[arg] = value;
+            NEXT();
         }
-        
-        case BC_STORE_GLOBAL: {
-            // Next byte is global index
-            arg = method->bytecode[frame->bytecode_index++];
-            
-            // Store top of stack to global
-            if (arg < MAX_GLOBALS) {
-                vm->globals[arg] = interpreter_peek();
+
+        CASE(op_store_global, BC_STORE_GLOBAL) {
+            arg = READ_BYTE();
+        store_global_decoded:;
+
+            Association* association = (Association*)as_object(as_object(method->literals)->fields[arg]);
+            gc_write_barrier(&association->object, PEEK());
+            association->value = PEEK();
+            NEXT();
+        }
+
+        CASE(op_store_outer, BC_STORE_OUTER) {
+            level = READ_BYTE();
+            arg = READ_BYTE();
+        store_outer_decoded:;
+            Context* context = context_outer(frame, level);
+            Value* slot = context != NULL ? context_slot(context, arg) : NULL;
+
+            if (slot != NULL) {
+                // Once the frame has returned the variable lives in the heap
+                Value value = PEEK();
+                if (is_nil(context->frame)) {
+                    gc_write_barrier(&context->object, value);
+                }
+                *slot = value;
             } else {
-                vm_error("Invalid global index: %d", arg);
+                SAVE_STATE();
+                vm_error("Invalid outer variable: %d at level %d", arg, level);
             }
-            break;
+            NEXT();
         }
-        
-        case BC_SEND: {
-            // Next byte is selector index followed by argument count
-            uint8_t selector_idx = method->bytecode[frame->bytecode_index++];
-            uint8_t arg_count = method->bytecode[frame->bytecode_index++];
-            
-            // Get selector from literals
-            Value selector = vm->literals[selector_idx];
-            
-            // Arguments are on the stack, with receiver on the bottom
-            // Pop arguments in reverse order
-            Value args[16]; // Max 16 arguments
-            
-            for (int i = arg_count - 1; i >= 0; i--) {
-                args[i] = interpreter_pop();
+
+        CASE(op_send, BC_SEND) {
+            // Next bytes are selector (literal) index, argument count and cache site
+            arg = READ_BYTE();
+            arg_count = READ_BYTE();
+            site = READ_BYTE();
+        send_decoded:;
+            Value selector = as_object(method->literals)->fields[arg];
+
+            // Receiver and arguments stay on the stack and become the
+            // callee's arguments
+            Value* base = sp - arg_count - 1;
+
+            SAVE_STATE();
+            Method* callee = inline_cache_lookup(method, site, interpreter_class_of(*base), selector);
+            Value result = vm->nil;
+            if (callee == NULL) {
+                vm_error("Method not found: %s", symbol_to_string(selector));
+            } else if (callee->num_args != arg_count) {
+                vm_error("Wrong argument count for %s: %d", symbol_to_string(selector), arg_count);
+            } else {
+                result = interpreter_activate(callee, base + 1);
             }
-            
-            // Pop receiver
-            Value receiver = interpreter_pop();
-            
-            // Perform message send
-            Value result = interpreter_send(receiver, selector, arg_count, args);
-            
-            // Push result
-            interpreter_push(result);
-            break;
+            LOAD_STATE();
+            UNWIND_IF_RETURNING(result);
+
+            sp = base;
+            PUSH(result);
+            NEXT();
         }
-        
-        case BC_SUPER_SEND: {
-            // Next byte is selector index followed by argument count
-            uint8_t selector_idx = method->bytecode[frame->bytecode_index++];
-            uint8_t arg_count = method->bytecode[frame->bytecode_index++];
-            
-            // Get selector from literals
-            Value selector = vm->literals[selector_idx];
-            
-            // Arguments are on the stack
-            Value args[16]; // Max 16 arguments
-            
-            for (int i = arg_count - 1; i >= 0; i--) {
-                args[i] = interpreter_pop();
+
+        CASE(op_super_send, BC_SUPER_SEND) {
+            arg = READ_BYTE();
+            arg_count = READ_BYTE();
+            site = READ_BYTE();
+        super_send_decoded:;
+            Value selector = as_object(method->literals)->fields[arg];
+
+            // The receiver slot holds self, pushed for 'super'
+            Value* base = sp - arg_count - 1;
+
+            // The lookup class is fixed for the site, so it stays monomorphic
+            SAVE_STATE();
+            Value superclass = ((Class*)as_object(method->holder))->superclass;
+            Method* callee = NULL;
+            Value result = vm->nil;
+            if (is_nil(superclass)) {
+                vm_error("No superclass for super send");
+            } else if ((callee = inline_cache_lookup(method, site, superclass, selector)) == NULL) {
+                vm_error("Method not found in superclass: %s", symbol_to_string(selector));
+            } else if (callee->num_args != arg_count) {
+                vm_error("Wrong argument count for %s: %d", symbol_to_string(selector), arg_count);
+            } else {
+                result = interpreter_activate(callee, base + 1);
             }
-            
-            // Use current receiver for super sends
-            // Perform super send
-            Value result = interpreter_super_send(selector, arg_count, args);
-            
-            // Push result
-            interpreter_push(result);
-            break;
+            LOAD_STATE();
+            UNWIND_IF_RETURNING(result);
+
+            sp = base;
+            PUSH(result);
+            NEXT();
         }
-        
-        case BC_RETURN_LOCAL: {
+
+        CASE(op_return_local, BC_RETURN_LOCAL) {
             // Return from method with top of stack as result
-            Value result = interpreter_pop();
-            
-            // Restore sender frame
+            Value result = POP();
+            SAVE_STATE();
             vm_pop_frame();
-            
-            // Push result on sender's stack
-            if (vm->current_frame != NULL) {
-                interpreter_push(result);
-            }
-            break;
+            return result;
         }
-        
-        case BC_RETURN_NON_LOCAL: {
-            // Return from block (non-local return)
-            // This is more complex and will be implemented later
-            vm_error("Non-local return not implemented yet");
-            break;
+
+        CASE(op_return_non_local, BC_RETURN_NON_LOCAL) {
+            // Return from the block's home method: every frame above the
+            // home frame returns as soon as control comes back to it
+            Value result = POP();
+            SAVE_STATE();
+            Frame* home = context_home_frame(frame);
+            if (home == NULL) {
+                vm_error("Non-local return from a block whose method has returned");
+            } else {
+                vm->return_target = home;
+            }
+            vm_pop_frame();
+            return result;
         }
-        
-        case BC_JUMP: {
-            // Next two bytes are jump offset
-            uint8_t high = method->bytecode[frame->bytecode_index++];
-            uint8_t low = method->bytecode[frame->bytecode_index++];
-            uint16_t offset = (high << 8) | low;
-            
-            // Jump to offset
-            frame->bytecode_index = offset;
-            break;
+
+        CASE(op_jump, BC_JUMP) {
+            // Next two bytes are the absolute jump target
+            uint16_t offset = READ_SHORT();
+            ip = &method->bytecode[offset];
+            NEXT();
         }
-        
-        case BC_JUMP_IF_TRUE: {
-            // Next two bytes are jump offset
-            uint8_t high = method->bytecode[frame->bytecode_index++];
-            uint8_t low = method->bytecode[frame->bytecode_index++];
-            uint16_t offset = (high << 8) | low;
-            
-            // Pop condition
-            Value condition = interpreter_pop();
-            
-            // Jump if true
+
+        CASE(op_jump_if_true, BC_JUMP_IF_TRUE) {
+            uint16_t offset = READ_SHORT();
+            Value condition = POP();
+
             if (is_true(condition) || (!is_false(condition) && !is_nil(condition))) {
-                frame->bytecode_index = offset;
+                ip = &method->bytecode[offset];
             }
-            break;
+            NEXT();
         }
-        
-        case BC_JUMP_IF_FALSE: {
-            // Next two bytes are jump offset
-            uint8_t high = method->bytecode[frame->bytecode_index++];
-            uint8_t low = method->bytecode[frame->bytecode_index++];
-            uint16_t offset = (high << 8) | low;
-            
-            // Pop condition
-            Value condition = interpreter_pop();
-            
-            // Jump if false
+
+        CASE(op_jump_if_false, BC_JUMP_IF_FALSE) {
+            uint16_t offset = READ_SHORT();
+            Value condition = POP();
+
             if (is_false(condition) || is_nil(condition)) {
-                frame->bytecode_index = offset;
+                ip = &method->bytecode[offset];
             }
-            break;
+            NEXT();
         }
-        
-        case BC_PRIMITIVE: {
+
+        CASE(op_primitive, BC_PRIMITIVE) {
             // Next byte is primitive ID followed by argument count
-            uint8_t primitive_id = method->bytecode[frame->bytecode_index++];
-            uint8_t arg_count = method->bytecode[frame->bytecode_index++];
-            
-            // Arguments are on the stack
-            Value args[16]; // Max 16 arguments
-            
-            for (int i = arg_count - 1; i >= 0; i--) {
-                args[i] = interpreter_pop();
+            uint8_t primitive_id = READ_BYTE();
+            arg_count = READ_BYTE();
+
+            // Operands stay on the stack (and visible to the GC) until the
+            // primitive is done with them
+            Value* operands = sp - arg_count;
+
+            SAVE_STATE();
+            Value result = interpreter_primitive(primitive_id, operands, arg_count);
+            LOAD_STATE();
+            UNWIND_IF_RETURNING(result);
+
+            sp = operands;
+            PUSH(result);
+            NEXT();
+        }
+
+        CASE(op_extend, BC_EXTEND) {
+            // The next instruction's index operands are two bytes: decode
+            // them here and join its handler after its own decoding
+            switch (READ_BYTE()) {
+                case BC_PUSH_LOCAL:     arg = READ_SHORT(); goto push_local_decoded;
+                case BC_PUSH_ARGUMENT:  arg = READ_SHORT(); goto push_argument_decoded;
+                case BC_PUSH_FIELD:     arg = READ_SHORT(); goto push_field_decoded;
+                case BC_PUSH_BLOCK:     arg = READ_SHORT(); goto push_block_decoded;
+                case BC_PUSH_CONSTANT:  arg = READ_SHORT(); goto push_constant_decoded;
+                case BC_PUSH_GLOBAL:    arg = READ_SHORT(); goto push_global_decoded;
+                case BC_STORE_LOCAL:    arg = READ_SHORT(); goto store_local_decoded;
+                case BC_STORE_ARGUMENT: arg = READ_SHORT(); goto store_argument_decoded;
+                case BC_STORE_FIELD:    arg = READ_SHORT(); goto store_field_decoded;
+                case BC_STORE_GLOBAL:   arg = READ_SHORT(); goto store_global_decoded;
+                case BC_PUSH_OUTER:
+                    level = READ_BYTE();
+                    arg = READ_SHORT();
+                    goto push_outer_decoded;
+                case BC_STORE_OUTER:
+                    level = READ_BYTE();
+                    arg = READ_SHORT();
+                    goto store_outer_decoded;
+                case BC_SEND:
+                    arg = READ_SHORT();
+                    arg_count = READ_BYTE();
+                    site = READ_SHORT();
+                    goto send_decoded;
+                case BC_SUPER_SEND:
+                    arg = READ_SHORT();
+                    arg_count = READ_BYTE();
+                    site = READ_SHORT();
+                    goto super_send_decoded;
+                default:
+                    SAVE_STATE();
+                    vm_error("Invalid extended bytecode: %d", ip[-1]);
+                    vm_pop_frame();
+                    return vm->nil;
             }
-            
-            // Perform primitive operation
-            Value result = interpreter_primitive(primitive_id, args, arg_count);
-            
-            // Push result
-            interpreter_push(result);
-            break;
         }
-        
+
+        // Superinstructions (see som_parser.c for the pairs they replace)
+        CASE(op_store_local_pop, BC_STORE_LOCAL_POP) {
+            arg = READ_BYTE();
+            frame->stack[arg] = POP();
+            NEXT();
+        }
+
+        CASE(op_return_self, BC_RETURN_SELF) {
+            Value result = frame->receiver;
+            SAVE_STATE();
+            vm_pop_frame();
+            return result;
+        }
+
+        CASE(op_push_field_return, BC_PUSH_FIELD_RETURN) {
+            arg = READ_BYTE();
+            Value result = as_object(frame->receiver)->fields[arg];
+            SAVE_STATE();
+            vm_pop_frame();
+            return result;
+        }
+
+        CASE(op_push_local_send, BC_PUSH_LOCAL_SEND) {
+            // Local index, then the operands of a one-byte BC_SEND
+            arg = READ_BYTE();
+            PUSH(frame->stack[arg]);
+            arg = READ_BYTE();
+            arg_count = READ_BYTE();
+            site = READ_BYTE();
+            goto send_decoded;
+        }
+
+        // Special sends: SmallInteger operands are handled inline, anything
+        // else (including overflow) is sent the selector as usual
+#define ARITHMETIC(label, op, small_op) \
+        CASE(label, op) { \
+            int32_t result; \
+            if (is_int(sp[-2]) && is_int(sp[-1]) && \
+                small_op(as_int(sp[-2]), as_int(sp[-1]), &result)) { \
+                sp--; \
+                sp[-1] = make_int(result); \
+                NEXT(); \
+            } \
+            goto special_send; \
+        }
+#define COMPARISON(label, op, operator) \
+        CASE(label, op) { \
+            if (is_int(sp[-2]) && is_int(sp[-1])) { \
+                bool result = as_int(sp[-2]) operator as_int(sp[-1]); \
+                sp--; \
+                sp[-1] = result ? vm->true_obj : vm->false_obj; \
+                NEXT(); \
+            } \
+            goto special_send; \
+        }
+
+        ARITHMETIC(op_add, BC_ADD, small_int_add)
+        ARITHMETIC(op_sub, BC_SUB, small_int_sub)
+        ARITHMETIC(op_mul, BC_MUL, small_int_mul)
+        ARITHMETIC(op_div, BC_DIV, small_int_div)
+        ARITHMETIC(op_mod, BC_MOD, small_int_mod)
+        COMPARISON(op_lt, BC_LT, <)
+        COMPARISON(op_gt, BC_GT, >)
+        COMPARISON(op_le, BC_LE, <=)
+        COMPARISON(op_ge, BC_GE, >=)
+        COMPARISON(op_eq, BC_EQ, ==)
+        COMPARISON(op_ne, BC_NE, !=)
+
+#undef ARITHMETIC
+#undef COMPARISON
+
+        special_send: {
+            Value selector = vm->special_selectors[ip[-1] - BC_ADD];
+            Value* base = sp - 2;
+
+            // No send site to cache in, so look up through the global cache
+            SAVE_STATE();
+            Method* callee = method_cache_lookup(interpreter_class_of(*base), selector);
+            Value result = vm->nil;
+            if (callee == NULL) {
+                vm_error("Method not found: %s", symbol_to_string(selector));
+            } else if (callee->num_args != 1) {
+                vm_error("Wrong argument count for %s: %d", symbol_to_string(selector), 1);
+            } else {
+                result = interpreter_activate(callee, base + 1);
+            }
+            LOAD_STATE();
+            UNWIND_IF_RETURNING(result);
+
+            sp = base;
+            PUSH(result);
+            NEXT();
+        }
+
+        DEFAULT() {
+            SAVE_STATE();
+            vm_error("Unknown bytecode: %d", ip[-1]);
+
+            // Bail out of the method rather than execute garbage
+            vm_pop_frame();
+            return vm->nil;
+        }
+    }
+
+    // Only reachable if the switch loop is left without a return
+    return vm->nil;
+}
+
+#undef READ_BYTE
+#undef READ_SHORT
+#undef SAVE_STATE
+#undef LOAD_STATE
+#undef PUSH
+#undef POP
+#undef PEEK
+#undef UNWIND_IF_RETURNING
+#undef PROFILE_PAIR
+#undef DISPATCH
+#undef INTERPRET
+#undef CASE
+#undef NEXT
+#undef DEFAULT
+
+// Length in bytes of the instruction at 'ip', including its operands (and
+// a BC_EXTEND prefix, which widens each index operand to two bytes)
+int interpreter_instruction_length(const uint8_t* ip) {
+    if (*ip == BC_EXTEND) {
+        switch (ip[1]) {
+            case BC_PUSH_OUTER:
+            case BC_STORE_OUTER:
+                return 5;
+            case BC_SEND:
+            case BC_SUPER_SEND:
+                return 7;
+            default:
+                return 4;
+        }
+    }
+
+    switch (*ip) {
+        case BC_POP:
+        case BC_DUP:
+        case BC_PUSH_THIS:
+        case BC_PUSH_CONTEXT:
+        case BC_RETURN_LOCAL:
+        case BC_RETURN_NON_LOCAL:
+        case BC_RETURN_SELF:
+            return 1;
+        case BC_ADD: case BC_SUB: case BC_MUL: case BC_DIV: case BC_MOD:
+        case BC_LT: case BC_GT: case BC_LE: case BC_GE: case BC_EQ: case BC_NE:
+            return 1;
+        case BC_PUSH_OUTER:
+        case BC_STORE_OUTER:
+        case BC_JUMP:
+        case BC_JUMP_IF_TRUE:
+        case BC_JUMP_IF_FALSE:
+        case BC_PRIMITIVE:
+            return 3;
+        case BC_SEND:
+        case BC_SUPER_SEND:
+            return 4;
+        case BC_PUSH_LOCAL_SEND:
+            return 5;
         default:
-            vm_error("Unknown bytecode: %d", bytecode);
+            return 2;
     }
 }
 
-// Send a message to a receiver
-Value interpreter_send(Value receiver, Value selector, int arg_count, Value* args) {
-    // Get receiver's class
-    Value class;
-    
+// The class a message to 'receiver' is looked up in
+static Value interpreter_class_of(Value receiver) {
     if (is_int(receiver)) {
-        class = vm->class_Integer;
+        return vm->class_Integer;
     } else if (is_special(receiver)) {
         if (is_nil(receiver)) {
-            class = vm->nil;
+            return vm->class_Nil;
         } else if (is_true(receiver)) {
-            class = vm->true_obj;
+            return vm->class_True;
         } else if (is_false(receiver)) {
-            class = vm->false_obj;
-        } else {
-            vm_error("Unknown special value");
-            return vm->nil;
+            return vm->class_False;
         }
-    } else {
-        class = as_object(receiver)->class;
+        vm_error("Unknown special value");
+        return vm->nil;
     }
-    
-    // Lookup method
-    Method* method = class_lookup_method(class, selector);
+    return object_class(as_object(receiver));
+}
+
+// Find the method a send of 'selector' to 'receiver' should run
+static Method* interpreter_lookup(Value receiver, Value selector) {
+    Method* method = method_cache_lookup(interpreter_class_of(receiver), selector);
     
     if (method == NULL) {
         vm_error("Method not found: %s", symbol_to_string(selector));
+    }
+    
+    return method;
+}
+
+// Send a message to a receiver
+Value interpreter_send(Value receiver, Value selector, int arg_count, Value* args) {
+    Method* method = interpreter_lookup(receiver, selector);
+    
+    if (method == NULL) {
         return vm->nil;
     }
     
@@ -471,7 +888,7 @@ Value interpreter_super_send(Value selector, int arg_count, Value* args) {
     }
     
     // Lookup method in superclass
-    Method* method = class_lookup_method(superclass, selector);
+    Method* method = method_cache_lookup(superclass, selector);
     
     if (method == NULL) {
         vm_error("Method not found in superclass: %s", symbol_to_string(selector));
@@ -487,31 +904,63 @@ Value interpreter_primitive(uint8_t primitive_id, Value* args, int arg_count) {
     switch (primitive_id) {
         case 1: // Integer add
             if (arg_count == 2 && is_int(args[0]) && is_int(args[1])) {
-                return make_int(as_int(args[0]) + as_int(args[1]));
+                int32_t result;
+                if (small_int_add(as_int(args[0]), as_int(args[1]), &result)) {
+                    return make_int(result);
+                }
+            }
+            if (arg_count == 2 && is_integer(args[0]) && is_integer(args[1])) {
+                return integer_add(args[0], args[1]);
             }
             break;
             
         case 2: // Integer subtract
             if (arg_count == 2 && is_int(args[0]) && is_int(args[1])) {
-                return make_int(as_int(args[0]) - as_int(args[1]));
+                int32_t result;
+                if (small_int_sub(as_int(args[0]), as_int(args[1]), &result)) {
+                    return make_int(result);
+                }
+            }
+            if (arg_count == 2 && is_integer(args[0]) && is_integer(args[1])) {
+                return integer_sub(args[0], args[1]);
             }
             break;
             
         case 3: // Integer multiply
             if (arg_count == 2 && is_int(args[0]) && is_int(args[1])) {
-                return make_int(as_int(args[0]) * as_int(args[1]));
+                int32_t result;
+                if (small_int_mul(as_int(args[0]), as_int(args[1]), &result)) {
+                    return make_int(result);
+                }
+            }
+            if (arg_count == 2 && is_integer(args[0]) && is_integer(args[1])) {
+                return integer_mul(args[0], args[1]);
             }
             break;
             
         case 4: // Integer divide
-            if (arg_count == 2 && is_int(args[0]) && is_int(args[1]) && as_int(args[1]) != 0) {
-                return make_int(as_int(args[0]) / as_int(args[1]));
+            if (arg_count == 2 && is_int(args[0]) && is_int(args[1])) {
+                int32_t result;
+                if (small_int_div(as_int(args[0]), as_int(args[1]), &result)) {
+                    return make_int(result);
+                }
+            }
+            if (arg_count == 2 && is_integer(args[0]) && is_integer(args[1]) &&
+                !(is_int(args[1]) && as_int(args[1]) == 0)) {
+                return integer_div(args[0], args[1]);
             }
             break;
             
         case 5: // Integer modulo
-            if (arg_count == 2 && is_int(args[0]) && is_int(args[1]) && as_int(args[1]) != 0) {
-                return make_int(as_int(args[0]) % as_int(args[1]));
+            if (arg_count == 2 && is_int(args[0]) && is_int(args[1])) {
+                int32_t result;
+                if (small_int_mod(as_int(args[0]), as_int(args[1]), &result)) {
+                    return make_int(result);
+                }
+            }
+            if (arg_count == 2 && is_integer(args[0]) && is_integer(args[1]) &&
+                !(is_int(args[1]) && as_int(args[1]) == 0)) {
+                return integer_mod(args[0], args[1]);
             }
             break;
             
@@ -519,31 +968,33 @@ Value interpreter_primitive(uint8_t primitive_id, Value* args, int arg_count) {
             if (arg_count == 2 && is_int(args[0]) && is_int(args[1])) {
                 return as_int(args[0]) == as_int(args[1]) ? vm->true_obj : vm->false_obj;
             }
+            if (arg_count == 2 && is_integer(args[0]) && is_integer(args[1])) {
+                return integer_compare(args[0], args[1]) == 0 ? vm->true_obj : vm->false_obj;
+            }
+            if (arg_count == 2 && is_integer(args[0])) {
+                return vm->false_obj; // Only integers equal integers
+            }
             break;
             
         case 7: // Integer less than
             if (arg_count == 2 && is_int(args[0]) && is_int(args[1])) {
                 return as_int(args[0]) < as_int(args[1]) ? vm->true_obj : vm->false_obj;
             }
+            if (arg_count == 2 && is_integer(args[0]) && is_integer(args[1])) {
+                return integer_compare(args[0], args[1]) < 0 ? vm->true_obj : vm->false_obj;
+            }
             break;
             
-        case 8: // Object equality
+        case 8:  // Object equality
+        case 29: // Object inequality
             if (arg_count == 2) {
-                return value_equals(args[0], args[1]) ? vm->true_obj : vm->false_obj;
+                return value_equals(args[0], args[1]) == (primitive_id == 8) ? vm->true_obj : vm->false_obj;
             }
             break;
             
         case 9: // Object class
             if (arg_count == 1) {
-                if (is_int(args[0])) {
-                    return vm->class_Integer;
-                } else if (is_special(args[0])) {
-                    if (is_nil(args[0])) return vm->nil;
-                    if (is_true(args[0])) return vm->true_obj;
-                    if (is_false(args[0])) return vm->false_obj;
-                } else {
-                    return as_object(args[0])->class;
-                }
+                return interpreter_class_of(args[0]);
             }
             break;
             
@@ -558,7 +1009,7 @@ Value interpreter_primitive(uint8_t primitive_id, Value* args, int arg_count) {
                 Object* array = as_object(args[0]);
                 uint16_t index = as_int(args[1]);
                 
-                if (array->flags & FLAG_ARRAY && index < array->size) {
+                if (array->class_index == CLASS_INDEX_ARRAY && index < array->size) {
                     return array->fields[index];
                 }
             }
@@ -569,7 +1020,8 @@ Value interpreter_primitive(uint8_t primitive_id, Value* args, int arg_count) {
                 Object* array = as_object(args[0]);
                 uint16_t index = as_int(args[1]);
                 
-                if (array->flags & FLAG_ARRAY && index < array->size) {
+                if (array->class_index == CLASS_INDEX_ARRAY && index < array->size) {
+                    gc_write_barrier(array, args[2]);
                     array->fields[index] = args[2];
                     return args[2];
                 }
@@ -580,7 +1032,7 @@ Value interpreter_primitive(uint8_t primitive_id, Value* args, int arg_count) {
             if (arg_count == 1 && is_object(args[0])) {
                 Object* array = as_object(args[0]);
                 
-                if (array->flags & FLAG_ARRAY) {
+                if (array->class_index == CLASS_INDEX_ARRAY) {
                     return make_int(array->size);
                 }
             }
@@ -590,18 +1042,18 @@ Value interpreter_primitive(uint8_t primitive_id, Value* args, int arg_count) {
             if (arg_count == 1 && is_object(args[0])) {
                 Object* string = as_object(args[0]);
                 
-                if (string->class.bits == vm->class_String.bits) {
-                    return string->fields[0]; // Length stored in first field
+                if (string->class_index == CLASS_INDEX_STRING) {
+                    return make_int(((String*)string)->length);
                 }
             }
             break;
             
         case 15: // Print
             if (arg_count == 1) {
-                if (is_object(args[0]) && as_object(args[0])->class.bits == vm->class_String.bits) {
-                    printf("%s", string_to_cstring(args[0]));
+                if (is_object(args[0]) && as_object(args[0])->class_index == CLASS_INDEX_STRING) {
+                    fwrite(string_to_cstring(args[0]), 1, string_length(args[0]), stdout);
                 } else {
-                    value_print(args[0]);
+                    object_print(args[0]);
                 }
                 return vm->nil;
             }
@@ -609,16 +1061,140 @@ Value interpreter_primitive(uint8_t primitive_id, Value* args, int arg_count) {
             
         case 16: // Println
             if (arg_count == 1) {
-                if (is_object(args[0]) && as_object(args[0])->class.bits == vm->class_String.bits) {
-                    printf("%s\n", string_to_cstring(args[0]));
+                if (is_object(args[0]) && as_object(args[0])->class_index == CLASS_INDEX_STRING) {
+                    fwrite(string_to_cstring(args[0]), 1, string_length(args[0]), stdout);
+                    putchar('\n');
                 } else {
-                    value_print(args[0]);
+                    object_print(args[0]);
                     printf("\n");
                 }
                 return vm->nil;
             }
             break;
             
+        case 17: // StringBuilder new (sent to the class)
+            if (arg_count == 1 && args[0].bits == vm->class_StringBuilder.bits) {
+                return string_builder_new();
+            }
+            break;
+            
+        case 18: // StringBuilder append
+            if (arg_count == 2 && is_object(args[0]) && is_object(args[1]) &&
+                as_object(args[0])->class_index == CLASS_INDEX_STRING_BUILDER &&
+                is_string(args[1])) {
+                string_builder_append(args[0], args[1]);
+                return args[0];
+            }
+            break;
+            
+        case 19: // StringBuilder as string
+            if (arg_count == 1 && is_object(args[0]) &&
+                as_object(args[0])->class_index == CLASS_INDEX_STRING_BUILDER) {
+                return string_builder_to_string(args[0]);
+            }
+            break;
+            
+        case 20: // StringBuilder size
+            if (arg_count == 1 && is_object(args[0]) &&
+                as_object(args[0])->class_index == CLASS_INDEX_STRING_BUILDER) {
+                return make_int(string_builder_length(args[0]));
+            }
+            break;
+            
+        case 21: // Block value (value, value:, value:with:, ...)
+            if (arg_count >= 1 && is_object(args[0]) &&
+                as_object(args[0])->class_index == CLASS_INDEX_BLOCK) {
+                return interpreter_block_value(args + 1, arg_count - 1);
+            }
+            break;
+            
+        case 22: // Context sender (nil once the context's frame has returned)
+        case 23: // Context method
+        case 24: // Context receiver
+            if (arg_count == 1 && is_object(args[0]) &&
+                as_object(args[0])->class_index == CLASS_INDEX_CONTEXT) {
+                Frame* frame = context_frame((Context*)as_object(args[0]));
+                if (frame == NULL) {
+                    return vm->nil;
+                }
+                if (primitive_id == 22) {
+                    return frame->sender != NULL ? context_for_frame(frame->sender) : vm->nil;
+                }
+                return primitive_id == 23 ? make_object((Object*)frame->method) : frame->receiver;
+            }
+            break;
+            
+        case 25: // Integer greater than
+        case 26: // Integer less than or equal
+        case 27: // Integer greater than or equal
+        case 28: // Integer inequality
+            if (arg_count == 2 && is_integer(args[0]) && is_integer(args[1])) {
+                int order = integer_compare(args[0], args[1]);
+                bool result = primitive_id == 25 ? order > 0
+                            : primitive_id == 26 ? order <= 0
+                            : primitive_id == 27 ? order >= 0
+                            : order != 0;
+                return result ? vm->true_obj : vm->false_obj;
+            }
+            if (arg_count == 2 && primitive_id == 28 && is_integer(args[0])) {
+                return vm->true_obj;
+            }
+            break;
+
+        case 30: // Object isNil
+        case 31: // Object notNil
+            if (arg_count == 1) {
+                return is_nil(args[0]) == (primitive_id == 30) ? vm->true_obj : vm->false_obj;
+            }
+            break;
+
+        case 32: // Boolean ifTrue:
+        case 33: // Boolean ifFalse:
+        case 34: // Boolean ifTrue:ifFalse:
+        case 35: // Boolean ifFalse:ifTrue:
+        case 36: // Boolean and:
+        case 37: // Boolean or:
+            if (arg_count >= 2 && (is_true(args[0]) || is_false(args[0]))) {
+                bool condition = is_true(args[0]);
+                int chosen;      // Argument whose value is the answer, or 0 for none
+                Value otherwise = vm->nil;
+
+                switch (primitive_id) {
+                    case 32: chosen = condition ? 1 : 0; break;
+                    case 33: chosen = condition ? 0 : 1; break;
+                    case 34: chosen = condition ? 1 : 2; break;
+                    case 35: chosen = condition ? 2 : 1; break;
+                    case 36: chosen = condition ? 1 : 0; otherwise = vm->false_obj; break;
+                    default: chosen = condition ? 0 : 1; otherwise = vm->true_obj; break;
+                }
+
+                // Blocks are evaluated; anything else answers itself
+                if (chosen == 0) {
+                    return otherwise;
+                }
+                if (is_object(args[chosen]) && as_object(args[chosen])->class_index == CLASS_INDEX_BLOCK) {
+                    return interpreter_block_value(args + chosen + 1, 0);
+                }
+                return args[chosen];
+            }
+            break;
+
+        case 38: // Boolean &
+        case 39: // Boolean |
+            if (arg_count == 2 && (is_true(args[0]) || is_false(args[0])) &&
+                (is_true(args[1]) || is_false(args[1]))) {
+                bool result = primitive_id == 38 ? is_true(args[0]) && is_true(args[1])
+                                                 : is_true(args[0]) || is_true(args[1]);
+                return result ? vm->true_obj : vm->false_obj;
+            }
+            break;
+
+        case 40: // Boolean not
+            if (arg_count == 1 && (is_true(args[0]) || is_false(args[0]))) {
+                return is_true(args[0]) ? vm->false_obj : vm->true_obj;
+            }
+            break;
+            
         // Agon-specific primitives
         case 100: // VDP draw pixel
             if (arg_count == 3 && is_int(args[0]) && is_int(args[1]) && is_int(args[2])) {
@@ -665,8 +1241,8 @@ Value interpreter_primitive(uint8_t primitive_id, Value* args, int arg_count) {
             if (arg_count == 2 && 
                 is_object(args[0]) && 
                 is_object(args[1]) && 
-                as_object(args[0])->class.bits == vm->class_String.bits &&
-                as_object(args[1])->class.bits == vm->class_String.bits) {
+                as_object(args[0])->class_index == CLASS_INDEX_STRING &&
+                as_object(args[1])->class_index == CLASS_INDEX_STRING) {
                 const char* filename = string_to_cstring(args[0]);
                 const char* mode = string_to_cstring(args[1]);
                 // Call Agon file function (to be implemented)
@@ -21,13 +21,22 @@ void interpreter_push(Value value);
 Value interpreter_pop();
 Value interpreter_peek();
 
-// Handle bytecode instruction
-void interpreter_handle_bytecode(uint8_t bytecode);
-
 // Dispatch message send
 Value interpreter_send(Value receiver, Value selector, int arg_count, Value* args);
 Value interpreter_super_send(Value selector, int arg_count, Value* args);
 
+// Evaluate a block whose arguments are on the frame stack, with the block
+// itself at arguments[-1]
+Value interpreter_block_value(Value* arguments, int arg_count);
+
+// Bytecode layout
+int interpreter_instruction_length(const uint8_t* ip);
+
+#ifdef POPLAR2_PROFILE_PAIRS
+// Bytecode pair counts (build with PROFILE=pairs)
+void interpreter_print_pair_profile();
+#endif
+
 // Primitive handling
 Value interpreter_primitive(uint8_t primitive_id, Value* args, int arg_count);
 
@@ -0,0 +1,78 @@
+// method_cache.c - Global method lookup cache for Poplar2
+
+#include "method_cache.h"
+#include "object.h"
+#include "gc.h"
+#include <string.h>
+
+// A 2-way set-associative cache from (class, selector) to Method*. Each set
+// keeps its most recently filled entry first; a miss evicts the second way.
+//
+// Keys and methods are raw object addresses, so the cache has to be flushed
+// whenever objects move. Only old objects are cached: classes, selectors and
+// methods are nearly always old anyway, and then a scavenge, which moves
+// nursery objects alone, leaves every entry valid.
+typedef struct {
+    uint32_t class_bits;
+    uint32_t selector_bits;
+    Method* method;
+} CacheEntry;
+
+static CacheEntry cache[METHOD_CACHE_SETS][2];
+
+static inline uint16_t cache_index(Value class, Value selector) {
+    // Object addresses are at least 4-byte aligned, so drop the low bits
+    uint32_t hash = (class.bits >> 2) ^ (selector.bits >> 4) ^ (selector.bits >> 11);
+    return hash & (METHOD_CACHE_SETS - 1);
+}
+
+// Look up a method through the cache
+Method* method_cache_lookup(Value class, Value selector) {
+    CacheEntry* set = cache[cache_index(class, selector)];
+
+    if (set[0].class_bits == class.bits && set[0].selector_bits == selector.bits && set[0].method != NULL) {
+        vm->method_cache_hits++;
+        return set[0].method;
+    }
+
+    if (set[1].class_bits == class.bits && set[1].selector_bits == selector.bits && set[1].method != NULL) {
+        vm->method_cache_hits++;
+
+        // Swap so the hot entry is checked first next time
+        CacheEntry hit = set[1];
+        set[1] = set[0];
+        set[0] = hit;
+        return hit.method;
+    }
+
+    vm->method_cache_misses++;
+
+    Method* method = class_lookup_method(class, selector);
+
+    // Failed lookups are not cached, nor are young objects
+    if (method != NULL && !gc_in_nursery(method) &&
+        !gc_in_nursery(as_object(class)) && !gc_in_nursery(as_object(selector))) {
+        set[1] = set[0];
+        set[0].class_bits = class.bits;
+        set[0].selector_bits = selector.bits;
+        set[0].method = method;
+    }
+
+    return method;
+}
+
+// Drop every cached entry
+void method_cache_flush() {
+    memset(cache, 0, sizeof(cache));
+}
+
+// Drop the entries for one selector
+void method_cache_invalidate_selector(Value selector) {
+    for (int i = 0; i < METHOD_CACHE_SETS; i++) {
+        for (int way = 0; way < 2; way++) {
+            if (cache[i][way].selector_bits == selector.bits) {
+                cache[i][way].method = NULL;
+            }
+        }
+    }
+}
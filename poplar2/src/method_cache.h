@@ -0,0 +1,17 @@
+// method_cache.h - Global method lookup cache for Poplar2
+
+#ifndef POPLAR2_METHOD_CACHE_H
+#define POPLAR2_METHOD_CACHE_H
+
+#include "vm.h"
+
+// Look up a method through the cache, falling back to class_lookup_method
+Method* method_cache_lookup(Value class, Value selector);
+
+// Drop every cached entry
+void method_cache_flush();
+
+// Drop the entries for one selector (after a method is installed)
+void method_cache_invalidate_selector(Value selector);
+
+#endif /* POPLAR2_METHOD_CACHE_H */
@@ -2,73 +2,145 @@
 
 #include "object.h"
 #include "gc.h"
+#include "method_cache.h"
+#include "integer.h"
+#include "verifier.h"
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
 
-// Symbol table (for fast symbol lookup)
+// Symbol table
+//
+// Interned symbols live in an open-addressed hash table keyed by string hash
+// and length, so interning never builds a temporary String and characters
+// are only compared on a full hash and length match. The table doubles
+// when it would become more than 3/4 full.
 typedef struct {
-    char* string;
-    Value symbol;
+    uint32_t hash;
+    uint16_t length;
+    Value symbol;      // Not an object for an empty slot
 } SymbolEntry;
 
-static SymbolEntry symbol_table[256];
-static int symbol_count = 0;
+#define SYMBOL_TABLE_MIN_CAPACITY 256
 
-// Create a new object
-Object* object_new(Value class, uint16_t size) {
+static SymbolEntry* symbol_table = NULL;
+static uint32_t symbol_capacity = 0;  // Power of two
+static uint32_t symbol_count = 0;
+
+static Value symbol_lookup(const char* chars, uint16_t length);
+static String* string_allocate(Value class, uint32_t length);
+static Object* object_allocate(Value class, uint32_t size);
+
+// Create a new object, or answer NULL if the header cannot hold its size
+Object* object_new(Value class, uint32_t size) {
+    if (size > MAX_OBJECT_FIELDS) {
+        vm_error("Object too large: %u fields (at most %u)", size, (unsigned)MAX_OBJECT_FIELDS);
+        return NULL;
+    }
+
+    return object_allocate(class, size);
+}
+
+// Create an object of 'size' fields, which the caller has checked
+static Object* object_allocate(Value class, uint32_t size) {
     // Calculate total size in bytes
     uint32_t byte_size = sizeof(Object) + size * sizeof(Value);
     
-    // Allocate memory
+    // Allocate memory (the class may move)
+    gc_push_root(&class);
     Object* obj = (Object*)gc_allocate(byte_size);
+    gc_pop_roots(1);
     
-    // Initialize object
-    obj->class = class;
-    obj->hash = 0; // Will be set when needed
+    // Initialize object (nil, the class of Class while it is being created,
+    // has no index)
+    obj->format = FORMAT_POINTERS;
     obj->flags = 0;
+    obj->class_index = is_object(class) ? as_int(((Class*)as_object(class))->index) : CLASS_INDEX_NONE;
+    obj->hash = 0; // Will be set when needed
     obj->size = size;
     
     // Initialize fields to nil
-    for (int i = 0; i < size; i++) {
+    for (uint32_t i = 0; i < size; i++) {
         obj->fields[i] = vm->nil;
     }
     
+    // Objects allocated straight into old space are initialized without
+    // write barriers, so remember them until the next scavenge
+    if (!gc_in_nursery(obj)) {
+        gc_remember(obj);
+    }
+    
     return obj;
 }
 
 // Create a new class
 Class* class_new(const char* name, Value superclass, uint16_t instance_size) {
+    // Allocate what the class refers to first, so that nothing moves once
+    // the class itself exists
+    Value class_name = symbol_for(name);
+    gc_push_root(&class_name);
+    gc_push_root(&superclass);
+    Value methods = array_new(0);
+    gc_push_root(&methods);
+
     // Create class object
-    Object* obj = object_new(vm->class_Class, sizeof(Class) / sizeof(Value));
+    Object* obj = object_new(vm->class_Class, CLASS_FIELDS);
     Class* class = (Class*)obj;
+    gc_pop_roots(3);
     
     // Set fields
-    class->name = symbol_for(name);
+    class->name = class_name;
     class->superclass = superclass;
-    class->methods = array_new(0);
+    class->methods = methods;
+    class->method_count = make_int(0);
     class->instance_size = make_int(instance_size);
-    
-    // Set class flag
-    obj->flags |= FLAG_CLASS;
+    class->method_dict = vm->nil; // Created by the first class_add_method
+    class_register(class);
     
     return class;
 }
 
+// Give a class the next index in the class table
+void class_register(Class* class) {
+    if (vm->class_count == 0) {
+        vm->class_count = 1; // Index 0 means no class
+    }
+
+    // Instances of a class without an index could not name it, so running
+    // out of indices is fatal
+    if (vm->class_count >= MAX_CLASSES) {
+        fprintf(stderr, "Class table is full: at most %d classes\n", MAX_CLASSES - 1);
+        exit(1);
+    }
+
+    class->index = make_int(vm->class_count);
+    vm->class_table[vm->class_count++] = make_object((Object*)class);
+}
+
 // Create a new method
-Method* method_new(const char* name, uint8_t num_args, uint8_t num_locals) {
-    // Calculate size for method (fixed fields + bytecode array)
-    Object* obj = object_new(vm->class_Method, sizeof(Method) / sizeof(Value));
+Method* method_new(const char* name, uint8_t num_args, uint16_t num_locals, const uint8_t* bytecode, uint16_t bytecode_count) {
+    Value method_name = symbol_for(name);
+
+    // Fixed fields, then exactly the bytecode
+    gc_push_root(&method_name);
+    Object* obj = object_new(vm->class_Method, METHOD_FIELDS(bytecode_count));
+    gc_pop_roots(1);
     Method* method = (Method*)obj;
     
     // Set fields
-    method->name = symbol_for(name);
+    method->name = method_name;
     method->holder = vm->nil; // Will be set when added to a class
+    method->send_caches = vm->nil; // Allocated by the compiler (inline_cache_init)
+    method->literals = vm->nil; // Built by the compiler (see literal_frame_finish)
     method->num_args = num_args;
     method->num_locals = num_locals;
-    method->bytecode_count = 0;
+    method->bytecode_count = bytecode_count;
+    memcpy(method->bytecode, bytecode, bytecode_count);
+    method->max_stack = DEFAULT_MAX_STACK; // Until verified (see verifier.h)
+    method->cache_epoch = vm->cache_epoch;
     
-    // Set method flag
-    obj->flags |= FLAG_METHOD;
+    // Only the leading fields are Values
+    obj->format = FORMAT_METHOD;
     
     return method;
 }
@@ -88,6 +160,7 @@ void object_set_field(Object* object, uint16_t index, Value value) {
         vm_error("Field index out of bounds: %d (size: %d)", index, object->size);
         return;
     }
+    gc_write_barrier(object, value);
     object->fields[index] = value;
 }
 
@@ -127,53 +200,87 @@ Value class_get_name(Value class_value) {
     return class->name;
 }
 
+// Method dictionaries
+//
+// Each class keeps an open-addressed hash table from selector to method in
+// method_dict: an Array of 2 * capacity slots holding key/value pairs, with
+// a power-of-two capacity and nil marking empty slots. Selectors are
+// interned symbols, so probing compares Value bits and never strings. The
+// probe starts at the symbol's string hash (all of it: the 6 bits cached in
+// the header would crowd large tables), which depends only on its
+// characters and so survives the object moving.
+#define METHOD_DICT_MIN_CAPACITY 8
+#define CLASS_METHODS_MIN_CAPACITY 4
+
+static Method* method_dict_at(Value dict, Value selector, uint32_t hash) {
+    if (!is_object(dict)) {
+        return NULL;
+    }
+
+    Object* table = as_object(dict);
+    uint16_t mask = table->size / 2 - 1;
+
+    for (uint16_t i = hash & mask;; i = (i + 1) & mask) {
+        Value key = table->fields[2 * i];
+        if (key.bits == selector.bits) {
+            return (Method*)as_object(table->fields[2 * i + 1]);
+        }
+        if (is_nil(key)) {
+            return NULL;
+        }
+    }
+}
+
+// Store into a table known to have a free slot; returns true if the
+// selector was not there before
+static bool method_dict_put(Object* table, Value selector, Value method) {
+    uint16_t mask = table->size / 2 - 1;
+
+    for (uint16_t i = string_value_hash(selector) & mask;; i = (i + 1) & mask) {
+        Value key = table->fields[2 * i];
+        if (is_nil(key) || key.bits == selector.bits) {
+            gc_write_barrier(table, selector);
+            gc_write_barrier(table, method);
+            table->fields[2 * i] = selector;
+            table->fields[2 * i + 1] = method;
+            return is_nil(key);
+        }
+    }
+}
+
 // Lookup a method in a class hierarchy
 Method* class_lookup_method(Value class_value, Value selector) {
-    if (!is_object(class_value)) {
+    if (!is_object(class_value) || !is_object(selector)) {
         return NULL;
     }
     
-    // Handle symbols or strings as selector name
-    const char* selector_name = NULL;
-    if (is_object(selector)) {
-        if (as_object(selector)->flags & FLAG_SYMBOL) {
-            selector_name = symbol_to_string(selector);
-        } else if (as_object(selector)->class.bits == vm->class_String.bits) {
-            selector_name = string_to_cstring(selector);
+    // Methods are keyed by interned symbols
+    if (as_object(selector)->class_index != CLASS_INDEX_SYMBOL) {
+        if (as_object(selector)->class_index != CLASS_INDEX_STRING) {
+            return NULL;
+        }
+
+        // Lookups never intern: no symbol means no method by that name
+        String* string = (String*)as_object(selector);
+        if (string->length > UINT16_MAX) {
+            return NULL;
+        }
+        selector = symbol_lookup(string->chars, (uint16_t)string->length);
+        if (is_nil(selector)) {
+            return NULL;
         }
-    } else if (is_int(selector) || is_special(selector)) {
-        // Cannot lookup with these types
-        return NULL;
     }
     
+    uint32_t hash = string_value_hash(selector);
+    
     // Start from current class and walk up the hierarchy
     Value current = class_value;
     while (!is_nil(current)) {
         Class* class = (Class*)as_object(current);
         
-        // Check methods in this class
-        Value methods = class->methods;
-        if (is_object(methods) && (as_object(methods)->flags & FLAG_ARRAY)) {
-            Object* methods_obj = as_object(methods);
-            
-            for (int i = 0; i < methods_obj->size; i++) {
-                Value method_value = methods_obj->fields[i];
-                if (is_object(method_value) && (as_object(method_value)->flags & FLAG_METHOD)) {
-                    Method* method = (Method*)as_object(method_value);
-                    
-                    // Compare by name if we have a string selector
-                    if (selector_name != NULL) {
-                        const char* method_name = symbol_to_string(method->name);
-                        if (strcmp(method_name, selector_name) == 0) {
-                            return method;
-                        }
-                    }
-                    // Otherwise compare values directly
-                    else if (value_equals(method->name, selector)) {
-                        return method;
-                    }
-                }
-            }
+        Method* method = method_dict_at(class->method_dict, selector, hash);
+        if (method != NULL) {
+            return method;
         }
         
         // Move up to superclass
@@ -184,58 +291,244 @@ Method* class_lookup_method(Value class_value, Value selector) {
     return NULL;
 }
 
-// Symbol handling
-Value symbol_for(const char* string) {
-    // First check if the symbol already exists
-    for (int i = 0; i < symbol_count; i++) {
-        if (strcmp(symbol_table[i].string, string) == 0) {
-            return symbol_table[i].symbol;
+// Install a method in a class, replacing any method with the same selector
+void class_add_method(Value class_value, Value method_value) {
+    Method* method = (Method*)as_object(method_value);
+    Value selector = method->name;
+
+    // The method dictionary and methods array may need reallocating
+    gc_push_root(&class_value);
+    gc_push_root(&method_value);
+    gc_push_root(&selector);
+
+    gc_write_barrier((Object*)method, class_value);
+    method->holder = class_value;
+
+    // Nothing is installed that could run outside its frame or literals
+    if (!verifier_verify(method)) {
+        gc_pop_roots(3);
+        return;
+    }
+
+    // Any class may now answer this selector differently
+    method_cache_invalidate_selector(selector);
+    vm->cache_epoch++;
+
+    // Replacing an existing method keeps the table and the methods array
+    Class* class = (Class*)as_object(class_value);
+    Object* methods = is_object(class->methods) ? as_object(class->methods) : NULL;
+    uint16_t count = as_int(class->method_count);
+
+    if (method_dict_at(class->method_dict, selector, string_value_hash(selector)) != NULL) {
+        method_dict_put(as_object(class->method_dict), selector, method_value);
+        for (uint16_t i = 0; i < count; i++) {
+            if (((Method*)as_object(methods->fields[i]))->name.bits == selector.bits) {
+                object_set_field(methods, i, method_value);
+            }
         }
+        gc_pop_roots(3);
+        return;
     }
-    
-    // Create a new symbol
-    Value str = string_new(string);
-    Object* str_obj = as_object(str);
-    
-    // Create symbol object (just a string with the symbol flag)
-    Object* symbol_obj = object_new(vm->class_Symbol, str_obj->size);
-    
-    // Copy string data
-    memcpy(symbol_obj->fields, str_obj->fields, str_obj->size * sizeof(Value));
-    
-    // Set symbol flag
-    symbol_obj->flags |= FLAG_SYMBOL;
-    
-    // Create symbol value
-    Value symbol = make_object(symbol_obj);
-    
-    // Add to symbol table
-    if (symbol_count < 256) {
-        symbol_table[symbol_count].string = strdup(string);
-        symbol_table[symbol_count].symbol = symbol;
-        symbol_count++;
-    } else {
-        vm_error("Symbol table full");
+
+    // The methods array (kept for reflection) doubles when full, so
+    // installing n methods copies O(n) of them overall
+    if (methods == NULL || count == methods->size) {
+        uint32_t new_size = count ? count * 2 : CLASS_METHODS_MIN_CAPACITY;
+        Value new_methods = array_new(new_size < MAX_OBJECT_FIELDS ? new_size : MAX_OBJECT_FIELDS);
+        if (is_nil(new_methods) || as_object(new_methods)->size == count) {
+            vm_error("Too many methods in one class");
+            gc_pop_roots(3);
+            return;
+        }
+
+        class = (Class*)as_object(class_value);
+        for (uint16_t i = 0; i < count; i++) {
+            array_at_put(new_methods, i, as_object(class->methods)->fields[i]);
+        }
+        gc_write_barrier((Object*)class, new_methods);
+        class->methods = new_methods;
     }
-    
+
+    // Grow the table when it would become more than 3/4 full
+    uint16_t capacity = is_object(class->method_dict) ? as_object(class->method_dict)->size / 2 : 0;
+    if ((count + 1) * 4 > capacity * 3) {
+        uint16_t new_capacity = capacity ? capacity * 2 : METHOD_DICT_MIN_CAPACITY;
+        Value new_dict = array_new(new_capacity * 2);
+        if (is_nil(new_dict)) {
+            gc_pop_roots(3);
+            return;
+        }
+        Object* new_table = as_object(new_dict);
+
+        class = (Class*)as_object(class_value);
+        for (uint16_t i = 0; i < capacity; i++) {
+            Value key = as_object(class->method_dict)->fields[2 * i];
+            if (!is_nil(key)) {
+                method_dict_put(new_table, key, as_object(class->method_dict)->fields[2 * i + 1]);
+            }
+        }
+        gc_write_barrier((Object*)class, new_dict);
+        class->method_dict = new_dict;
+    }
+
+    method_dict_put(as_object(class->method_dict), selector, method_value);
+    array_at_put(class->methods, count, method_value);
+    class->method_count = make_int(count + 1);
+
+    gc_pop_roots(3);
+}
+
+// Hash the characters of a string or symbol
+//
+// The low 6 bits are the hash cached in object headers.
+uint32_t string_hash(const char* chars, uint32_t length) {
+    uint32_t hash = 0;
+
+    for (uint32_t i = 0; i < length; i++) {
+        hash = (hash * 31) + (uint8_t)chars[i];
+    }
+
+    return hash;
+}
+
+// Double the symbol table (or create it), reinserting every entry
+static void symbol_table_grow() {
+    uint32_t new_capacity = symbol_capacity ? symbol_capacity * 2 : SYMBOL_TABLE_MIN_CAPACITY;
+    SymbolEntry* new_table = calloc(new_capacity, sizeof(SymbolEntry));
+
+    if (new_table == NULL) {
+        fprintf(stderr, "Failed to allocate symbol table\n");
+        exit(1);
+    }
+
+    for (uint32_t i = 0; i < symbol_capacity; i++) {
+        if (is_object(symbol_table[i].symbol)) {
+            uint32_t index = symbol_table[i].hash & (new_capacity - 1);
+
+            while (is_object(new_table[index].symbol)) {
+                index = (index + 1) & (new_capacity - 1);
+            }
+            new_table[index] = symbol_table[i];
+        }
+    }
+
+    free(symbol_table);
+    symbol_table = new_table;
+    symbol_capacity = new_capacity;
+}
+
+// Find the slot holding a symbol, or the empty slot where it would go
+static uint32_t symbol_table_slot(const char* chars, uint16_t length, uint32_t hash) {
+    uint32_t index = hash & (symbol_capacity - 1);
+
+    while (is_object(symbol_table[index].symbol)) {
+        SymbolEntry* entry = &symbol_table[index];
+
+        if (entry->hash == hash && entry->length == length &&
+            memcmp(((String*)as_object(entry->symbol))->chars, chars, length) == 0) {
+            break;
+        }
+        index = (index + 1) & (symbol_capacity - 1);
+    }
+
+    return index;
+}
+
+// The existing symbol for some characters, or nil (never allocates)
+static Value symbol_lookup(const char* chars, uint16_t length) {
+    if (symbol_capacity == 0) {
+        return vm->nil;
+    }
+
+    Value symbol = symbol_table[symbol_table_slot(chars, length, string_hash(chars, length))].symbol;
+    return is_object(symbol) ? symbol : vm->nil;
+}
+
+// Intern the symbol for 'length' characters at 'chars'
+//
+// Creating the symbol may collect garbage, so 'chars' must not point into
+// the heap.
+Value symbol_for_chars(const char* chars, uint16_t length) {
+    if ((symbol_count + 1) * 4 > symbol_capacity * 3) {
+        symbol_table_grow();
+    }
+
+    uint32_t hash = string_hash(chars, length);
+    uint32_t index = symbol_table_slot(chars, length, hash);
+
+    // First check if the symbol already exists
+    if (is_object(symbol_table[index].symbol)) {
+        return symbol_table[index].symbol;
+    }
+
+    // Create the symbol directly, with its hash already cached
+    String* symbol_obj = string_allocate(vm->class_Symbol, length);
+    if (symbol_obj == NULL) {
+        return vm->nil;
+    }
+    memcpy(symbol_obj->chars, chars, length);
+    symbol_obj->hash = hash;
+    symbol_obj->object.hash = (hash & 0x3F) ? (hash & 0x3F) : 1;
+
+    // Add to symbol table (collecting garbage does not rehash it)
+    Value symbol = make_object(&symbol_obj->object);
+    symbol_table[index].hash = hash;
+    symbol_table[index].length = length;
+    symbol_table[index].symbol = symbol;
+    symbol_count++;
+
     return symbol;
 }
 
+// Intern the symbol for a C string
+Value symbol_for(const char* string) {
+    return symbol_for_chars(string, (uint16_t)strlen(string));
+}
+
+// Visit every interned symbol (GC roots)
+void symbol_table_visit(GcVisitor visit) {
+    for (uint32_t i = 0; i < symbol_capacity; i++) {
+        if (is_object(symbol_table[i].symbol)) {
+            visit(&symbol_table[i].symbol);
+        }
+    }
+}
+
+// Give the symbols interned before the Symbol class existed (the names of
+// the classes created up to it) their class
+void symbol_table_adopt_early_symbols() {
+    uint16_t class_index = (uint16_t)as_int(((Class*)as_object(vm->class_Symbol))->index);
+
+    for (uint32_t i = 0; i < symbol_capacity; i++) {
+        if (is_object(symbol_table[i].symbol) &&
+            as_object(symbol_table[i].symbol)->class_index == CLASS_INDEX_NONE) {
+            as_object(symbol_table[i].symbol)->class_index = class_index;
+        }
+    }
+}
+
+// Release the symbol table (the symbols themselves live in the heap)
+void symbol_table_cleanup() {
+    free(symbol_table);
+    symbol_table = NULL;
+    symbol_capacity = 0;
+    symbol_count = 0;
+}
+
 // Convert symbol to string
 const char* symbol_to_string(Value symbol) {
-    if (!is_object(symbol) || !(as_object(symbol)->flags & FLAG_SYMBOL)) {
+    if (!is_object(symbol) || as_object(symbol)->class_index != CLASS_INDEX_SYMBOL) {
         vm_error("Expected symbol");
         return "<not a symbol>";
     }
     
-    return string_to_cstring(symbol);
+    return ((String*)as_object(symbol))->chars;
 }
 
-// Create a new array
+// Create a new array (nil if it would be too large)
 Value array_new(uint16_t size) {
     Object* array = object_new(vm->class_Array, size);
-    array->flags |= FLAG_ARRAY;
-    return make_object(array);
+    return array != NULL ? make_object(array) : vm->nil;
 }
 
 // Get array element at index
@@ -247,7 +540,7 @@ Value array_at(Value array_value, uint16_t index) {
     
     Object* array = as_object(array_value);
     
-    if (!(array->flags & FLAG_ARRAY)) {
+    if (array->class_index != CLASS_INDEX_ARRAY) {
         vm_error("Expected array");
         return vm->nil;
     }
@@ -269,7 +562,7 @@ void array_at_put(Value array_value, uint16_t index, Value value) {
     
     Object* array = as_object(array_value);
     
-    if (!(array->flags & FLAG_ARRAY)) {
+    if (array->class_index != CLASS_INDEX_ARRAY) {
         vm_error("Expected array");
         return;
     }
@@ -279,63 +572,209 @@ void array_at_put(Value array_value, uint16_t index, Value value) {
         return;
     }
     
+    gc_write_barrier(array, value);
     array->fields[index] = value;
 }
 
+// Allocate a string of 'length' bytes (uninitialized but NUL-terminated)
+static String* string_allocate(Value class, uint32_t length) {
+    if (length > STRING_MAX_LENGTH) {
+        vm_error("String too long: %u bytes (at most %u)", length, (unsigned)STRING_MAX_LENGTH);
+        return NULL;
+    }
+
+    // Byte objects may have more fields than object_new allows
+    String* string = (String*)object_allocate(class, STRING_FIELDS(length));
+    if (string == NULL) {
+        return NULL;
+    }
+    string->object.format = FORMAT_BYTES;
+    string->length = length;
+    string->hash = 0;
+    string->chars[length] = '\0';
+
+    return string;
+}
+
+// Create a new string from 'length' bytes at 'chars'
+//
+// Allocating may collect garbage, so 'chars' must not point into the heap.
+Value string_new_chars(const char* chars, uint32_t length) {
+    String* string = string_allocate(vm->class_String, length);
+    if (string == NULL) {
+        return vm->nil;
+    }
+    memcpy(string->chars, chars, length);
+    return make_object(&string->object);
+}
+
 // Create a new string from a C string
 Value string_new(const char* cstring) {
-    size_t length = strlen(cstring);
-    
-    // Calculate how many Value slots we need
-    // Each Value can hold 4 bytes (on 32-bit system)
-    uint16_t size = (length + 4) / 4;
-    
-    // Create string object
-    Object* string = object_new(vm->class_String, size + 1); // +1 for length
-    
-    // Store length in first field
-    string->fields[0] = make_int(length);
-    
-    // Copy string data
-    memcpy(&string->fields[1], cstring, length);
-    
-    return make_object(string);
+    return string_new_chars(cstring, strlen(cstring));
 }
 
-// Extract C string from a string object
-const char* string_to_cstring(Value string_value) {
-    if (!is_object(string_value)) {
+// Check that a value is a string (or symbol) and return it
+static String* string_check(Value string_value) {
+    if (!is_string(string_value)) {
         vm_error("Expected string");
-        return "<not a string>";
+        return NULL;
     }
-    
-    Object* string = as_object(string_value);
-    
-    // The string data starts after the length field
-    return (const char*)&string->fields[1];
+
+    return (String*)as_object(string_value);
+}
+
+// Number of bytes in a string
+uint32_t string_length(Value string_value) {
+    String* string = string_check(string_value);
+    return string != NULL ? string->length : 0;
+}
+
+// Extract C string from a string object (cut short if it holds NULs; see
+// string_length)
+const char* string_to_cstring(Value string_value) {
+    String* string = string_check(string_value);
+    return string != NULL ? string->chars : "<not a string>";
+}
+
+// Hash of a string's bytes, computed once and cached in the string
+uint32_t string_value_hash(Value string_value) {
+    String* string = string_check(string_value);
+    if (string == NULL) {
+        return 0;
+    }
+
+    if (string->hash == 0) {
+        string->hash = string_hash(string->chars, string->length);
+    }
+
+    return string->hash;
 }
 
 // Concatenate two strings
 Value string_concat(Value str1, Value str2) {
-    if (!is_object(str1) || !is_object(str2)) {
-        vm_error("Expected strings");
+    if (string_check(str1) == NULL || string_check(str2) == NULL) {
         return vm->nil;
     }
     
-    Object* s1 = as_object(str1);
-    Object* s2 = as_object(str2);
+    uint32_t len1 = ((String*)as_object(str1))->length;
+    uint32_t len2 = ((String*)as_object(str2))->length;
+    if (len1 + len2 > STRING_MAX_LENGTH) {
+        vm_error("String too long: %u bytes (at most %u)", len1 + len2, (unsigned)STRING_MAX_LENGTH);
+        return vm->nil;
+    }
     
-    // Get string lengths
-    int len1 = as_int(s1->fields[0]);
-    int len2 = as_int(s2->fields[0]);
+    // Allocate the result, then copy both halves straight into it (the
+    // sources may have moved in the meantime)
+    gc_push_root(&str1);
+    gc_push_root(&str2);
+    String* result = string_allocate(vm->class_String, len1 + len2);
+    gc_pop_roots(2);
+    if (result == NULL) {
+        return vm->nil;
+    }
     
-    // Create result string
-    char buffer[len1 + len2 + 1];
-    memcpy(buffer, &s1->fields[1], len1);
-    memcpy(buffer + len1, &s2->fields[1], len2);
-    buffer[len1 + len2] = '\0';
+    memcpy(result->chars, ((String*)as_object(str1))->chars, len1);
+    memcpy(result->chars + len1, ((String*)as_object(str2))->chars, len2);
     
-    return string_new(buffer);
+    return make_object(&result->object);
+}
+
+// Create an empty string builder
+Value string_builder_new() {
+    return make_object(object_new(vm->class_StringBuilder, STRING_BUILDER_FIELDS));
+}
+
+// Check that a value is a string builder and return it
+static StringBuilder* string_builder_check(Value builder_value) {
+    if (!is_object(builder_value) ||
+        as_object(builder_value)->class_index != CLASS_INDEX_STRING_BUILDER) {
+        vm_error("Expected string builder");
+        return NULL;
+    }
+
+    return (StringBuilder*)as_object(builder_value);
+}
+
+// Bytes a string's object has room for, its terminating NUL aside
+static inline uint32_t string_capacity(String* string) {
+    return string->object.size * sizeof(Value) - (offsetof(String, chars) - sizeof(Object)) - 1;
+}
+
+// Append a string's bytes to a builder, growing its buffer if needed
+void string_builder_append(Value builder_value, Value string_value) {
+    StringBuilder* builder = string_builder_check(builder_value);
+    if (builder == NULL || string_check(string_value) == NULL) {
+        return;
+    }
+
+    String* buffer = is_object(builder->buffer) ? (String*)as_object(builder->buffer) : NULL;
+    uint32_t count = buffer != NULL ? buffer->length : 0;
+    uint32_t capacity = buffer != NULL ? string_capacity(buffer) : 0;
+    uint32_t length = ((String*)as_object(string_value))->length;
+
+    if (count + length > STRING_MAX_LENGTH) {
+        vm_error("String too long: %u bytes (at most %u)", count + length, (unsigned)STRING_MAX_LENGTH);
+        return;
+    }
+
+    if (count + length > capacity) {
+        // Double the buffer, so appending n bytes copies O(n) bytes overall
+        uint32_t new_capacity = capacity ? capacity * 2 : STRING_BUILDER_MIN_CAPACITY;
+        if (new_capacity < count + length) {
+            new_capacity = count + length;
+        }
+        if (new_capacity > STRING_MAX_LENGTH) {
+            new_capacity = STRING_MAX_LENGTH;
+        }
+
+        gc_push_root(&builder_value);
+        gc_push_root(&string_value);
+        buffer = string_allocate(vm->class_String, new_capacity);
+        gc_pop_roots(2);
+        if (buffer == NULL) {
+            return;
+        }
+
+        builder = (StringBuilder*)as_object(builder_value);
+        if (count > 0) {
+            memcpy(buffer->chars, ((String*)as_object(builder->buffer))->chars, count);
+        }
+        gc_write_barrier(&builder->object, make_object(&buffer->object));
+        builder->buffer = make_object(&buffer->object);
+    }
+
+    memcpy(buffer->chars + count, ((String*)as_object(string_value))->chars, length);
+    buffer->length = count + length;
+    buffer->chars[buffer->length] = '\0';
+}
+
+// Number of bytes appended to a builder
+uint32_t string_builder_length(Value builder_value) {
+    StringBuilder* builder = string_builder_check(builder_value);
+    if (builder == NULL || !is_object(builder->buffer)) {
+        return 0;
+    }
+
+    return ((String*)as_object(builder->buffer))->length;
+}
+
+// Copy a builder's contents out into a new string
+Value string_builder_to_string(Value builder_value) {
+    uint32_t count = string_builder_length(builder_value);
+
+    gc_push_root(&builder_value);
+    String* string = string_allocate(vm->class_String, count);
+    gc_pop_roots(1);
+    if (string == NULL) {
+        return vm->nil;
+    }
+
+    if (count > 0) {
+        Value buffer = ((StringBuilder*)as_object(builder_value))->buffer;
+        memcpy(string->chars, ((String*)as_object(buffer))->chars, count);
+    }
+
+    return make_object(&string->object);
 }
 
 // Object equality
@@ -354,19 +793,14 @@ uint8_t object_hash(Value obj) {
         
         // Cache hash if not set
         if (o->hash == 0) {
-            if (o->flags & FLAG_SYMBOL || o->class.bits == vm->class_String.bits) {
-                const char* str = string_to_cstring(obj);
-                uint8_t hash = 0;
-                
-                while (*str) {
-                    hash = (hash * 31) + *str++;
-                }
+            if (is_string(obj)) {
+                uint8_t hash = string_value_hash(obj) & 0x3F;
                 
                 o->hash = hash ? hash : 1; // Ensure non-zero
             } else {
                 // Use object address for hash
                 uintptr_t addr = (uintptr_t)o;
-                o->hash = (addr >> 2) & 0xFF; // Use some bits from the address
+                o->hash = (addr >> 2) & 0x3F; // Use some bits from the address
                 if (o->hash == 0) o->hash = 1; // Ensure non-zero
             }
         }
@@ -379,5 +813,9 @@ uint8_t object_hash(Value obj) {
 
 // Print object (for debugging)
 void object_print(Value obj) {
+    if (is_integer(obj)) {
+        integer_print(obj);
+        return;
+    }
     value_print(obj);
 }
@@ -4,11 +4,13 @@
 #define POPLAR2_OBJECT_H
 
 #include "vm.h"
+#include "gc.h"
 
 // Object creation
-Object* object_new(Value class, uint16_t size);
+Object* object_new(Value class, uint32_t size);
 Class* class_new(const char* name, Value superclass, uint16_t instance_size);
-Method* method_new(const char* name, uint8_t num_args, uint8_t num_locals);
+void class_register(Class* class);
+Method* method_new(const char* name, uint8_t num_args, uint16_t num_locals, const uint8_t* bytecode, uint16_t bytecode_count);
 
 // Object access
 Value object_get_field(Object* object, uint16_t index);
@@ -18,10 +20,15 @@ void object_set_field(Object* object, uint16_t index, Value value);
 bool class_is_subclass_of(Value class, Value superclass);
 Value class_get_name(Value class);
 Method* class_lookup_method(Value class, Value selector);
+void class_add_method(Value class, Value method);
 
 // Symbol table
 Value symbol_for(const char* string);
+Value symbol_for_chars(const char* chars, uint16_t length);
 const char* symbol_to_string(Value symbol);
+void symbol_table_visit(GcVisitor visit);
+void symbol_table_adopt_early_symbols();
+void symbol_table_cleanup();
 
 // Array operations
 Value array_new(uint16_t size);
@@ -29,9 +36,23 @@ Value array_at(Value array, uint16_t index);
 void array_at_put(Value array, uint16_t index, Value value);
 
 // String operations
+static inline bool is_string(Value value) {
+    return is_object(value) && (as_object(value)->class_index == CLASS_INDEX_STRING ||
+                                as_object(value)->class_index == CLASS_INDEX_SYMBOL);
+}
 Value string_new(const char* cstring);
+Value string_new_chars(const char* chars, uint32_t length);
+uint32_t string_length(Value string);
 const char* string_to_cstring(Value string);
 Value string_concat(Value str1, Value str2);
+uint32_t string_hash(const char* chars, uint32_t length);
+uint32_t string_value_hash(Value string);
+
+// String builder operations
+Value string_builder_new();
+void string_builder_append(Value builder, Value string);
+uint32_t string_builder_length(Value builder);
+Value string_builder_to_string(Value builder);
 
 // Object comparison
 bool object_equals(Value a, Value b);
@@ -4,10 +4,16 @@
 #include "vm.h"
 #include "ast.h"
 #include "object.h"
+#include "inline_cache.h"
+#include "gc.h"
+#include "integer.h"
+#include "context.h"
+#include "interpreter.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <limits.h>
 
 // Forward declarations for expression parsing
 static AstNode* parse_expression(Parser* parser);
@@ -21,6 +27,20 @@ static AstNode* parse_array_literal(Parser* parser);
 static AstNode* parse_assignment(Parser* parser, Value var_name, int var_scope, int var_index);
 static AstNode* parse_cascade(Parser* parser, AstNode* receiver);
 
+// Forward declarations for code generation
+static int generate_bytecode(AstNode* node, ScopeInfo* scope, int code_index);
+static int generate_message_send(AstNode* node, ScopeInfo* scope, int code_index);
+static int generate_variable_access(AstNode* node, ScopeInfo* scope, int code_index);
+static int generate_assignment(AstNode* node, ScopeInfo* scope, int code_index);
+static int generate_literal(AstNode* node, ScopeInfo* scope, int code_index);
+static int generate_return(AstNode* node, ScopeInfo* scope, int code_index);
+static int generate_sequence(AstNode* node, ScopeInfo* scope, int code_index);
+static int generate_block(AstNode* node, ScopeInfo* scope, int code_index);
+static void literal_frame_finish(LiteralFrame* frame, Method* method);
+static int emit_byte(ScopeInfo* scope, int code_index, uint8_t byte);
+static int emit_indexed(ScopeInfo* scope, int code_index, uint8_t opcode, int index);
+static Method* scope_new_method(ScopeInfo* scope, int code_index);
+
 // Error reporting
 static void error(Parser* parser, const char* message) {
     if (parser->panic_mode) return;
@@ -185,9 +205,7 @@ static Token number(Lexer* lexer) {
 }
 
 static Token string(Lexer* lexer) {
-    // Skip the opening quote
-    advance(lexer);
-
+    // The opening quote has been consumed
     lexer->start = lexer->current;
 
     while (!is_at_end(lexer)) {
@@ -226,9 +244,7 @@ static Token string(Lexer* lexer) {
 }
 
 static Token symbol(Lexer* lexer) {
-    // Skip the #
-    advance(lexer);
-
+    // The # has been consumed
     // Read the symbol name
     if (is_identifier_start(peek(lexer))) {
         lexer->start = lexer->current;
@@ -253,9 +269,7 @@ static Token symbol(Lexer* lexer) {
 }
 
 static Token primitive(Lexer* lexer) {
-    // Skip the opening '<'
-    advance(lexer);
-
+    // The opening '<' has been consumed
     // Check for "primitive:"
     const char* primitive = "primitive:";
     for (int i = 0; primitive[i] != '\0'; i++) {
@@ -291,7 +305,7 @@ static Token primitive(Lexer* lexer) {
 }
 
 static Token operator_token(Lexer* lexer) {
-    while (strchr("+-*/=<>%&|~,@", peek(lexer)) != NULL) {
+    while (peek(lexer) != '\0' && strchr("+-*/\\=<>%&|~,@", peek(lexer)) != NULL) {
         advance(lexer);
     }
 
@@ -341,7 +355,7 @@ static Token scan_token(Lexer* lexer) {
             return operator_token(lexer);
         case '+': case '-': case '*': case '/':
         case '=': case '>': case '%': case '&':
-        case '~': case ',': case '@':
+        case '~': case ',': case '@': case '\\':
             return operator_token(lexer);
     }
 
@@ -377,6 +391,7 @@ static void consume(Parser* parser, TokenType type, const char* message);
 static bool check(Parser* parser, TokenType type);
 static bool parser_match(Parser* parser, TokenType type);
 static bool check_next(Parser* parser, TokenType type);
+static bool check_binary_operator(Parser* parser);
 static char* copy_string(const char* chars, int length);
 static char* token_to_string(Token* token);
 static Value parse_class_definition(Parser* parser);
@@ -396,7 +411,6 @@ static void init_parser(Parser* parser, const char* source, const char* filename
 
     parser->had_error = false;
     parser->panic_mode = false;
-    parser->class_index = 0;
     if (DBUG) {
         printf("init_parser\n");
     }
@@ -442,19 +456,31 @@ static bool parser_match(Parser* parser, TokenType type) {
     return true;
 }
 
+// Whether the current token is a binary selector: an operator, or a '|',
+// which the lexer makes a separator but which after an operand can only
+// be the binary message
+static bool check_binary_operator(Parser* parser) {
+    return check(parser, TOKEN_OPERATOR) ||
+           (check(parser, TOKEN_SEPARATOR) && parser->current.length == 1 && parser->current.text[0] == '|');
+}
+
 static bool check_next(Parser* parser, TokenType type) {
     // Skip the check if we're at the end
     if (parser->current.type == TOKEN_EOF) return false;
 
-    // Save current token
-    Token saved = parser->current;
+    // Save the lexer and tokens
+    Lexer saved_lexer = parser->lexer;
+    Token saved_current = parser->current;
+    Token saved_previous = parser->previous;
 
     // Advance and check
     advance_token(parser);
     bool result = check(parser, type);
 
-    // Restore current token (hack but works for simple lookahead)
-    parser->current = saved;
+    // Restore, so the lookahead token is scanned again
+    parser->lexer = saved_lexer;
+    parser->current = saved_current;
+    parser->previous = saved_previous;
 
     return result;
 }
@@ -471,6 +497,11 @@ static char* token_to_string(Token* token) {
     return copy_string(token->text, token->length);
 }
 
+// Intern a token's text without copying it first
+static Value token_to_symbol(Token* token) {
+    return symbol_for_chars(token->text, (uint16_t)token->length);
+}
+
 
 
 // SOM class parsing
@@ -523,7 +554,7 @@ static Value parse_class_definition(Parser* parser) {
     free(class_name);
 
     // Add class to globals
-    vm->globals[parser->class_index++] = class;
+    vm_define_global(new_class->name, class);
 
     // Instance variables
     if (parser_match(parser, TOKEN_SEPARATOR) &&
@@ -553,23 +584,17 @@ static Value parse_class_definition(Parser* parser) {
 }
 
 static void parse_class_body(Parser* parser, Value class) {
-    // Create array for methods
-    Value methods = array_new(0);
-    Class* class_obj = (Class*)as_object(class);
-    class_obj->methods = methods;
-
     while (!check(parser, TOKEN_EOF) && !check(parser, TOKEN_RPAREN)) {
-        // Method type
+        // Method type ('class' prefix, but a unary method may also start
+        // with an identifier, so only take it when no '=' follows)
         bool is_class_method = false;
 
-        if (parser_match(parser, TOKEN_IDENTIFIER)) {
-            if (parser->previous.length == 4 &&
-                strncmp(parser->previous.text, "class", 4) == 0) {
-                is_class_method = true;
-            } else {
-                error_at_previous(parser, "Expected 'class' or method definition");
-                return;
-            }
+        if (check(parser, TOKEN_IDENTIFIER) &&
+            parser->current.length == 5 &&
+            strncmp(parser->current.text, "class", 5) == 0 &&
+            !check_next(parser, TOKEN_OPERATOR)) {
+            advance_token(parser);
+            is_class_method = true;
         }
 
         // Parse the method
@@ -577,19 +602,9 @@ static void parse_class_body(Parser* parser, Value class) {
 
         if (!is_nil(method)) {
             // Add method to class
-            Value current_methods = class_obj->methods;
-            int size = as_object(current_methods)->size;
-
-            Value new_methods = array_new(size + 1);
-
-            // Copy existing methods
-            for (int i = 0; i < size; i++) {
-                array_at_put(new_methods, i, array_at(current_methods, i));
-            }
-
-            // Add new method
-            array_at_put(new_methods, size, method);
-            class_obj->methods = new_methods;
+            class_add_method(class, method);
+        } else if (parser->had_error) {
+            return;
         }
     }
 }
@@ -602,14 +617,10 @@ static Value parse_method(Parser* parser, Value class, bool is_class_method) {
 
     if (parser_match(parser, TOKEN_IDENTIFIER)) {
         // Unary method
-        char* name = token_to_string(&parser->previous);
-        selector = symbol_for(name);
-        free(name);
+        selector = token_to_symbol(&parser->previous);
     } else if (parser_match(parser, TOKEN_OPERATOR)) {
         // Binary method
-        char* name = token_to_string(&parser->previous);
-        selector = symbol_for(name);
-        free(name);
+        selector = token_to_symbol(&parser->previous);
 
         consume(parser, TOKEN_IDENTIFIER, "Expected argument name after binary operator");
         char* arg_name = token_to_string(&parser->previous);
@@ -620,14 +631,8 @@ static Value parse_method(Parser* parser, Value class, bool is_class_method) {
 
         num_args = 1;
     } else if (parser_match(parser, TOKEN_KEYWORD)) {
-        // Keyword method
-        char* name = token_to_string(&parser->previous);
-        int name_length = strlen(name);
-        name[name_length - 1] = '\0'; // Remove trailing colon
-
-        // Start building the selector
-        char* selector_name = strdup(name);
-        free(name);
+        // Keyword method: the selector is the keywords, colons included
+        char* selector_name = token_to_string(&parser->previous);
 
         consume(parser, TOKEN_IDENTIFIER, "Expected argument name after keyword");
         char* arg_name = token_to_string(&parser->previous);
@@ -688,110 +693,113 @@ static Value parse_method(Parser* parser, Value class, bool is_class_method) {
         parser->previous.length == 1 &&
         parser->previous.text[0] == '|') {
 
-        // Count local variables first
-        int local_count = 0;
-        Token saved_current = parser->current;
-
-        while (!check(parser, TOKEN_SEPARATOR)) {
-            if (check(parser, TOKEN_IDENTIFIER)) {
-                local_count++;
-                advance_token(parser);
-            } else {
-                break;
-            }
-        }
-
-        // Restore parser position
-        parser->current = saved_current;
-
-        // Allocate array for local variable names
-        local_names = local_count > 0 ? malloc(sizeof(Value) * local_count) : NULL;
-        num_locals = local_count;
-
-        // Now parse the local variables again
-        int i = 0;
-        while (!check(parser, TOKEN_SEPARATOR)) {
-            consume(parser, TOKEN_IDENTIFIER, "Expected local variable name");
-            char* name = token_to_string(&parser->previous);
-            local_names[i++] = symbol_for(name);
-            free(name);
-
-            if (check(parser, TOKEN_SEPARATOR)) break;
+        // The lexer cannot be rewound, so collect the names as they come
+        while (check(parser, TOKEN_IDENTIFIER)) {
+            advance_token(parser);
+            local_names = realloc(local_names, sizeof(Value) * (num_locals + 1));
+            local_names[num_locals++] = token_to_symbol(&parser->previous);
         }
 
         consume(parser, TOKEN_SEPARATOR, "Expected '|' after local variables");
     }
 
-    // Create method object
-    Method* method = method_new(symbol_to_string(selector), num_args, num_locals);
-    method->holder = class;
+    // Create scope info for code generation
+    ScopeInfo scope;
+    scope.selector = selector;
+    scope.holder = class;
+    scope.arg_names = arg_names;
+    scope.num_args = num_args;
+    scope.local_names = local_names;
+    scope.num_locals = num_locals;
+    scope.instance_names = NULL; // We don't know instance variables yet
+    scope.num_instances = 0;     // We'll need to add instance variable support later
+    scope.num_send_sites = 0;
+    scope.outer = NULL;
+    scope.captures = false;
+    scope.uses_self = false;
+    memset(&scope.literals, 0, sizeof(LiteralFrame));
+    memset(&scope.code, 0, sizeof(CodeBuffer));
+    int code_index = 0;
 
     // Parse method body
-    if (parser_match(parser, TOKEN_PRIMITIVE)) {
+    bool is_primitive = parser_match(parser, TOKEN_PRIMITIVE);
+    if (is_primitive) {
         // Parse primitive number (same as before)
         char* primitive_str = token_to_string(&parser->previous);
         int primitive_id = atoi(primitive_str);
         free(primitive_str);
 
-        // Add bytecode for primitive call
-        method->bytecode[0] = BC_PRIMITIVE;
-        method->bytecode[1] = (uint8_t)primitive_id;
-        method->bytecode[2] = (uint8_t)num_args;
-        method->bytecode[3] = BC_RETURN_LOCAL;
-        method->bytecode_count = 4;
-    } else {
-        // Parse method body as expressions
-        AstNode** statements = NULL;
-        int statement_count = 0;
+        // Primitives take the receiver and arguments as operands, which
+        // live in the sender's frame, so push copies for the primitive
+        code_index = emit_byte(&scope, code_index, BC_PUSH_THIS);
+        for (int i = 0; i < num_args; i++) {
+            code_index = emit_indexed(&scope, code_index, BC_PUSH_ARGUMENT, i);
+        }
+        code_index = emit_byte(&scope, code_index, BC_PRIMITIVE);
+        code_index = emit_byte(&scope, code_index, (uint8_t)primitive_id);
+        code_index = emit_byte(&scope, code_index, (uint8_t)(num_args + 1));
+        code_index = emit_byte(&scope, code_index, BC_RETURN_LOCAL);
+    }
 
-        // Parse statements until we reach the closing paren
-        while (!check(parser, TOKEN_RPAREN) && !check(parser, TOKEN_EOF)) {
-            AstNode* stmt = parse_expression(parser);
+    // Parse method body as expressions (after a primitive, these are what
+    // SOM runs if it fails; they are compiled but never run, since failing
+    // primitives report a VM error instead)
+    AstNode** statements = NULL;
+    int statement_count = 0;
 
-            // Add the statement to our array
-            statements = realloc(statements, sizeof(AstNode*) * (statement_count + 1));
-            statements[statement_count++] = stmt;
+    // Parse statements until we reach the closing paren
+    while (!check(parser, TOKEN_RPAREN) && !check(parser, TOKEN_EOF) && !parser->had_error) {
+        AstNode* stmt = parse_expression(parser);
 
-            // Optional period after statement
-            parser_match(parser, TOKEN_PERIOD);
-        }
+        // Add the statement to our array
+        statements = realloc(statements, sizeof(AstNode*) * (statement_count + 1));
+        statements[statement_count++] = stmt;
 
-        // Create sequence from statements
-        AstNode* body = ast_create_sequence(statement_count, statements);
+        // Optional period after statement
+        parser_match(parser, TOKEN_PERIOD);
+    }
 
-        // For now, just print the AST for debugging
-        if (DBUG) {
-            printf("Method AST for %s:\n", symbol_to_string(selector));
-            ast_print(body, 2);
+    // Nothing is compiled for a method that does not parse
+    if (parser->had_error) {
+        for (int i = 0; i < statement_count; i++) {
+            ast_free(statements[i]);
         }
+        free(statements);
+        free(scope.code.bytes);
+        free(scope.literals.values);
+        free(scope.literals.table);
+        free(arg_names);
+        free(local_names);
+        return vm->nil;
+    }
 
-        // Create scope info for code generation
-        ScopeInfo scope;
-        scope.arg_names = arg_names;
-        scope.num_args = num_args;
-        scope.local_names = local_names;
-        scope.num_locals = num_locals;
-        scope.instance_names = NULL; // We don't know instance variables yet
-        scope.num_instances = 0;     // We'll need to add instance variable support later
-
-        // Generate bytecode from AST
-        int code_index = 0;
-        code_index = generate_bytecode(method, body, &scope, code_index);
-        method->bytecode_count = code_index;
-
-        // If no explicit return, add implicit return self
-        if (statement_count == 0 || body->sequence.statements[statement_count-1]->type != AST_RETURN) {
-            if (code_index + 2 < MAX_BYTECODE_SIZE) {
-                method->bytecode[code_index++] = BC_PUSH_THIS;
-                method->bytecode[code_index++] = BC_RETURN_LOCAL;
-                method->bytecode_count = code_index;
-            }
-        }
+    // Create sequence from statements
+    AstNode* body = ast_create_sequence(statement_count, statements);
 
-        // Free the AST
-        ast_free(body);
+    // For now, just print the AST for debugging
+    if (DBUG) {
+        printf("Method AST for %s:\n", symbol_to_string(selector));
+        ast_print(body, 2);
     }
 
+    // Generate bytecode from AST (inlined blocks may add locals)
+    code_index = generate_bytecode(body, &scope, code_index);
+
+    // If no explicit return, add implicit return self
+    if (!is_primitive &&
+        (statement_count == 0 || body->sequence.statements[statement_count-1]->type != AST_RETURN)) {
+        code_index = emit_byte(&scope, code_index, BC_PUSH_THIS);
+        code_index = emit_byte(&scope, code_index, BC_RETURN_LOCAL);
+    }
+
+    // Free the AST
+    ast_free(body);
+
+    // Create method object, with one inline cache per send site and the
+    // literals the code indexes
+    Method* method = scope_new_method(&scope, code_index);
+    local_names = scope.local_names;
+
     // Consume the closing parenthesis
     consume(parser, TOKEN_RPAREN, "Expected ')' at end of method");
 
@@ -1132,7 +1140,7 @@ static AstNode* parse_expression(Parser* parser) {
     }
 
     // Message sends
-    if (check(parser, TOKEN_IDENTIFIER) || check(parser, TOKEN_OPERATOR) || check(parser, TOKEN_KEYWORD)) {
+    if (check(parser, TOKEN_IDENTIFIER) || check_binary_operator(parser) || check(parser, TOKEN_KEYWORD)) {
         expr = parse_message_send(parser, expr);
 
         // Check for cascade
@@ -1167,7 +1175,7 @@ static AstNode* parse_cascade(Parser* parser, AstNode* receiver) {
             );
 
             message = parse_unary_message(parser, receiver_clone);
-        } else if (check(parser, TOKEN_OPERATOR)) {
+        } else if (check_binary_operator(parser)) {
             AstNode* receiver_clone = ast_create_variable(
                 receiver->type == AST_VARIABLE ? receiver->variable.name : vm->nil,
                 receiver->type == AST_VARIABLE ? receiver->variable.scope : 0,
@@ -1267,16 +1275,24 @@ static AstNode* parse_primary(Parser* parser) {
 
     // Literals
     if (parser_match(parser, TOKEN_INTEGER)) {
-        char* value_str = token_to_string(&parser->previous);
-        int value = atoi(value_str);
-        free(value_str);
-        return ast_create_literal(make_int(value));
+        // Literals too big for a SmallInteger become LargeIntegers
+        Value value = integer_parse(parser->previous.text, parser->previous.length);
+        return ast_create_literal(value);
     }
 
     if (parser_match(parser, TOKEN_STRING)) {
-        char* value_str = token_to_string(&parser->previous);
-        Value string_val = string_new(value_str);
-        free(value_str);
+        // A doubled quote in the source stands for one (the copy is not in
+        // the heap, so creating the string may collect garbage)
+        char* chars = malloc(parser->previous.length + 1);
+        int length = 0;
+        for (int i = 0; i < parser->previous.length; i++) {
+            chars[length++] = parser->previous.text[i];
+            if (parser->previous.text[i] == '\'') {
+                i++;
+            }
+        }
+        Value string_val = string_new_chars(chars, length);
+        free(chars);
         return ast_create_literal(string_val);
     }
 
@@ -1315,9 +1331,7 @@ static AstNode* parse_primary(Parser* parser) {
 
     // Symbol literals
     if (parser_match(parser, TOKEN_SYMBOL)) {
-        char* name = token_to_string(&parser->previous);
-        Value symbol = symbol_for(name);
-        free(name);
+        Value symbol = token_to_symbol(&parser->previous);
         return ast_create_literal(symbol);
     }
 
@@ -1354,9 +1368,7 @@ static AstNode* parse_block(Parser* parser) {
         advance_token(parser); // Consume :
         consume(parser, TOKEN_IDENTIFIER, "Expected parameter name");
 
-        char* name = token_to_string(&parser->previous);
-        Value arg_name = symbol_for(name);
-        free(name);
+        Value arg_name = token_to_symbol(&parser->previous);
 
         // Add to arg names
         arg_names = realloc(arg_names, sizeof(Value) * (arg_count + 1));
@@ -1445,11 +1457,11 @@ static AstNode* parse_message_send(Parser* parser, AstNode* receiver) {
     }
 
     // Then binary messages (middle precedence)
-    if (check(parser, TOKEN_OPERATOR)) {
+    if (check_binary_operator(parser)) {
         result = parse_binary_message(parser, result);
 
         // Chain additional binary messages
-        while (check(parser, TOKEN_OPERATOR)) {
+        while (check_binary_operator(parser)) {
             result = parse_binary_message(parser, result);
         }
     }
@@ -1465,15 +1477,16 @@ static AstNode* parse_message_send(Parser* parser, AstNode* receiver) {
 static AstNode* parse_unary_message(Parser* parser, AstNode* receiver) {
     consume(parser, TOKEN_IDENTIFIER, "Expected unary message name");
 
-    char* name = token_to_string(&parser->previous);
-    Value selector = symbol_for(name);
-    free(name);
+    Value selector = token_to_symbol(&parser->previous);
 
     return ast_create_message_send(MESSAGE_UNARY, selector, receiver, 0, NULL);
 }
 
 static AstNode* parse_binary_message(Parser* parser, AstNode* receiver) {
-    consume(parser, TOKEN_OPERATOR, "Expected binary operator");
+    if (!check_binary_operator(parser)) {
+        error_at_current(parser, "Expected binary operator");
+    }
+    advance_token(parser);
 
     char* op = token_to_string(&parser->previous);
     Value selector = symbol_for(op);
@@ -1485,7 +1498,7 @@ static AstNode* parse_binary_message(Parser* parser, AstNode* receiver) {
     // Check for unary messages on the argument
     while (check(parser, TOKEN_IDENTIFIER) &&
            !check_next(parser, TOKEN_COLON) &&
-           !check(parser, TOKEN_OPERATOR) &&
+           !check_binary_operator(parser) &&
            !check(parser, TOKEN_KEYWORD)) {
         arg = parse_unary_message(parser, arg);
     }
@@ -1532,7 +1545,7 @@ static AstNode* parse_keyword_message(Parser* parser, AstNode* receiver) {
         }
 
         // Check for binary messages on the argument
-        while (check(parser, TOKEN_OPERATOR)) {
+        while (check_binary_operator(parser)) {
             arg = parse_binary_message(parser, arg);
         }
 
@@ -1593,9 +1606,15 @@ bool parse_string(const char* source, const char* name) {
     }
 
 
+    // The compiler keeps Values in C structures the GC cannot see, so
+    // nothing may move until it is done
+    gc_disable();
+
     // Parse the class definition
     Value class = parse_class_definition(&parser);
 
+    gc_enable();
+
     return !parser.had_error;
 }
 
@@ -1659,29 +1678,182 @@ static const char* token_type_to_string(TokenType type) {
 }
 
 // Bytecode generation
+
+// Append a byte to the code being generated; answers the index after it
+static int emit_byte(ScopeInfo* scope, int code_index, uint8_t byte) {
+    CodeBuffer* code = &scope->code;
+    if (code_index >= code->capacity) {
+        code->capacity = code->capacity == 0 ? 64 : code->capacity * 2;
+        code->bytes = realloc(code->bytes, code->capacity);
+    }
+    code->bytes[code_index] = byte;
+    return code_index + 1;
+}
+
+// Append an opcode, behind BC_EXTEND if its index operands are wide
+static int emit_opcode(ScopeInfo* scope, int code_index, uint8_t opcode, bool wide) {
+    if (wide) {
+        code_index = emit_byte(scope, code_index, BC_EXTEND);
+    }
+    return emit_byte(scope, code_index, opcode);
+}
+
+// Append an index operand: one byte, or two (big-endian) if wide
+static int emit_operand(ScopeInfo* scope, int code_index, int index, bool wide) {
+    if (wide) {
+        code_index = emit_byte(scope, code_index, (uint8_t)(index >> 8));
+    }
+    return emit_byte(scope, code_index, (uint8_t)index);
+}
+
+// Append an instruction whose one operand indexes a variable or literal
+static int emit_indexed(ScopeInfo* scope, int code_index, uint8_t opcode, int index) {
+    bool wide = index > UINT8_MAX;
+    code_index = emit_opcode(scope, code_index, opcode, wide);
+    return emit_operand(scope, code_index, index, wide);
+}
+
+// Whether an instruction only pushes a value, so that it and a POP right
+// after it can both be dropped
+static bool is_pure_push(uint8_t opcode) {
+    switch (opcode) {
+        case BC_PUSH_LOCAL:
+        case BC_PUSH_ARGUMENT:
+        case BC_PUSH_FIELD:
+        case BC_PUSH_CONSTANT:
+        case BC_PUSH_GLOBAL:
+        case BC_PUSH_SPECIAL:
+        case BC_PUSH_OUTER:
+        case BC_PUSH_THIS:
+        case BC_DUP:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static bool is_jump(uint8_t opcode) {
+    return opcode == BC_JUMP || opcode == BC_JUMP_IF_TRUE || opcode == BC_JUMP_IF_FALSE;
+}
+
+// Peephole pass over a scope's finished code: drops pushes that are popped
+// straight away and fuses the most frequently executed instruction pairs
+// (as counted with PROFILE=pairs) into superinstructions. A pair is left
+// alone if a jump lands on its second instruction. The code only shrinks,
+// so it is rewritten in place and the jumps retargeted; answers its new
+// length
+static int peephole_optimize(ScopeInfo* scope, int code_index) {
+    uint8_t* code = scope->code.bytes;
+    bool* is_target = calloc((size_t)code_index + 1, sizeof(bool));
+    int* new_index = malloc(((size_t)code_index + 1) * sizeof(int));
+    if (is_target == NULL || new_index == NULL) {
+        free(is_target);
+        free(new_index);
+        return code_index;
+    }
+
+    for (int i = 0; i < code_index; i += interpreter_instruction_length(&code[i])) {
+        if (is_jump(code[i])) {
+            is_target[code[i + 1] << 8 | code[i + 2]] = true;
+        }
+    }
+
+    int out = 0;
+    int i = 0;
+    while (i < code_index) {
+        uint8_t opcode = code[i];
+        int next = i + interpreter_instruction_length(&code[i]);
+        uint8_t following = next < code_index && !is_target[next] ? code[next] : 0;
+        int after = following != 0 ? next + interpreter_instruction_length(&code[next]) : next;
+        new_index[i] = out;
+
+        // Wide instructions start with BC_EXTEND, so none of these match them
+        if (is_pure_push(opcode) && following == BC_POP) {
+            i = after;
+            continue;
+        } else if (opcode == BC_STORE_LOCAL && following == BC_POP) {
+            code[out++] = BC_STORE_LOCAL_POP;
+            code[out++] = code[i + 1];
+        } else if (opcode == BC_PUSH_THIS && following == BC_RETURN_LOCAL) {
+            code[out++] = BC_RETURN_SELF;
+        } else if (opcode == BC_PUSH_FIELD && following == BC_RETURN_LOCAL) {
+            code[out++] = BC_PUSH_FIELD_RETURN;
+            code[out++] = code[i + 1];
+        } else if (opcode == BC_PUSH_LOCAL && following == BC_SEND) {
+            uint8_t local = code[i + 1];
+            code[out++] = BC_PUSH_LOCAL_SEND;
+            code[out++] = local;
+            memmove(&code[out], &code[next + 1], 3);
+            out += 3;
+        } else {
+            memmove(&code[out], &code[i], (size_t)(next - i));
+            out += next - i;
+            i = next;
+            continue;
+        }
+        i = after;
+    }
+    new_index[code_index] = out;
+
+    for (i = 0; i < out; i += interpreter_instruction_length(&code[i])) {
+        if (is_jump(code[i])) {
+            int target = new_index[code[i + 1] << 8 | code[i + 2]];
+            code[i + 1] = (uint8_t)(target >> 8);
+            code[i + 2] = (uint8_t)target;
+        }
+    }
+
+    free(is_target);
+    free(new_index);
+    return out;
+}
+
+// Create the Method for the code generated in a scope, allocated at its
+// exact size, with the inline caches and literals the code refers to; the
+// scope's code buffer and literal frame are freed
+static Method* scope_new_method(ScopeInfo* scope, int code_index) {
+    if (code_index > (int)METHOD_MAX_BYTECODE || 2 * scope->num_send_sites > MAX_OBJECT_FIELDS) {
+        vm_error("Method too large: %s", symbol_to_string(scope->selector));
+        code_index = emit_byte(scope, 0, BC_PUSH_THIS);
+        code_index = emit_byte(scope, code_index, BC_RETURN_LOCAL);
+        scope->num_send_sites = 0;
+    }
+    code_index = peephole_optimize(scope, code_index);
+
+    Method* method = method_new(symbol_to_string(scope->selector), (uint8_t)scope->num_args,
+                                (uint16_t)scope->num_locals, scope->code.bytes, (uint16_t)code_index);
+    method->holder = scope->holder;
+    inline_cache_init(method, (uint16_t)scope->num_send_sites);
+    literal_frame_finish(&scope->literals, method);
+
+    free(scope->code.bytes);
+    memset(&scope->code, 0, sizeof(CodeBuffer));
+    return method;
+}
+
 // Main bytecode generation function
-static int generate_bytecode(Method* method, AstNode* node, ScopeInfo* scope, int code_index) {
+static int generate_bytecode(AstNode* node, ScopeInfo* scope, int code_index) {
     switch (node->type) {
         case AST_LITERAL:
-            return generate_literal(method, node, code_index);
+            return generate_literal(node, scope, code_index);
 
         case AST_VARIABLE:
-            return generate_variable_access(method, node, scope, code_index);
+            return generate_variable_access(node, scope, code_index);
 
         case AST_ASSIGNMENT:
-            return generate_assignment(method, node, scope, code_index);
+            return generate_assignment(node, scope, code_index);
 
         case AST_RETURN:
-            return generate_return(method, node, scope, code_index);
+            return generate_return(node, scope, code_index);
 
         case AST_MESSAGE_SEND:
-            return generate_message_send(method, node, scope, code_index);
+            return generate_message_send(node, scope, code_index);
 
         case AST_BLOCK:
-            return generate_block(method, node, scope, code_index);
+            return generate_block(node, scope, code_index);
 
         case AST_SEQUENCE:
-            return generate_sequence(method, node, scope, code_index);
+            return generate_sequence(node, scope, code_index);
 
         default:
             vm_error("Unknown AST node type: %d", node->type);
@@ -1689,295 +1861,661 @@ static int generate_bytecode(Method* method, AstNode* node, ScopeInfo* scope, in
     }
 }
 
-// Generate bytecode for a literal value
-static int generate_literal(Method* method, AstNode* node, int code_index) {
-    // Find or add to literals table
-    int literal_index = -1;
-
-    // Find in literals table
-    for (int i = 0; i < MAX_LITERALS; i++) {
-        if (value_equals(vm->literals[i], node->literal)) {
-            literal_index = i;
-            break;
+// Note that a block uses self: it and the blocks it is nested in need the
+// receiver of the method they were created in
+static void scope_use_self(ScopeInfo* scope) {
+    for (; scope->outer != NULL; scope = scope->outer) {
+        scope->uses_self = true;
+    }
+}
+
+// Note that a block refers to the frame 'levels' scopes out: it and the
+// blocks in between need the contexts of the frames they were created in
+static void scope_capture(ScopeInfo* scope, int levels) {
+    for (; levels > 0 && scope->outer != NULL; levels--, scope = scope->outer) {
+        scope->captures = true;
+    }
+}
+
+// Generate a push or store of a local or argument, looking through the
+// enclosing scopes of a block; answers -1 if none has one named 'name'
+static int generate_scoped_variable(Value name, ScopeInfo* scope, bool store, int code_index) {
+    int level = 0;
+
+    for (ScopeInfo* s = scope; s != NULL; s = s->outer, level++) {
+        int slot = -1;
+        bool is_local = false;
+
+        // Locals, innermost (most recently added) first, then arguments
+        for (int i = s->num_locals - 1; i >= 0 && slot < 0; i--) {
+            if (value_equals(s->local_names[i], name)) {
+                slot = i;
+                is_local = true;
+            }
+        }
+        for (int i = 0; i < s->num_args && slot < 0; i++) {
+            if (value_equals(s->arg_names[i], name)) {
+                slot = i;
+            }
+        }
+
+        if (slot < 0) {
+            continue;
         }
+
+        if (level == 0) {
+            if (is_local) {
+                code_index = emit_indexed(scope, code_index, store ? BC_STORE_LOCAL : BC_PUSH_LOCAL, slot);
+            } else {
+                code_index = emit_indexed(scope, code_index, store ? BC_STORE_ARGUMENT : BC_PUSH_ARGUMENT, slot);
+            }
+        } else {
+            // An enclosing frame's variables are numbered arguments first
+            int index = is_local ? s->num_args + slot : slot;
+            bool wide = index > UINT8_MAX;
+            scope_capture(scope, level);
+            code_index = emit_opcode(scope, code_index, store ? BC_STORE_OUTER : BC_PUSH_OUTER, wide);
+            code_index = emit_byte(scope, code_index, (uint8_t)level);
+            code_index = emit_operand(scope, code_index, index, wide);
+        }
+        return code_index;
     }
 
-    // If not found, add to literals table
-    if (literal_index == -1) {
-        // Find first empty slot
-        for (int i = 0; i < MAX_LITERALS; i++) {
-            if (is_nil(vm->literals[i])) {
-                vm->literals[i] = node->literal;
-                literal_index = i;
-                break;
+    return -1;
+}
+
+// Hash a literal for its method's literal frame: Strings by their
+// characters, everything else by identity
+static uint32_t literal_hash(Value literal) {
+    if (is_object(literal) && as_object(literal)->class_index == CLASS_INDEX_STRING) {
+        return string_value_hash(literal);
+    }
+    return literal.bits * 2654435761u;
+}
+
+// Whether two literals can share a literal frame entry
+static bool literal_equals(Value a, Value b) {
+    if (value_identical(a, b)) {
+        return true;
+    }
+    if (!is_object(a) || !is_object(b) ||
+        as_object(a)->class_index != CLASS_INDEX_STRING || as_object(b)->class_index != CLASS_INDEX_STRING) {
+        return false;
+    }
+
+    uint32_t length = string_length(a);
+    return string_length(b) == length && memcmp(string_to_cstring(a), string_to_cstring(b), length) == 0;
+}
+
+// Enter literal 'index' into the hash table of a literal frame
+static void literal_frame_insert(LiteralFrame* frame, int index) {
+    uint32_t mask = (uint32_t)frame->table_size - 1;
+    uint32_t i = literal_hash(frame->values[index]) & mask;
+    while (frame->table[i] != 0) {
+        i = (i + 1) & mask;
+    }
+    frame->table[i] = (uint16_t)(index + 1);
+}
+
+// Index of a literal in the frame of the method being compiled, added if no
+// equal literal is there yet (or always, if 'shared' is false); answers -1
+// once the frame has as many literals as an Array can hold
+static int literal_frame_add(LiteralFrame* frame, Value literal, bool shared) {
+    if (shared && frame->table != NULL) {
+        uint32_t mask = (uint32_t)frame->table_size - 1;
+        for (uint32_t i = literal_hash(literal) & mask; frame->table[i] != 0; i = (i + 1) & mask) {
+            if (literal_equals(frame->values[frame->table[i] - 1], literal)) {
+                return frame->table[i] - 1;
             }
         }
     }
 
-    // If still not found, literals table is full
-    if (literal_index == -1) {
-        vm_error("Literals table is full");
-        return code_index;
+    if (frame->count >= MAX_OBJECT_FIELDS) {
+        return -1;
+    }
+
+    if (frame->count == frame->capacity) {
+        frame->capacity = frame->capacity == 0 ? 8 : frame->capacity * 2;
+        frame->values = realloc(frame->values, frame->capacity * sizeof(Value));
+    }
+    int index = frame->count++;
+    frame->values[index] = literal;
+
+    // Keep the table at most half full
+    if (frame->count * 2 > frame->table_size) {
+        free(frame->table);
+        frame->table_size = frame->table_size == 0 ? 16 : frame->table_size * 2;
+        frame->table = calloc(frame->table_size, sizeof(uint16_t));
+        for (int i = 0; i < frame->count; i++) {
+            literal_frame_insert(frame, i);
+        }
+    } else {
+        literal_frame_insert(frame, index);
+    }
+
+    return index;
+}
+
+// Index of a literal in the current method's literal frame, adding it if
+// it is not there yet
+static int scope_literal(ScopeInfo* scope, Value literal) {
+    int index = literal_frame_add(&scope->literals, literal, true);
+    if (index < 0) {
+        vm_error("Too many literals in method");
+        return 0;
+    }
+    return index;
+}
+
+// Give a compiled method an Array of exactly its literals, and free the
+// compiler's literal frame
+static void literal_frame_finish(LiteralFrame* frame, Method* method) {
+    if (frame->count > 0) {
+        Value literals = array_new((uint16_t)frame->count);
+        for (int i = 0; i < frame->count; i++) {
+            array_at_put(literals, (uint16_t)i, frame->values[i]);
+        }
+        gc_write_barrier((Object*)method, literals);
+        method->literals = literals;
     }
 
+    free(frame->values);
+    free(frame->table);
+    memset(frame, 0, sizeof(LiteralFrame));
+}
+
+// Generate bytecode for a literal value
+static int generate_literal(AstNode* node, ScopeInfo* scope, int code_index) {
+    int literal_index = scope_literal(scope, node->literal);
+
     // Push the literal value
-    method->bytecode[code_index++] = BC_PUSH_CONSTANT;
-    method->bytecode[code_index++] = (uint8_t)literal_index;
+    code_index = emit_indexed(scope, code_index, BC_PUSH_CONSTANT, literal_index);
 
     return code_index;
 }
 
 // Generate bytecode for variable access
-static int generate_variable_access(Method* method, AstNode* node, ScopeInfo* scope, int code_index) {
+static int generate_variable_access(AstNode* node, ScopeInfo* scope, int code_index) {
     int var_index = -1;
     const char* var_name = symbol_to_string(node->variable.name);
 
-    // Check if it's a special variable
-    if (strcmp(var_name, "self") == 0) {
-        method->bytecode[code_index++] = BC_PUSH_THIS;
+    // Check if it's a special variable ('super' pushes self too; the send
+    // bytecode decides where lookup starts)
+    if (strcmp(var_name, "self") == 0 || strcmp(var_name, "super") == 0) {
+        scope_use_self(scope);
+        code_index = emit_byte(scope, code_index, BC_PUSH_THIS);
+        return code_index;
+    }
+
+    if (strcmp(var_name, "thisContext") == 0) {
+        code_index = emit_byte(scope, code_index, BC_PUSH_CONTEXT);
         return code_index;
     }
 
     if (strcmp(var_name, "nil") == 0) {
-        method->bytecode[code_index++] = BC_PUSH_SPECIAL;
-        method->bytecode[code_index++] = SPECIAL_NIL;
+        code_index = emit_byte(scope, code_index, BC_PUSH_SPECIAL);
+        code_index = emit_byte(scope, code_index, SPECIAL_NIL);
         return code_index;
     }
 
     if (strcmp(var_name, "true") == 0) {
-        method->bytecode[code_index++] = BC_PUSH_SPECIAL;
-        method->bytecode[code_index++] = SPECIAL_TRUE;
+        code_index = emit_byte(scope, code_index, BC_PUSH_SPECIAL);
+        code_index = emit_byte(scope, code_index, SPECIAL_TRUE);
         return code_index;
     }
 
     if (strcmp(var_name, "false") == 0) {
-        method->bytecode[code_index++] = BC_PUSH_SPECIAL;
-        method->bytecode[code_index++] = SPECIAL_FALSE;
+        code_index = emit_byte(scope, code_index, BC_PUSH_SPECIAL);
+        code_index = emit_byte(scope, code_index, SPECIAL_FALSE);
         return code_index;
     }
 
-    // Check local variables
-    for (int i = 0; i < scope->num_locals; i++) {
-        if (value_equals(scope->local_names[i], node->variable.name)) {
-            method->bytecode[code_index++] = BC_PUSH_LOCAL;
-            method->bytecode[code_index++] = (uint8_t)i;
-            return code_index;
-        }
-    }
-
-    // Check arguments
-    for (int i = 0; i < scope->num_args; i++) {
-        if (value_equals(scope->arg_names[i], node->variable.name)) {
-            method->bytecode[code_index++] = BC_PUSH_ARGUMENT;
-            method->bytecode[code_index++] = (uint8_t)i;
-            return code_index;
-        }
+    // Check locals and arguments, here and in enclosing blocks and methods
+    int scoped = generate_scoped_variable(node->variable.name, scope, false, code_index);
+    if (scoped >= 0) {
+        return scoped;
     }
 
     // Check instance variables
     for (int i = 0; i < scope->num_instances; i++) {
         if (value_equals(scope->instance_names[i], node->variable.name)) {
-            method->bytecode[code_index++] = BC_PUSH_FIELD;
-            method->bytecode[code_index++] = (uint8_t)i;
+            scope_use_self(scope);
+            code_index = emit_indexed(scope, code_index, BC_PUSH_FIELD, i);
             return code_index;
         }
     }
 
-    // If not found, assume it's a global
-    // Find or add to literals table
-    int global_index = -1;
-    Value name_symbol = node->variable.name;
+    // If not found, assume it's a global, referred to by its Association
+    int global_index = scope_literal(scope, vm_global_association(node->variable.name));
 
-    for (int i = 0; i < MAX_LITERALS; i++) {
-        if (value_equals(vm->literals[i], name_symbol)) {
-            global_index = i;
-            break;
-        }
-    }
-
-    if (global_index == -1) {
-        for (int i = 0; i < MAX_LITERALS; i++) {
-            if (is_nil(vm->literals[i])) {
-                vm->literals[i] = name_symbol;
-                global_index = i;
-                break;
-            }
-        }
-    }
-
-    if (global_index == -1) {
-        vm_error("Literals table is full");
-        return code_index;
-    }
-
-    method->bytecode[code_index++] = BC_PUSH_GLOBAL;
-    method->bytecode[code_index++] = (uint8_t)global_index;
+    code_index = emit_indexed(scope, code_index, BC_PUSH_GLOBAL, global_index);
 
     return code_index;
 }
 
 // Generate bytecode for an assignment
-static int generate_assignment(Method* method, AstNode* node, ScopeInfo* scope, int code_index) {
+static int generate_assignment(AstNode* node, ScopeInfo* scope, int code_index) {
     // First generate the value to be assigned
-    code_index = generate_bytecode(method, node->assign.value, scope, code_index);
+    code_index = generate_bytecode(node->assign.value, scope, code_index);
 
-    // Duplicate the value on the stack (we'll need it for the return value)
-    method->bytecode[code_index++] = BC_DUP;
+    // The stores leave the value on the stack as the assignment's result
 
     int var_index = -1;
     const char* var_name = symbol_to_string(node->assign.variable.name);
 
-    // Check local variables
-    for (int i = 0; i < scope->num_locals; i++) {
-        if (value_equals(scope->local_names[i], node->assign.variable.name)) {
-            method->bytecode[code_index++] = BC_STORE_LOCAL;
-            method->bytecode[code_index++] = (uint8_t)i;
-            return code_index;
-        }
-    }
-
-    // Check arguments
-    for (int i = 0; i < scope->num_args; i++) {
-        if (value_equals(scope->arg_names[i], node->assign.variable.name)) {
-            method->bytecode[code_index++] = BC_STORE_ARGUMENT;
-            method->bytecode[code_index++] = (uint8_t)i;
-            return code_index;
-        }
+    // Check locals and arguments, here and in enclosing blocks and methods
+    int scoped = generate_scoped_variable(node->assign.variable.name, scope, true, code_index);
+    if (scoped >= 0) {
+        return scoped;
     }
 
     // Check instance variables
     for (int i = 0; i < scope->num_instances; i++) {
         if (value_equals(scope->instance_names[i], node->assign.variable.name)) {
-            method->bytecode[code_index++] = BC_STORE_FIELD;
-            method->bytecode[code_index++] = (uint8_t)i;
+            scope_use_self(scope);
+            code_index = emit_indexed(scope, code_index, BC_STORE_FIELD, i);
             return code_index;
         }
     }
 
-    // If not found, assume it's a global
-    // Find or add to literals table
-    int global_index = -1;
-    Value name_symbol = node->assign.variable.name;
+    // If not found, assume it's a global, referred to by its Association
+    int global_index = scope_literal(scope, vm_global_association(node->assign.variable.name));
 
-    for (int i = 0; i < MAX_LITERALS; i++) {
-        if (value_equals(vm->literals[i], name_symbol)) {
-            global_index = i;
-            break;
-        }
-    }
+    code_index = emit_indexed(scope, code_index, BC_STORE_GLOBAL, global_index);
 
-    if (global_index == -1) {
-        for (int i = 0; i < MAX_LITERALS; i++) {
-            if (is_nil(vm->literals[i])) {
-                vm->literals[i] = name_symbol;
-                global_index = i;
-                break;
-            }
-        }
-    }
+    return code_index;
+}
 
-    if (global_index == -1) {
-        vm_error("Literals table is full");
-        return code_index;
-    }
+// Generate bytecode for a return statement
+static int generate_return(AstNode* node, ScopeInfo* scope, int code_index) {
+    // Generate the return value expression
+    code_index = generate_bytecode(node->return_expr, scope, code_index);
 
-    method->bytecode[code_index++] = BC_STORE_GLOBAL;
-    method->bytecode[code_index++] = (uint8_t)global_index;
+    // In a block, ^ returns from the method the block was created in
+    if (scope->outer != NULL) {
+        scope_capture(scope, INT_MAX);
+        code_index = emit_byte(scope, code_index, BC_RETURN_NON_LOCAL);
+    } else {
+        code_index = emit_byte(scope, code_index, BC_RETURN_LOCAL);
+    }
 
     return code_index;
 }
 
-// Generate bytecode for a return statement
-static int generate_return(Method* method, AstNode* node, ScopeInfo* scope, int code_index) {
-    // Generate the return value expression
-    code_index = generate_bytecode(method, node->return_expr, scope, code_index);
+// Emit a jump with its target left open; answers the operand's position
+// for patch_jump
+static int emit_jump(ScopeInfo* scope, uint8_t opcode, int* code_index) {
+    *code_index = emit_byte(scope, *code_index, opcode);
+    *code_index = emit_byte(scope, *code_index, 0);
+    *code_index = emit_byte(scope, *code_index, 0);
+    return *code_index - 2;
+}
 
-    // Add return instruction
-    method->bytecode[code_index++] = BC_RETURN_LOCAL;
+// Point a jump emitted by emit_jump at an absolute bytecode index
+static void patch_jump(ScopeInfo* scope, int operand_index, int target) {
+    scope->code.bytes[operand_index] = (uint8_t)(target >> 8);
+    scope->code.bytes[operand_index + 1] = (uint8_t)target;
+}
 
+// Emit a jump back to a known bytecode index
+static int emit_jump_to(ScopeInfo* scope, uint8_t opcode, int target, int code_index) {
+    patch_jump(scope, emit_jump(scope, opcode, &code_index), target);
     return code_index;
 }
 
-// Generate bytecode for a message send
-static int generate_message_send(Method* method, AstNode* node, ScopeInfo* scope, int code_index) {
-    // Generate the receiver
-    code_index = generate_bytecode(method, node->message.receiver, scope, code_index);
+// Whether a node is a literal block taking 'arg_count' arguments
+static bool is_inlinable_block(AstNode* node, int arg_count) {
+    return node->type == AST_BLOCK && node->block.arg_count == arg_count;
+}
 
-    // Generate each argument
-    for (int i = 0; i < node->message.arg_count; i++) {
-        code_index = generate_bytecode(method, node->message.args[i], scope, code_index);
+// Reserve a local for the code generator ('name' may be nil for a hidden
+// one); answers its index
+static int scope_add_local(ScopeInfo* scope, Value name) {
+    if (scope->num_locals >= (int)MAX_LOCALS) {
+        vm_error("Too many local variables");
+        return scope->num_locals - 1;
     }
 
-    // Find or add the selector to literals table
-    int selector_index = -1;
+    scope->local_names = realloc(scope->local_names, sizeof(Value) * (scope->num_locals + 1));
+    scope->local_names[scope->num_locals] = name;
+    return scope->num_locals++;
+}
 
-    for (int i = 0; i < MAX_LITERALS; i++) {
-        if (value_equals(vm->literals[i], node->message.selector)) {
-            selector_index = i;
-            break;
-        }
+// Generate a literal block's body in line (its value is left on the stack)
+static int generate_inlined_block(AstNode* block, ScopeInfo* scope, int code_index) {
+    return generate_bytecode(block->block.body, scope, code_index);
+}
+
+// Push nil, true or false
+static int generate_special(ScopeInfo* scope, uint8_t special, int code_index) {
+    code_index = emit_byte(scope, code_index, BC_PUSH_SPECIAL);
+    code_index = emit_byte(scope, code_index, special);
+    return code_index;
+}
+
+// Whether a send is a control structure that is compiled into jumps (see
+// generate_control_structure)
+static bool is_control_structure(AstNode* node) {
+    if (node->type != AST_MESSAGE_SEND) {
+        return false;
     }
 
-    if (selector_index == -1) {
-        for (int i = 0; i < MAX_LITERALS; i++) {
-            if (is_nil(vm->literals[i])) {
-                vm->literals[i] = node->message.selector;
-                selector_index = i;
-                break;
+    const char* selector = symbol_to_string(node->message.selector);
+    AstNode* receiver = node->message.receiver;
+    AstNode** args = node->message.args;
+    int arg_count = node->message.arg_count;
+
+    if (receiver->type == AST_VARIABLE && strcmp(symbol_to_string(receiver->variable.name), "super") == 0) {
+        return false;
+    }
+    if (arg_count == 1 && is_inlinable_block(args[0], 0) &&
+        (strcmp(selector, "ifTrue:") == 0 || strcmp(selector, "ifFalse:") == 0 ||
+         strcmp(selector, "and:") == 0 || strcmp(selector, "or:") == 0)) {
+        return true;
+    }
+    if (arg_count == 2 && is_inlinable_block(args[0], 0) && is_inlinable_block(args[1], 0) &&
+        (strcmp(selector, "ifTrue:ifFalse:") == 0 || strcmp(selector, "ifFalse:ifTrue:") == 0)) {
+        return true;
+    }
+    if (arg_count == 1 && is_inlinable_block(receiver, 0) && is_inlinable_block(args[0], 0) &&
+        (strcmp(selector, "whileTrue:") == 0 || strcmp(selector, "whileFalse:") == 0)) {
+        return true;
+    }
+    return arg_count == 2 && is_inlinable_block(args[1], 1) && strcmp(selector, "to:do:") == 0;
+}
+
+// Whether a block literal that is the receiver (index -1) or argument
+// 'index' of an inlined control structure is compiled in line
+static bool is_inlined_operand(AstNode* send, int index) {
+    const char* selector = symbol_to_string(send->message.selector);
+    if (strcmp(selector, "to:do:") == 0) {
+        return index == 1;
+    }
+    return index >= 0 || strncmp(selector, "while", 5) == 0;
+}
+
+// Whether a block that is not inlined, somewhere within 'node', refers to
+// the variable 'name' as it is visible at 'node' ('in_closure' says whether
+// 'node' itself already lies in such a block)
+static bool is_captured_in(AstNode* node, Value name, bool in_closure) {
+    switch (node->type) {
+        case AST_VARIABLE:
+            return in_closure && value_equals(node->variable.name, name);
+
+        case AST_ASSIGNMENT:
+            return (in_closure && value_equals(node->assign.variable.name, name)) ||
+                   is_captured_in(node->assign.value, name, in_closure);
+
+        case AST_RETURN:
+            return is_captured_in(node->return_expr, name, in_closure);
+
+        case AST_SEQUENCE:
+            for (int i = 0; i < node->sequence.count; i++) {
+                if (is_captured_in(node->sequence.statements[i], name, in_closure)) {
+                    return true;
+                }
+            }
+            return false;
+
+        case AST_BLOCK:
+            // An argument of the same name hides the variable
+            for (int i = 0; i < node->block.arg_count; i++) {
+                if (value_equals(node->block.arg_names[i], name)) {
+                    return false;
+                }
+            }
+            return is_captured_in(node->block.body, name, true);
+
+        case AST_MESSAGE_SEND: {
+            bool inlined = is_control_structure(node);
+            for (int i = -1; i < node->message.arg_count; i++) {
+                AstNode* operand = i < 0 ? node->message.receiver : node->message.args[i];
+                if (inlined && operand->type == AST_BLOCK && is_inlined_operand(node, i)) {
+                    // Its arguments are not hidden: an inlined to:do: reuses
+                    // the name for a local of the same frame
+                    if (is_captured_in(operand->block.body, name, in_closure)) {
+                        return true;
+                    }
+                } else if (is_captured_in(operand, name, in_closure)) {
+                    return true;
+                }
             }
+            return false;
         }
+
+        default:
+            return false;
     }
+}
+
+// Emit a send of 'selector' to the receiver and arguments on the stack
+static int emit_send(ScopeInfo* scope, Value selector, int arg_count, bool is_super, int code_index) {
+    int selector_index = scope_literal(scope, selector);
 
-    if (selector_index == -1) {
-        vm_error("Literals table is full");
+    int site = scope->num_send_sites++;
+    bool wide = selector_index > UINT8_MAX || site > UINT8_MAX;
+    code_index = emit_opcode(scope, code_index, is_super ? BC_SUPER_SEND : BC_SEND, wide);
+    code_index = emit_operand(scope, code_index, selector_index, wide);
+    code_index = emit_byte(scope, code_index, (uint8_t)arg_count);
+    code_index = emit_operand(scope, code_index, site, wide);
+    return code_index;
+}
+
+// Compile a control structure with literal block arguments into jumps, so
+// no block is created and nothing is sent. Answers the new code index, or
+// -1 if the send is not one of the inlined selectors.
+static int generate_control_structure(AstNode* node, ScopeInfo* scope, int code_index) {
+    if (!is_control_structure(node)) {
+        return -1;
+    }
+
+    const char* selector = symbol_to_string(node->message.selector);
+    AstNode* receiver = node->message.receiver;
+    AstNode** args = node->message.args;
+    int end_jump, else_jump;
+
+    if (node->message.arg_count == 1 &&
+        (strcmp(selector, "ifTrue:") == 0 || strcmp(selector, "ifFalse:") == 0)) {
+        // cond JUMP_IF_<not taken> else; body JUMP end; else: nil; end:
+        bool if_true = selector[2] == 'T';
+        code_index = generate_bytecode(receiver, scope, code_index);
+        else_jump = emit_jump(scope, if_true ? BC_JUMP_IF_FALSE : BC_JUMP_IF_TRUE, &code_index);
+        code_index = generate_inlined_block(args[0], scope, code_index);
+        end_jump = emit_jump(scope, BC_JUMP, &code_index);
+        patch_jump(scope, else_jump, code_index);
+        code_index = generate_special(scope, SPECIAL_NIL, code_index);
+        patch_jump(scope, end_jump, code_index);
         return code_index;
     }
 
-    // Check if this is a super send
-    if (node->message.receiver->type == AST_VARIABLE &&
-        strcmp(symbol_to_string(node->message.receiver->variable.name), "super") == 0) {
-        // Super send
-        method->bytecode[code_index++] = BC_SUPER_SEND;
-    } else {
-        // Normal send
-        method->bytecode[code_index++] = BC_SEND;
+    if (node->message.arg_count == 2 &&
+        (strcmp(selector, "ifTrue:ifFalse:") == 0 || strcmp(selector, "ifFalse:ifTrue:") == 0)) {
+        bool if_true = selector[2] == 'T';
+        code_index = generate_bytecode(receiver, scope, code_index);
+        else_jump = emit_jump(scope, if_true ? BC_JUMP_IF_FALSE : BC_JUMP_IF_TRUE, &code_index);
+        code_index = generate_inlined_block(args[0], scope, code_index);
+        end_jump = emit_jump(scope, BC_JUMP, &code_index);
+        patch_jump(scope, else_jump, code_index);
+        code_index = generate_inlined_block(args[1], scope, code_index);
+        patch_jump(scope, end_jump, code_index);
+        return code_index;
     }
 
-    method->bytecode[code_index++] = (uint8_t)selector_index;
-    method->bytecode[code_index++] = (uint8_t)node->message.arg_count;
+    if (node->message.arg_count == 1 &&
+        (strcmp(selector, "and:") == 0 || strcmp(selector, "or:") == 0)) {
+        // Short-circuit: the receiver decides unless it is true (and:) or
+        // false (or:), in which case the block's value is the answer
+        bool is_and = selector[0] == 'a';
+        code_index = generate_bytecode(receiver, scope, code_index);
+        else_jump = emit_jump(scope, is_and ? BC_JUMP_IF_FALSE : BC_JUMP_IF_TRUE, &code_index);
+        code_index = generate_inlined_block(args[0], scope, code_index);
+        end_jump = emit_jump(scope, BC_JUMP, &code_index);
+        patch_jump(scope, else_jump, code_index);
+        code_index = generate_special(scope, is_and ? SPECIAL_FALSE : SPECIAL_TRUE, code_index);
+        patch_jump(scope, end_jump, code_index);
+        return code_index;
+    }
 
+    if (strcmp(selector, "whileTrue:") == 0 || strcmp(selector, "whileFalse:") == 0) {
+        // top: cond JUMP_IF_<done> end; body POP JUMP top; end: nil
+        bool while_true = selector[5] == 'T';
+        int top = code_index;
+        code_index = generate_inlined_block(receiver, scope, code_index);
+        end_jump = emit_jump(scope, while_true ? BC_JUMP_IF_FALSE : BC_JUMP_IF_TRUE, &code_index);
+        code_index = generate_inlined_block(args[0], scope, code_index);
+        code_index = emit_byte(scope, code_index, BC_POP);
+        code_index = emit_jump_to(scope, BC_JUMP, top, code_index);
+        patch_jump(scope, end_jump, code_index);
+        return generate_special(scope, SPECIAL_NIL, code_index);
+    }
+
+    // to:do: is all that is left. The block's argument becomes a local of
+    // the method, next to a hidden one for the limit; the receiver stays on
+    // the stack as the answer. A local is shared by every iteration, though,
+    // so if a block inside the body refers to the argument the body stays a
+    // block, evaluated with value: each time round to give each iteration a
+    // variable of its own.
+    bool closure = is_captured_in(args[1]->block.body, args[1]->block.arg_names[0], false);
+    int counter = scope_add_local(scope, closure ? vm->nil : args[1]->block.arg_names[0]);
+    int limit = scope_add_local(scope, vm->nil);
+    int body = closure ? scope_add_local(scope, vm->nil) : -1;
+    AstNode one = { .type = AST_LITERAL, .literal = make_int(1) };
+
+    code_index = generate_bytecode(receiver, scope, code_index);
+    code_index = emit_indexed(scope, code_index, BC_STORE_LOCAL, counter);
+    code_index = generate_bytecode(args[0], scope, code_index);
+    code_index = emit_indexed(scope, code_index, BC_STORE_LOCAL, limit);
+    code_index = emit_byte(scope, code_index, BC_POP);
+    if (closure) {
+        code_index = generate_block(args[1], scope, code_index);
+        code_index = emit_indexed(scope, code_index, BC_STORE_LOCAL, body);
+        code_index = emit_byte(scope, code_index, BC_POP);
+    }
+
+    // top: counter <= limit JUMP_IF_FALSE end; body POP;
+    //      counter := counter + 1 POP JUMP top; end:
+    int top = code_index;
+    code_index = emit_indexed(scope, code_index, BC_PUSH_LOCAL, counter);
+    code_index = emit_indexed(scope, code_index, BC_PUSH_LOCAL, limit);
+    code_index = emit_byte(scope, code_index, BC_LE);
+    end_jump = emit_jump(scope, BC_JUMP_IF_FALSE, &code_index);
+    if (closure) {
+        code_index = emit_indexed(scope, code_index, BC_PUSH_LOCAL, body);
+        code_index = emit_indexed(scope, code_index, BC_PUSH_LOCAL, counter);
+        code_index = emit_send(scope, symbol_for("value:"), 1, false, code_index);
+    } else {
+        code_index = generate_inlined_block(args[1], scope, code_index);
+    }
+    code_index = emit_byte(scope, code_index, BC_POP);
+    code_index = emit_indexed(scope, code_index, BC_PUSH_LOCAL, counter);
+    code_index = generate_literal(&one, scope, code_index);
+    code_index = emit_byte(scope, code_index, BC_ADD);
+    code_index = emit_indexed(scope, code_index, BC_STORE_LOCAL, counter);
+    code_index = emit_byte(scope, code_index, BC_POP);
+    code_index = emit_jump_to(scope, BC_JUMP, top, code_index);
+    patch_jump(scope, end_jump, code_index);
+
+    // The block argument goes out of scope (its slot stays reserved)
+    scope->local_names[counter] = vm->nil;
     return code_index;
 }
 
+// Generate bytecode for a message send
+static int generate_message_send(AstNode* node, ScopeInfo* scope, int code_index) {
+    bool is_super = node->message.receiver->type == AST_VARIABLE &&
+                    strcmp(symbol_to_string(node->message.receiver->variable.name), "super") == 0;
+
+    // Control structures with literal blocks compile to jumps
+    if (!is_super) {
+        int inlined = generate_control_structure(node, scope, code_index);
+        if (inlined >= 0) {
+            return inlined;
+        }
+    }
+
+    // Generate the receiver
+    code_index = generate_bytecode(node->message.receiver, scope, code_index);
+
+    // Generate each argument
+    for (int i = 0; i < node->message.arg_count; i++) {
+        code_index = generate_bytecode(node->message.args[i], scope, code_index);
+    }
+
+    // Arithmetic and comparisons have their own bytecodes, which skip the
+    // send for SmallIntegers
+    if (node->message.arg_count == 1 && !is_super) {
+        for (int i = 0; i < SPECIAL_SELECTOR_COUNT; i++) {
+            if (value_identical(vm->special_selectors[i], node->message.selector)) {
+                code_index = emit_byte(scope, code_index, (uint8_t)(BC_ADD + i));
+                return code_index;
+            }
+        }
+    }
+
+    return emit_send(scope, node->message.selector, node->message.arg_count, is_super, code_index);
+}
+
 // Generate bytecode for a block
-static int generate_block(Method* method, AstNode* node, ScopeInfo* scope, int code_index) {
-    // For now, we'll just create a placeholder for blocks
-    // A full implementation would create a block context and compile the block body
-    vm_error("Block compilation not yet implemented");
+//
+// The body is compiled into a Method of its own, with the enclosing scopes
+// visible to it. A block that refers to nothing of the frame it is created
+// in is made into a Block once, here; the rest get a Block per evaluation
+// of BC_PUSH_BLOCK (see context.h).
+static int generate_block(AstNode* node, ScopeInfo* scope, int code_index) {
+    ScopeInfo block_scope;
+    block_scope.selector = scope->selector;
+    block_scope.holder = scope->holder;
+    block_scope.arg_names = node->block.arg_names;
+    block_scope.num_args = node->block.arg_count;
+    block_scope.local_names = NULL;
+    block_scope.num_locals = 0;
+    block_scope.instance_names = scope->instance_names;
+    block_scope.num_instances = scope->num_instances;
+    block_scope.num_send_sites = 0;
+    block_scope.outer = scope;
+    block_scope.captures = false;
+    block_scope.uses_self = false;
+    memset(&block_scope.literals, 0, sizeof(LiteralFrame));
+    memset(&block_scope.code, 0, sizeof(CodeBuffer));
+
+    // The block answers its last expression (nil if it is empty)
+    int block_code_index = generate_bytecode(node->block.body, &block_scope, 0);
+    block_code_index = emit_byte(&block_scope, block_code_index, BC_RETURN_LOCAL);
+    Method* block_method = scope_new_method(&block_scope, block_code_index);
+    free(block_scope.local_names);
+
+    Value literal = make_object((Object*)block_method);
+    if (!block_scope.captures && !block_scope.uses_self) {
+        literal = block_new(literal, vm->nil, vm->nil);
+    }
+
+    int literal_index = literal_frame_add(&scope->literals, literal, false);
+    if (literal_index < 0) {
+        vm_error("Too many literals in method %s", symbol_to_string(scope->selector));
+        return code_index;
+    }
 
-    // Push a nil value as a placeholder
-    method->bytecode[code_index++] = BC_PUSH_SPECIAL;
-    method->bytecode[code_index++] = SPECIAL_NIL;
+    code_index = emit_indexed(scope, code_index, BC_PUSH_BLOCK, literal_index);
 
     return code_index;
 }
 
 // Generate bytecode for a sequence of expressions
-static int generate_sequence(Method* method, AstNode* node, ScopeInfo* scope, int code_index) {
+static int generate_sequence(AstNode* node, ScopeInfo* scope, int code_index) {
     // Generate code for each statement
     for (int i = 0; i < node->sequence.count; i++) {
-        code_index = generate_bytecode(method, node->sequence.statements[i], scope, code_index);
+        code_index = generate_bytecode(node->sequence.statements[i], scope, code_index);
 
         // Pop the result if it's not the last statement
         if (i < node->sequence.count - 1) {
-            method->bytecode[code_index++] = BC_POP;
+            code_index = emit_byte(scope, code_index, BC_POP);
         }
     }
 
     // If the sequence is empty, push nil
     if (node->sequence.count == 0) {
-        method->bytecode[code_index++] = BC_PUSH_SPECIAL;
-        method->bytecode[code_index++] = SPECIAL_NIL;
+        code_index = emit_byte(scope, code_index, BC_PUSH_SPECIAL);
+        code_index = emit_byte(scope, code_index, SPECIAL_NIL);
     }
 
     return code_index;
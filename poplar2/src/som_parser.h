@@ -63,7 +63,6 @@ typedef struct {
     Token previous;
     bool had_error;
     bool panic_mode;
-    int class_index;          // Current global index for classes
 } Parser;
 
 // Token handling functions (internal, not exposed)
@@ -84,25 +83,39 @@ void print_tokens(const char* source);
 
 // Bytecode generation
 
-// Scope information for variable resolution
+// Literals of the method being compiled, deduplicated through a hash table
+// of their indices (plus one, zero marking an empty entry)
+typedef struct {
+    Value* values;           // Literals, in the order they were added
+    int count;               // Number of literals
+    int capacity;            // Allocated size of 'values'
+    uint16_t* table;         // Open addressing table, NULL until the first literal
+    int table_size;          // Power of two, at least twice 'count'
+} LiteralFrame;
+
+// Bytecode of the method or block being compiled, grown as it is emitted;
+// the Method is allocated at its exact size once the code is complete
 typedef struct {
+    uint8_t* bytes;          // Bytecode emitted so far
+    int capacity;            // Allocated size of 'bytes'
+} CodeBuffer;
+
+// Scope information for variable resolution
+typedef struct ScopeInfo {
+    Value selector;          // Selector of the method being compiled (blocks share their home's)
+    Value holder;            // Class the method is compiled for
     Value* local_names;      // Names of local variables
     int num_locals;          // Number of local variables
     Value* arg_names;        // Names of arguments
     int num_args;            // Number of arguments
     Value* instance_names;   // Names of instance variables (if known)
     int num_instances;       // Number of instance variables
+    int num_send_sites;      // Send sites numbered so far (one inline cache each)
+    struct ScopeInfo* outer; // Scope a block's body is nested in, NULL for a method
+    bool captures;           // Block refers to variables of enclosing frames or returns from its home
+    bool uses_self;          // Block refers to self, super or instance variables
+    LiteralFrame literals;   // Literal frame of the method or block being compiled
+    CodeBuffer code;         // Bytecode of the method or block being compiled
 } ScopeInfo;
 
-// Forward declaration for code generator functions
-static int generate_bytecode(Method* method, AstNode* node, ScopeInfo* scope, int code_index);
-static int generate_expression(Method* method, AstNode* node, ScopeInfo* scope, int code_index);
-static int generate_message_send(Method* method, AstNode* node, ScopeInfo* scope, int code_index);
-static int generate_variable_access(Method* method, AstNode* node, ScopeInfo* scope, int code_index);
-static int generate_assignment(Method* method, AstNode* node, ScopeInfo* scope, int code_index);
-static int generate_literal(Method* method, AstNode* node, int code_index);
-static int generate_return(Method* method, AstNode* node, ScopeInfo* scope, int code_index);
-static int generate_sequence(Method* method, AstNode* node, ScopeInfo* scope, int code_index);
-static int generate_block(Method* method, AstNode* node, ScopeInfo* scope, int code_index);
-
 #endif /* POPLAR2_SOM_PARSER_H */
@@ -4,21 +4,17 @@
 #include <stdio.h>
 
 // Value creation helpers
-Value make_int(int16_t value) {
+Value make_int(int32_t value) {
     Value v;
     v.tag = TAG_INT;
-    v.value = (uint32_t)(value & 0x7FFF); // Keep only 15 bits for signed int
-    // Set the sign bit separately
-    if (value < 0) {
-        v.value |= 0x8000; // Set the 16th bit as sign bit
-    }
+    v.value = (uint32_t)value & 0x3FFFFFFF; // SMALL_INT_MIN..SMALL_INT_MAX
     return v;
 }
 
 Value make_object(Object* obj) {
     Value v;
     v.tag = TAG_OBJ;
-    v.value = (uint32_t)obj;
+    v.value = (uint32_t)(uintptr_t)obj; // Below VALUE_ADDRESS_LIMIT (see gc.c)
     return v;
 }
 
@@ -56,20 +52,15 @@ bool is_false(Value value) {
 }
 
 // Value extraction
-int16_t as_int(Value value) {
+int32_t as_int(Value value) {
     if (!is_int(value)) {
         // Handle error: trying to use non-int as int
         fprintf(stderr, "Error: Trying to extract int from non-int value\n");
         return 0;
     }
     
-    // Extract the value, handling the sign bit
-    int16_t result = (int16_t)(value.value & 0x7FFF);
-    if (value.value & 0x8000) {
-        // If sign bit is set, make it negative
-        result = -result;
-    }
-    return result;
+    // Sign-extend the 30-bit payload
+    return (int32_t)((uint32_t)value.value << 2) >> 2;
 }
 
 Object* as_object(Value value) {
@@ -78,7 +69,7 @@ Object* as_object(Value value) {
         fprintf(stderr, "Error: Trying to extract object from non-object value\n");
         return NULL;
     }
-    return (Object*)value.value;
+    return (Object*)(uintptr_t)value.value;
 }
 
 uint8_t as_special(Value value) {
@@ -20,6 +20,14 @@ typedef struct Class Class;
 #define SPECIAL_TRUE        1
 #define SPECIAL_FALSE       2
 
+// SmallInteger range: the 30-bit payload, two's complement
+#define SMALL_INT_MIN       (-(1 << 29))
+#define SMALL_INT_MAX       ((1 << 29) - 1)
+
+// Object addresses are stored in the same 30 bits, so every object must lie
+// below this address
+#define VALUE_ADDRESS_LIMIT ((uintptr_t)1 << 30)
+
 // Tagged value representation
 typedef struct {
     union {
@@ -32,7 +40,7 @@ typedef struct {
 } Value;
 
 // Value creation helpers
-Value make_int(int16_t value);
+Value make_int(int32_t value);
 Value make_object(Object* obj);
 Value make_special(uint8_t special);
 
@@ -45,7 +53,7 @@ bool is_true(Value value);
 bool is_false(Value value);
 
 // Value extraction
-int16_t as_int(Value value);
+int32_t as_int(Value value);
 Object* as_object(Value value);
 uint8_t as_special(Value value);
 
@@ -0,0 +1,289 @@
+// verifier.c - Bytecode verification for Poplar2
+
+#include "verifier.h"
+#include "object.h"
+#include "interpreter.h"
+#include <stdlib.h>
+
+// State of the verification of one method
+typedef struct Verifier {
+    Method* method;
+    int32_t* depth;        // Operand stack depth before each instruction (-1: not reached)
+    uint16_t* pending;     // Reached instructions still to be checked
+    int pending_count;
+    int32_t max_depth;
+} Verifier;
+
+// Report why a method fails verification
+static bool verifier_fail(Verifier* verifier, int pc, const char* problem) {
+    vm_error("Invalid bytecode in %s at %d: %s", symbol_to_string(verifier->method->name), pc, problem);
+    return false;
+}
+
+// Note that the instruction at 'target' is reached with 'depth' operands
+static bool verifier_reach(Verifier* verifier, int pc, int target, int32_t depth) {
+    if (target >= verifier->method->bytecode_count) {
+        return verifier_fail(verifier, pc, "runs off the end of the method");
+    }
+
+    if (verifier->depth[target] < 0) {
+        verifier->depth[target] = depth;
+        verifier->pending[verifier->pending_count++] = (uint16_t)target;
+    } else if (verifier->depth[target] != depth) {
+        return verifier_fail(verifier, pc, "stack depths differ where paths meet");
+    }
+    return true;
+}
+
+// The literal at 'index', or NULL if there is none
+static Object* verifier_literal(Method* method, uint16_t index) {
+    if (!is_object(method->literals) || index >= as_object(method->literals)->size) {
+        return NULL;
+    }
+    Value literal = as_object(method->literals)->fields[index];
+    return is_object(literal) ? as_object(literal) : NULL;
+}
+
+// Whether literal 'index' can be pushed as a value
+static bool verifier_has_literal(Method* method, uint16_t index) {
+    return is_object(method->literals) && index < as_object(method->literals)->size;
+}
+
+// Whether 'index' names a field of every receiver the method can run on
+static bool verifier_has_field(Method* method, uint16_t index) {
+    if (!is_object(method->holder)) {
+        return false;
+    }
+    Value instance_size = ((Class*)as_object(method->holder))->instance_size;
+    return is_int(instance_size) && index < as_int(instance_size);
+}
+
+// Whether an instruction can follow BC_EXTEND (see op_extend)
+static bool verifier_has_wide_form(uint8_t opcode) {
+    switch (opcode) {
+        case BC_PUSH_LOCAL: case BC_PUSH_ARGUMENT: case BC_PUSH_FIELD: case BC_PUSH_BLOCK:
+        case BC_PUSH_CONSTANT: case BC_PUSH_GLOBAL: case BC_PUSH_OUTER:
+        case BC_STORE_LOCAL: case BC_STORE_ARGUMENT: case BC_STORE_FIELD: case BC_STORE_GLOBAL:
+        case BC_STORE_OUTER: case BC_SEND: case BC_SUPER_SEND:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Verify the Method of block literal 'index'
+static bool verifier_verify_block(Method* method, uint16_t index) {
+    Object* literal = verifier_literal(method, index);
+    if (literal != NULL && literal->class_index == CLASS_INDEX_BLOCK) {
+        Value block_method = ((Block*)literal)->method;
+        literal = is_object(block_method) ? as_object(block_method) : NULL;
+    }
+    if (literal == NULL || literal->class_index != CLASS_INDEX_METHOD) {
+        return false;
+    }
+
+    return verifier_verify((Method*)literal);
+}
+
+// Check the instruction at 'pc' and reach the ones that can follow it
+static bool verifier_step(Verifier* verifier, int pc) {
+    Method* method = verifier->method;
+    const uint8_t* ip = &method->bytecode[pc];
+    bool wide = *ip == BC_EXTEND;
+
+    if ((wide && pc + 1 >= method->bytecode_count) ||
+        pc + interpreter_instruction_length(ip) > method->bytecode_count) {
+        return verifier_fail(verifier, pc, "operands run off the end of the method");
+    }
+    if (wide && !verifier_has_wide_form(ip[1])) {
+        return verifier_fail(verifier, pc, "invalid extended bytecode");
+    }
+
+    // The first operand, which is two bytes for the wide form
+    uint8_t opcode = wide ? ip[1] : ip[0];
+    const uint8_t* operands = wide ? ip + 2 : ip + 1;
+    uint16_t index = wide ? (uint16_t)(operands[0] << 8 | operands[1]) : operands[0];
+
+    int32_t depth = verifier->depth[pc];
+    int needed = 0;          // Operands the instruction takes off the stack
+    int pushed = 0;          // Values it leaves in their place
+    int peak = 0;            // Values it pushes before taking any off
+    int jump = -1;
+    bool falls_through = true;
+    const char* problem = NULL;
+
+    switch (opcode) {
+        case BC_PUSH_LOCAL:
+            problem = index >= method->num_locals ? "local index out of range" : NULL;
+            pushed = 1;
+            break;
+        case BC_PUSH_ARGUMENT:
+            problem = index >= method->num_args ? "argument index out of range" : NULL;
+            pushed = 1;
+            break;
+        case BC_PUSH_FIELD:
+            problem = !verifier_has_field(method, index) ? "field index out of range" : NULL;
+            pushed = 1;
+            break;
+        case BC_PUSH_BLOCK:
+            problem = !verifier_verify_block(method, index) ? "invalid block literal" : NULL;
+            pushed = 1;
+            break;
+        case BC_PUSH_CONSTANT:
+            problem = !verifier_has_literal(method, index) ? "literal index out of range" : NULL;
+            pushed = 1;
+            break;
+        case BC_PUSH_GLOBAL: {
+            Object* literal = verifier_literal(method, index);
+            problem = literal == NULL || literal->class_index != CLASS_INDEX_ASSOCIATION ? "invalid global literal" : NULL;
+            pushed = 1;
+            break;
+        }
+        case BC_PUSH_SPECIAL:
+            problem = index > SPECIAL_FALSE ? "invalid special value" : NULL;
+            pushed = 1;
+            break;
+        case BC_PUSH_OUTER:
+        case BC_PUSH_CONTEXT:
+        case BC_PUSH_THIS:
+            pushed = 1;
+            break;
+
+        case BC_POP:
+            needed = 1;
+            break;
+        case BC_DUP:
+            needed = 1;
+            pushed = 2;
+            break;
+
+        case BC_STORE_LOCAL:
+            problem = index >= method->num_locals ? "local index out of range" : NULL;
+            needed = pushed = 1;
+            break;
+        case BC_STORE_ARGUMENT:
+            problem = index >= method->num_args ? "argument index out of range" : NULL;
+            needed = pushed = 1;
+            break;
+        case BC_STORE_FIELD:
+            problem = !verifier_has_field(method, index) ? "field index out of range" : NULL;
+            needed = pushed = 1;
+            break;
+        case BC_STORE_GLOBAL: {
+            Object* literal = verifier_literal(method, index);
+            problem = literal == NULL || literal->class_index != CLASS_INDEX_ASSOCIATION ? "invalid global literal" : NULL;
+            needed = pushed = 1;
+            break;
+        }
+        case BC_STORE_OUTER:
+            needed = pushed = 1;
+            break;
+
+        case BC_SEND:
+        case BC_SUPER_SEND:
+            // Selector, argument count, then the site
+            problem = verifier_literal(method, index) == NULL ? "invalid selector literal" : NULL;
+            needed = operands[wide ? 2 : 1] + 1;
+            pushed = 1;
+            break;
+        case BC_RETURN_LOCAL:
+        case BC_RETURN_NON_LOCAL:
+            needed = 1;
+            falls_through = false;
+            break;
+
+        case BC_JUMP:
+        case BC_JUMP_IF_TRUE:
+        case BC_JUMP_IF_FALSE:
+            needed = opcode != BC_JUMP;
+            jump = ip[1] << 8 | ip[2];
+            falls_through = opcode != BC_JUMP;
+            break;
+
+        case BC_PRIMITIVE:
+            needed = ip[2];
+            pushed = 1;
+            break;
+
+        case BC_ADD: case BC_SUB: case BC_MUL: case BC_DIV: case BC_MOD:
+        case BC_LT: case BC_GT: case BC_LE: case BC_GE: case BC_EQ: case BC_NE:
+            needed = 2;
+            pushed = 1;
+            break;
+
+        case BC_STORE_LOCAL_POP:
+            problem = index >= method->num_locals ? "local index out of range" : NULL;
+            needed = 1;
+            break;
+        case BC_RETURN_SELF:
+            falls_through = false;
+            break;
+        case BC_PUSH_FIELD_RETURN:
+            problem = !verifier_has_field(method, index) ? "field index out of range" : NULL;
+            falls_through = false;
+            break;
+        case BC_PUSH_LOCAL_SEND:
+            // The local is the last of the send's operands
+            problem = index >= method->num_locals ? "local index out of range"
+                    : verifier_literal(method, ip[2]) == NULL ? "invalid selector literal" : NULL;
+            peak = 1;
+            needed = ip[3] + 1;
+            pushed = 1;
+            break;
+
+        default:
+            problem = "unknown bytecode";
+            break;
+    }
+
+    if (problem != NULL) {
+        return verifier_fail(verifier, pc, problem);
+    }
+    if (depth + peak < needed) {
+        return verifier_fail(verifier, pc, "stack underflow");
+    }
+
+    int32_t after = depth + peak - needed + pushed;
+    if (depth + peak > verifier->max_depth) {
+        verifier->max_depth = depth + peak;
+    }
+    if (after > verifier->max_depth) {
+        verifier->max_depth = after;
+    }
+
+    if (jump >= 0 && !verifier_reach(verifier, pc, jump, after)) {
+        return false;
+    }
+    return !falls_through || verifier_reach(verifier, pc, pc + interpreter_instruction_length(ip), after);
+}
+
+// Verify a method and its blocks and set their max_stack
+bool verifier_verify(Method* method) {
+    Verifier verifier = { method, NULL, NULL, 0, 0 };
+    verifier.depth = malloc(method->bytecode_count * sizeof(int32_t));
+    verifier.pending = malloc(method->bytecode_count * sizeof(uint16_t));
+    if (verifier.depth == NULL || verifier.pending == NULL) {
+        free(verifier.depth);
+        free(verifier.pending);
+        vm_error("Out of memory verifying %s", symbol_to_string(method->name));
+        return false;
+    }
+    for (int pc = 0; pc < method->bytecode_count; pc++) {
+        verifier.depth[pc] = -1;
+    }
+
+    // Every instruction is checked once, at the depth it is first reached
+    // with; the rest of its paths only have to agree on that depth
+    bool valid = verifier_reach(&verifier, 0, 0, 0);
+    while (valid && verifier.pending_count > 0) {
+        valid = verifier_step(&verifier, verifier.pending[--verifier.pending_count]);
+    }
+
+    free(verifier.depth);
+    free(verifier.pending);
+
+    if (valid) {
+        method->max_stack = (uint16_t)verifier.max_depth;
+    }
+    return valid;
+}
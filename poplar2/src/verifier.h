@@ -0,0 +1,29 @@
+// verifier.h - Bytecode verification for Poplar2
+
+#ifndef POPLAR2_VERIFIER_H
+#define POPLAR2_VERIFIER_H
+
+#include "vm.h"
+#include <stdbool.h>
+
+// Methods are verified once, when they are installed in a class, together
+// with the block methods in their literals. Following every path through
+// the bytecode proves that:
+//
+//   - instructions and their operands lie within the bytecode, and no path
+//     runs off its end
+//   - local, argument, field, literal and special value indices are in
+//     range, and globals and blocks index literals of the right kind
+//   - the operand stack never underflows, and has the same depth wherever
+//     paths meet
+//
+// The deepest operand stack becomes the method's max_stack, which its frame
+// is sized for when pushed (vm_push_frame), so the interpreter pushes, pops
+// and indexes without checking. Outer variables are still checked as they
+// are used, since the contexts they live in are only known then.
+
+// Verify a method and its blocks and set their max_stack; answers false,
+// after reporting the first problem found, if the method must not run
+bool verifier_verify(Method* method);
+
+#endif /* POPLAR2_VERIFIER_H */
@@ -5,6 +5,9 @@
 #include "interpreter.h"
 #include "gc.h"
 #include "som_parser.h"
+#include "method_cache.h"
+#include "inline_cache.h"
+#include "context.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
@@ -13,6 +16,20 @@
 // Global VM instance
 VM* vm = NULL;
 
+// Frame stack size in Values, fixed once vm_init has run
+static size_t stack_size = STACK_SIZE;
+
+// Set the frame stack size in Values; answers false, changing nothing, if
+// the stack could not hold a useful number of frames
+bool vm_set_stack_size(size_t size) {
+    if (size < STACK_MIN_SIZE) {
+        return false;
+    }
+
+    stack_size = size;
+    return true;
+}
+
 // Initialize the VM
 void vm_init() {
     // Allocate VM structure
@@ -29,82 +46,101 @@ void vm_init() {
     gc_init();
 
     // Allocate frame stack
-    vm->frames = (Frame*)malloc(sizeof(Frame) * FRAME_STACK_SIZE);
-    if (vm->frames == NULL) {
+    vm->stack_base = (Value*)malloc(sizeof(Value) * stack_size);
+    if (vm->stack_base == NULL) {
         fprintf(stderr, "Failed to allocate frame stack\n");
         exit(1);
     }
+    vm->stack_limit = vm->stack_base + stack_size;
 
-    // Initialize globals and literals to nil
-    for (int i = 0; i < MAX_GLOBALS; i++) {
-        vm->globals[i] = make_special(SPECIAL_NIL);
-    }
-
-    for (int i = 0; i < MAX_LITERALS; i++) {
-        vm->literals[i] = make_special(SPECIAL_NIL);
-    }
+    // The globals table is created by the first global
+    vm->globals = make_special(SPECIAL_NIL);
+    vm->global_count = 0;
 
     // Create special constants
     vm->nil = make_special(SPECIAL_NIL);
     vm->true_obj = make_special(SPECIAL_TRUE);
     vm->false_obj = make_special(SPECIAL_FALSE);
 
-    // Bootstrap core classes
+    // Bootstrap core classes (into old space, where they will end up anyway)
+    gc_disable();
     vm_bootstrap_core_classes();
+    gc_enable();
 }
 
 // Function to add a class to the globals table
 void register_global_class(const char* name, Value class_obj) {
-    // Find the first empty slot in the globals table
-    for (int i = 0; i < MAX_GLOBALS; i++) {
-        if (is_nil(vm->globals[i])) {
-            vm->globals[i] = class_obj;
-            return;
-        }
+    vm_define_global(symbol_for(name), class_obj);
+}
+
+// Install a method on a core class that runs a primitive on its receiver
+// and arguments, as a compiled '<primitive: n>' method does
+static void bootstrap_primitive_method(Value class, const char* selector, uint8_t num_args, uint8_t primitive_id) {
+    uint8_t bytecode[2 * UINT8_MAX + 5];
+    int code_index = 0;
+
+    bytecode[code_index++] = BC_PUSH_THIS;
+    for (int i = 0; i < num_args; i++) {
+        bytecode[code_index++] = BC_PUSH_ARGUMENT;
+        bytecode[code_index++] = (uint8_t)i;
     }
+    bytecode[code_index++] = BC_PRIMITIVE;
+    bytecode[code_index++] = primitive_id;
+    bytecode[code_index++] = (uint8_t)(num_args + 1);
+    bytecode[code_index++] = BC_RETURN_LOCAL;
 
-    vm_error("Globals table is full, cannot register class %s", name);
+    Method* method = method_new(selector, num_args, 0, bytecode, (uint16_t)code_index);
+    class_add_method(class, make_object((Object*)method));
 }
 
 // Create core classes in a mutually recursive way
 void vm_bootstrap_core_classes() {
     // First create Class class
-    Object* class_class_obj = object_new(make_special(SPECIAL_NIL), sizeof(Class) / sizeof(Value));
+    Object* class_class_obj = object_new(make_special(SPECIAL_NIL), CLASS_FIELDS);
     Class* class_class = (Class*)class_class_obj;
-    class_class_obj->flags |= FLAG_CLASS;
     class_class->name = make_special(SPECIAL_NIL); // Will be set later
     class_class->superclass = make_special(SPECIAL_NIL); // Will be set to Object
     class_class->methods = make_special(SPECIAL_NIL); // Will be set later
+    class_class->method_count = make_int(0);
+    class_class->method_dict = make_special(SPECIAL_NIL); // Created on first method
     class_class->instance_size = make_int(sizeof(Object) / sizeof(Value));
 
     // Temporarily store Class in VM
     vm->class_Class = make_object(class_class_obj);
+    class_register(class_class);
 
     // Now create Object class
-    Object* object_class_obj = object_new(vm->class_Class, sizeof(Class) / sizeof(Value));
+    Object* object_class_obj = object_new(vm->class_Class, CLASS_FIELDS);
     Class* object_class = (Class*)object_class_obj;
-    object_class_obj->flags |= FLAG_CLASS;
     object_class->name = make_special(SPECIAL_NIL); // Will be set later
     object_class->superclass = make_special(SPECIAL_NIL); // Object has no superclass
     object_class->methods = make_special(SPECIAL_NIL); // Will be set later
+    object_class->method_count = make_int(0);
+    object_class->method_dict = make_special(SPECIAL_NIL); // Created on first method
     object_class->instance_size = make_int(0); // Default instance size
 
     // Store Object class in VM
     vm->class_Object = make_object(object_class_obj);
+    class_register(object_class);
 
     // Fix Class's superclass to point to Object
     class_class->superclass = vm->class_Object;
 
     // Fix Class's class to point to itself
-    class_class_obj->class = vm->class_Class;
+    class_class_obj->class_index = CLASS_INDEX_CLASS;
 
     // Create other core classes
-    vm->class_Method = make_object(class_new("Method", vm->class_Object, sizeof(Method) / sizeof(Value)));
-    vm->class_Array = make_object(class_new("Array", vm->class_Object, 0));
-    vm->class_String = make_object(class_new("String", vm->class_Object, 0));
-    vm->class_Symbol = make_object(class_new("Symbol", vm->class_String, 0));
-    vm->class_Integer = make_object(class_new("Integer", vm->class_Object, 0));
-    vm->class_Block = make_object(class_new("Block", vm->class_Object, 0));
+    vm->class_Method = make_object((Object*)class_new("Method", vm->class_Object, sizeof(Method) / sizeof(Value)));
+    vm->class_Array = make_object((Object*)class_new("Array", vm->class_Object, 0));
+    vm->class_String = make_object((Object*)class_new("String", vm->class_Object, 0));
+    vm->class_Symbol = make_object((Object*)class_new("Symbol", vm->class_String, 0));
+    symbol_table_adopt_early_symbols(); // Names so far were interned classless
+    vm->class_Integer = make_object((Object*)class_new("Integer", vm->class_Object, 0));
+    vm->class_Block = make_object((Object*)class_new("Block", vm->class_Object, BLOCK_FIELDS));
+    vm->class_StringBuilder = make_object((Object*)class_new("StringBuilder", vm->class_Object, STRING_BUILDER_FIELDS));
+    vm->class_LargeInteger = make_object((Object*)class_new("LargeInteger", vm->class_Integer, 0));
+    vm->class_Context = make_object((Object*)class_new("Context", vm->class_Object, 0));
+    vm->class_Association = make_object((Object*)class_new("Association", vm->class_Object, ASSOCIATION_FIELDS));
 
     // Now set names for Object and Class
     object_class->name = symbol_for("Object");
@@ -123,50 +159,208 @@ void vm_bootstrap_core_classes() {
     register_global_class("Symbol", vm->class_Symbol);
     register_global_class("Integer", vm->class_Integer);
     register_global_class("Block", vm->class_Block);
+    register_global_class("StringBuilder", vm->class_StringBuilder);
+    register_global_class("LargeInteger", vm->class_LargeInteger);
+    register_global_class("Association", vm->class_Association);
 
-    // Create and register singleton instances
-    Object* nil_class_obj = class_new("Nil", vm->class_Object, 0);
-    Object* true_class_obj = class_new("True", vm->class_Object, 0);
-    Object* false_class_obj = class_new("False", vm->class_Object, 0);
+    // Classes of the singleton instances
+    vm->class_Nil = make_object((Object*)class_new("Nil", vm->class_Object, 0));
+    vm->class_True = make_object((Object*)class_new("True", vm->class_Object, 0));
+    vm->class_False = make_object((Object*)class_new("False", vm->class_Object, 0));
 
-    register_global_class("Nil", make_object(nil_class_obj));
-    register_global_class("True", make_object(true_class_obj));
-    register_global_class("False", make_object(false_class_obj));
+    register_global_class("Nil", vm->class_Nil);
+    register_global_class("True", vm->class_True);
+    register_global_class("False", vm->class_False);
 
     // Register singleton instances
     register_global("nil", vm->nil);
     register_global("true", vm->true_obj);
     register_global("false", vm->false_obj);
+
+    // Selectors the special send bytecodes stand for, in bytecode order
+    static const char* const special_selector_names[SPECIAL_SELECTOR_COUNT] = {
+        "+", "-", "*", "/", "\\\\", "<", ">", "<=", ">=", "=", "~="
+    };
+    for (int i = 0; i < SPECIAL_SELECTOR_COUNT; i++) {
+        vm->special_selectors[i] = symbol_for(special_selector_names[i]);
+    }
+
+    // Printing (strings print their characters, anything else its
+    // printed form)
+    bootstrap_primitive_method(vm->class_Object, "print", 0, 15);
+    bootstrap_primitive_method(vm->class_Object, "println", 0, 16);
+
+    // Identity, which = and ~= special sends to other objects fall back on
+    bootstrap_primitive_method(vm->class_Object, "=", 1, 8);
+    bootstrap_primitive_method(vm->class_Object, "~=", 1, 29);
+    bootstrap_primitive_method(vm->class_Object, "isNil", 0, 30);
+    bootstrap_primitive_method(vm->class_Object, "notNil", 0, 31);
+
+    // Booleans, for the conditionals the compiler cannot inline (their
+    // arguments are not literal blocks)
+    static const struct { const char* selector; uint8_t num_args; uint8_t primitive_id; } boolean_primitives[] = {
+        { "ifTrue:", 1, 32 }, { "ifFalse:", 1, 33 }, { "ifTrue:ifFalse:", 2, 34 },
+        { "ifFalse:ifTrue:", 2, 35 }, { "and:", 1, 36 }, { "or:", 1, 37 },
+        { "&", 1, 38 }, { "|", 1, 39 }, { "not", 0, 40 }
+    };
+    for (size_t i = 0; i < sizeof(boolean_primitives) / sizeof(boolean_primitives[0]); i++) {
+        bootstrap_primitive_method(vm->class_True, boolean_primitives[i].selector,
+                                   boolean_primitives[i].num_args, boolean_primitives[i].primitive_id);
+        bootstrap_primitive_method(vm->class_False, boolean_primitives[i].selector,
+                                   boolean_primitives[i].num_args, boolean_primitives[i].primitive_id);
+    }
+
+    // Integer arithmetic and comparison, which the special send bytecodes
+    // fall back on once an operand is not a SmallInteger (or a result
+    // overflows), so LargeInteger gets them too
+    static const struct { const char* selector; uint8_t primitive_id; } integer_primitives[] = {
+        { "+", 1 }, { "-", 2 }, { "*", 3 }, { "/", 4 }, { "\\\\", 5 },
+        { "<", 7 }, { ">", 25 }, { "<=", 26 }, { ">=", 27 }, { "=", 6 }, { "~=", 28 }
+    };
+    for (size_t i = 0; i < sizeof(integer_primitives) / sizeof(integer_primitives[0]); i++) {
+        bootstrap_primitive_method(vm->class_Integer, integer_primitives[i].selector, 1, integer_primitives[i].primitive_id);
+        bootstrap_primitive_method(vm->class_LargeInteger, integer_primitives[i].selector, 1, integer_primitives[i].primitive_id);
+    }
+
+    // Strings
+    bootstrap_primitive_method(vm->class_String, ",", 1, 10);
+    bootstrap_primitive_method(vm->class_String, "size", 0, 14);
+
+    // String building (classes are instances of Class, so that is where
+    // StringBuilder's new has to go; it fails for other classes)
+    bootstrap_primitive_method(vm->class_Class, "new", 0, 17);
+    bootstrap_primitive_method(vm->class_StringBuilder, "append:", 1, 18);
+    bootstrap_primitive_method(vm->class_StringBuilder, "asString", 0, 19);
+    bootstrap_primitive_method(vm->class_StringBuilder, "size", 0, 20);
+
+    // Block evaluation
+    bootstrap_primitive_method(vm->class_Block, "value", 0, 21);
+    bootstrap_primitive_method(vm->class_Block, "value:", 1, 21);
+    bootstrap_primitive_method(vm->class_Block, "value:with:", 2, 21);
+    bootstrap_primitive_method(vm->class_Block, "value:with:with:", 3, 21);
+
+    // Context reflection (frames are reified as they are asked for)
+    bootstrap_primitive_method(vm->class_Context, "sender", 0, 22);
+    bootstrap_primitive_method(vm->class_Context, "method", 0, 23);
+    bootstrap_primitive_method(vm->class_Context, "receiver", 0, 24);
 }
 
 // Helper to register any global (not just classes)
 void register_global(const char* name, Value value) {
-    // Find the first empty slot in the globals table
-    for (int i = 0; i < MAX_GLOBALS; i++) {
-        if (is_nil(vm->globals[i])) {
-            vm->globals[i] = value;
+    vm_define_global(symbol_for(name), value);
+}
+
+// Globals
+//
+// vm->globals is an open-addressed hash table from name to Association: an
+// Array of a power-of-two number of slots, with nil marking empty ones.
+// Compiled code holds the Associations themselves in its literal frame, so
+// reading or writing a global is one indirection and the table is only
+// probed when compiling and from C. Names are interned symbols, so probing
+// compares Value bits; it starts at the symbol's string hash, which depends
+// only on its characters and so survives the symbol moving.
+#define GLOBALS_MIN_CAPACITY 32
+#define GLOBALS_MAX_CAPACITY 8192  // Largest power of two an object's size field holds
+
+// The Association of global 'name', or nil if there is none
+static Value globals_at(Value name) {
+    if (!is_object(vm->globals)) {
+        return vm->nil;
+    }
+
+    Object* table = as_object(vm->globals);
+    uint16_t mask = table->size - 1;
+
+    for (uint16_t i = string_value_hash(name) & mask;; i = (i + 1) & mask) {
+        Value association = table->fields[i];
+        if (is_nil(association) || ((Association*)as_object(association))->key.bits == name.bits) {
+            return association;
+        }
+    }
+}
+
+// Store into a table known to have a free slot
+static void globals_put(Object* table, Value association) {
+    uint16_t mask = table->size - 1;
+    Value name = ((Association*)as_object(association))->key;
+
+    for (uint16_t i = string_value_hash(name) & mask;; i = (i + 1) & mask) {
+        if (is_nil(table->fields[i])) {
+            object_set_field(table, i, association);
             return;
         }
     }
+}
+
+// The Association of global 'name', created holding nil if there is none
+// yet (may collect garbage)
+Value vm_global_association(Value name) {
+    Value association = globals_at(name);
+    if (!is_nil(association)) {
+        return association;
+    }
+
+    gc_push_root(&name);
+
+    // Grow the table when it would become more than 3/4 full
+    uint16_t capacity = is_object(vm->globals) ? as_object(vm->globals)->size : 0;
+    if ((vm->global_count + 1) * 4 > capacity * 3) {
+        if (capacity == GLOBALS_MAX_CAPACITY) {
+            gc_pop_roots(1);
+            vm_error("Globals table is full, cannot register global %s", symbol_to_string(name));
+            return vm->nil;
+        }
+
+        Value new_globals = array_new(capacity ? capacity * 2 : GLOBALS_MIN_CAPACITY);
+        for (uint16_t i = 0; i < capacity; i++) {
+            Value old = as_object(vm->globals)->fields[i];
+            if (!is_nil(old)) {
+                globals_put(as_object(new_globals), old);
+            }
+        }
+        vm->globals = new_globals;
+    }
+
+    Association* cell = (Association*)object_new(vm->class_Association, ASSOCIATION_FIELDS);
+    cell->key = name;
+    cell->value = vm->nil;
+    gc_pop_roots(1);
 
-    vm_error("Globals table is full, cannot register global %s", name);
+    association = make_object(&cell->object);
+    globals_put(as_object(vm->globals), association);
+    vm->global_count++;
+
+    return association;
+}
+
+// Set global 'name', creating it if need be
+void vm_define_global(Value name, Value value) {
+    gc_push_root(&value);
+    Value association = vm_global_association(name);
+    gc_pop_roots(1);
+
+    if (is_nil(association)) {
+        return;
+    }
+
+    gc_write_barrier(as_object(association), value);
+    ((Association*)as_object(association))->value = value;
 }
 
 // Clean up VM resources
 void vm_cleanup() {
     if (vm != NULL) {
         // Free the heap
-        if (vm->heap_start != NULL) {
-            free(vm->heap_start);
-            vm->heap_start = NULL;
-        }
+        gc_cleanup();
 
         // Free the frame stack
-        if (vm->frames != NULL) {
-            free(vm->frames);
-            vm->frames = NULL;
+        if (vm->stack_base != NULL) {
+            free(vm->stack_base);
+            vm->stack_base = NULL;
         }
 
+        symbol_table_cleanup();
+
         // Free VM structure
         free(vm);
         vm = NULL;
@@ -179,40 +373,32 @@ Value vm_execute_method(Method* method, Value receiver, Value* arguments, int ar
 }
 
 // Push a new frame onto the call stack
-Frame* vm_push_frame(Method* method, Value receiver) {
-    // Check if we've reached the maximum call depth
-    if (vm->current_frame != NULL) {
-        int depth = 0;
-        Frame* frame = vm->current_frame;
-
-        while (frame != NULL) {
-            depth++;
-            frame = frame->sender;
-        }
-
-        if (depth >= FRAME_STACK_SIZE) {
-            vm_error("Stack overflow: maximum call depth exceeded");
-            return NULL;
-        }
-    }
-
-    // Get next frame from frame pool
-    Frame* frame = &vm->frames[0]; // For simplicity, always use first frame
-
-    if (vm->current_frame != NULL) {
-        // Set sender
-        frame->sender = vm->current_frame;
-    } else {
-        frame->sender = NULL;
+//
+// The receiver and arguments must already be on the frame stack, with the
+// arguments starting at 'arguments'. The frame is placed right after them.
+Frame* vm_push_frame(Method* method, Value receiver, Value* arguments) {
+    // Frames hold pointers, so keep them pointer aligned
+    uintptr_t address = (uintptr_t)(arguments + method->num_args);
+    address = (address + sizeof(void*) - 1) & ~(uintptr_t)(sizeof(void*) - 1);
+    Frame* frame = (Frame*)address;
+
+    // One pointer compare covers locals and the deepest operand stack
+    Value* limit = &frame->stack[method->num_locals + method->max_stack];
+    if (limit > vm->stack_limit) {
+        vm_error("Stack overflow: maximum call depth exceeded");
+        return NULL;
     }
 
     // Initialize frame
     frame->method = method;
     frame->bytecode_index = 0;
+    frame->stack_pointer = frame->stack;
+    frame->stack_limit = limit;
+    frame->arguments = arguments;
     frame->receiver = receiver;
+    frame->sender = vm->current_frame;
     frame->is_block_invocation = false;
     frame->context = make_special(SPECIAL_NIL);
-    frame->stack_pointer = frame->stack;
 
     // Set as current frame
     vm->current_frame = frame;
@@ -227,24 +413,14 @@ void vm_pop_frame() {
         return;
     }
 
-    // Get sender
-    Frame* sender = vm->current_frame->sender;
-
-    // Reset current frame
-    vm->current_frame->method = NULL;
-    vm->current_frame->bytecode_index = 0;
-    vm->current_frame->receiver = make_special(SPECIAL_NIL);
-    vm->current_frame->sender = NULL;
-    vm->current_frame->is_block_invocation = false;
-    vm->current_frame->context = make_special(SPECIAL_NIL);
-    vm->current_frame->stack_pointer = vm->current_frame->stack;
-
-    // Set sender as current frame
-    vm->current_frame = sender;
+    // The frame's memory is reused by the sender's next send, so blocks
+    // still referring to it must find its variables in its context
+    context_detach(vm->current_frame);
+    vm->current_frame = vm->current_frame->sender;
 }
 
 // Allocate a new object
-Object* vm_allocate_object(Value class, uint16_t size) {
+Object* vm_allocate_object(Value class, uint32_t size) {
     return object_new(class, size);
 }
 
@@ -255,30 +431,8 @@ void vm_collect_garbage() {
 
 // Find a global variable by name
 Value vm_find_global(const char* name) {
-    Value symbol = symbol_for(name);
-    if (DBUG) {
-        printf("vm_find_global for %s\n", name);
-    }
-
-    // Search in globals table (linear search for simplicity)
-    for (int i = 0; i < MAX_GLOBALS; i++) {
-        // if (DBUG) {
-        //     printf("global[%d]: %d\n", i, vm->globals[i].value);
-        // }
-
-        if (vm->globals[i].tag != TAG_SPECIAL || vm->globals[i].value != SPECIAL_NIL) {
-            // Check if this is a class
-            if (is_object(vm->globals[i]) && (as_object(vm->globals[i])->flags & FLAG_CLASS)) {
-                Class* class = (Class*)as_object(vm->globals[i]);
-
-                if (value_equals(class->name, symbol)) {
-                    return vm->globals[i];
-                }
-            }
-        }
-    }
-
-    return vm->nil;
+    Value association = globals_at(symbol_for(name));
+    return is_nil(association) ? vm->nil : ((Association*)as_object(association))->value;
 }
 
 // Find a class by name
@@ -288,7 +442,10 @@ Value vm_find_class(const char* name) {
 
 // Find a method in a class
 Method* vm_find_method(Value class, const char* name) {
+    gc_push_root(&class);
     Value selector = symbol_for(name);
+    gc_pop_roots(1);
+
     return class_lookup_method(class, selector);
 }
 
@@ -296,6 +453,14 @@ Method* vm_find_method(Value class, const char* name) {
 Value vm_invoke_method(Value receiver, const char* name, Value* arguments, int arg_count) {
     Value class;
 
+    // Interning the selector may collect garbage
+    gc_push_root(&receiver);
+    for (int i = 0; i < arg_count; i++) {
+        gc_push_root(&arguments[i]);
+    }
+    Value selector = symbol_for(name);
+    gc_pop_roots(arg_count + 1);
+
     // Get receiver's class
     if (is_int(receiver)) {
         class = vm->class_Integer;
@@ -311,12 +476,11 @@ Value vm_invoke_method(Value receiver, const char* name, Value* arguments, int a
             return vm->nil;
         }
     } else {
-        class = as_object(receiver)->class;
+        class = object_class(as_object(receiver));
     }
 
     // Find method
-    Value selector = symbol_for(name);
-    Method* method = class_lookup_method(class, selector);
+    Method* method = method_cache_lookup(class, selector);
 
     if (method == NULL) {
         vm_error("Method not found: %s", name);
@@ -327,6 +491,81 @@ Value vm_invoke_method(Value receiver, const char* name, Value* arguments, int a
     return vm_execute_method(method, receiver, arguments, arg_count);
 }
 
+// Print VM statistics
+void vm_print_stats() {
+    uint32_t lookups = vm->method_cache_hits + vm->method_cache_misses;
+
+    printf("GC runs: %u full, %u minor, allocated: %u bytes\n", vm->gc_count, vm->gc_minor_count, vm->allocated);
+
+    uint32_t mark_us = vm->gc_mark_time_us;
+    printf("GC marking: %u objects, %u bytes in %u us, %u rescans (%u objects/ms, %u bytes/ms)\n",
+           vm->gc_marked_objects,
+           vm->gc_marked_bytes,
+           mark_us,
+           vm->gc_mark_overflows,
+           mark_us ? (unsigned)((uint64_t)vm->gc_marked_objects * 1000 / mark_us) : 0,
+           mark_us ? (unsigned)((uint64_t)vm->gc_marked_bytes * 1000 / mark_us) : 0);
+    printf("Heap: %u bytes old space, %u in use, grown %u times\n",
+           (unsigned)((char*)vm->heap_end - (char*)vm->heap_start),
+           (unsigned)((char*)vm->heap_next - (char*)vm->heap_start),
+           vm->gc_heap_grows);
+
+    uint32_t pauses = 0;
+    for (int i = 0; i < GC_PAUSE_BUCKETS; i++) {
+        pauses += vm->gc_pauses[i];
+    }
+    printf("GC pauses: %u, longest %u us\n", pauses, vm->gc_pause_max_us);
+    for (int i = 0; i < GC_PAUSE_BUCKETS; i++) {
+        if (vm->gc_pauses[i] == 0) {
+            continue;
+        }
+        if (i < GC_PAUSE_BUCKETS - 1) {
+            printf("  < %u us: %u\n", 1u << i, vm->gc_pauses[i]);
+        } else {
+            printf("  >= %u us: %u\n", 1u << (i - 1), vm->gc_pauses[i]);
+        }
+    }
+    printf("Method cache: %u hits, %u misses (%u%% hit rate)\n",
+           vm->method_cache_hits,
+           vm->method_cache_misses,
+           lookups ? (unsigned)((uint64_t)vm->method_cache_hits * 100 / lookups) : 0);
+
+    uint32_t sends = vm->inline_cache_hits + vm->inline_cache_misses;
+    printf("Inline caches: %u hits, %u misses (%u%% hit rate)\n",
+           vm->inline_cache_hits,
+           vm->inline_cache_misses,
+           sends ? (unsigned)((uint64_t)vm->inline_cache_hits * 100 / sends) : 0);
+
+#ifdef POPLAR2_PROFILE_PAIRS
+    interpreter_print_pair_profile();
+#endif
+}
+
+// Print the inline cache state of every method of every global class
+void vm_dump_inline_caches() {
+    uint16_t capacity = is_object(vm->globals) ? as_object(vm->globals)->size : 0;
+    for (uint16_t i = 0; i < capacity; i++) {
+        Value association = as_object(vm->globals)->fields[i];
+        if (is_nil(association)) {
+            continue;
+        }
+
+        Value global = ((Association*)as_object(association))->value;
+        if (!is_object(global) || as_object(global)->class_index != CLASS_INDEX_CLASS) {
+            continue;
+        }
+
+        Value methods = ((Class*)as_object(global))->methods;
+        if (!is_object(methods)) {
+            continue;
+        }
+
+        for (uint16_t j = 0; j < as_int(((Class*)as_object(global))->method_count); j++) {
+            inline_cache_dump((Method*)as_object(as_object(methods)->fields[j]));
+        }
+    }
+}
+
 // Error handling
 void vm_error(const char* format, ...) {
     va_list args;
@@ -369,7 +608,9 @@ void vm_error(const char* format, ...) {
 
 // Load a SOM file and execute the 'run' method
 Value vm_load_and_run(const char* filename) {
-    printf("Loading %s...\n", filename);
+    if (DBUG) {
+        printf("Loading %s...\n", filename);
+    }
 
     // Parse the SOM file
     if (!parse_file(filename)) {
@@ -387,8 +628,12 @@ Value vm_load_and_run(const char* filename) {
     // Create main instance
     Value main_instance = make_object(object_new(main_class, 0));
 
-    // Look for run method
-    Method* run_method = vm_find_method(main_class, "run");
+    // Look for run method (the instance may move while the selector is
+    // interned)
+    gc_push_root(&main_instance);
+    Method* run_method = vm_find_method(object_class(as_object(main_instance)), "run");
+    gc_pop_roots(1);
+
     if (run_method == NULL) {
         fprintf(stderr, "run method not found in Main class\n");
         return vm->nil;
@@ -398,30 +643,132 @@ Value vm_load_and_run(const char* filename) {
     return vm_execute_method(run_method, main_instance, NULL, 0);
 }
 
+// Parse a byte count with an optional K or M suffix
+static bool parse_size(const char* text, size_t* size) {
+    char* end;
+    unsigned long value = strtoul(text, &end, 10);
+
+    if (end == text) {
+        return false;
+    }
+    if (*end == 'K' || *end == 'k') {
+        value *= 1024;
+        end++;
+    } else if (*end == 'M' || *end == 'm') {
+        value *= 1024 * 1024;
+        end++;
+    }
+
+    *size = value;
+    return *end == '\0';
+}
+
+// Parse a positive decimal number as a percentage (e.g. "1.5" is 150)
+static bool parse_percent(const char* text, unsigned* percent) {
+    char* end;
+    double value = strtod(text, &end);
+
+    if (end == text || *end != '\0' || value <= 0 || value > 100) {
+        return false;
+    }
+
+    *percent = (unsigned)(value * 100 + 0.5);
+    return true;
+}
+
+// Apply a --heap-... or --gc-... command line option to a heap configuration
+static bool parse_gc_option(const char* option, GcConfig* config) {
+    const char* value = strchr(option, '=');
+    unsigned percent;
+
+    if (value == NULL) {
+        return false;
+    }
+    value++;
+
+    if (strncmp(option, "--heap-size=", 12) == 0) {
+        return parse_size(value, &config->initial_size);
+    }
+    if (strncmp(option, "--heap-max=", 11) == 0) {
+        return parse_size(value, &config->max_size);
+    }
+    if (strncmp(option, "--heap-growth=", 14) == 0 && parse_percent(value, &percent)) {
+        config->growth_percent = (uint16_t)percent;
+        return true;
+    }
+    if (strncmp(option, "--gc-pause=", 11) == 0) {
+        char* end;
+        config->pause_budget_us = (uint32_t)strtoul(value, &end, 10);
+        return end != value && *end == '\0';
+    }
+    if (strncmp(option, "--heap-live=", 12) == 0 && parse_percent(value, &percent) && percent < 100) {
+        config->target_live_percent = (uint8_t)percent;
+        return true;
+    }
+
+    return false;
+}
+
+static void print_usage(const char* program) {
+    printf("Usage: %s [options] <somfile>\n", program);
+    printf("  --heap-size=BYTES   initial heap size (K and M suffixes allowed)\n");
+    printf("  --heap-max=BYTES    largest size the heap may grow to\n");
+    printf("  --heap-growth=F     factor to grow the heap by, e.g. 2\n");
+    printf("  --heap-live=R       live fraction of old space to aim for, e.g. 0.5\n");
+    printf("  --gc-pause=US       longest incremental marking step, 0 for none\n");
+    printf("  --stack-size=BYTES  frame stack size, which limits call depth\n");
+}
+
 // Main entry point for the VM
 int main(int argc, char** argv) {
-    // Initialize VM
-    vm_init();
+    GcConfig config;
+    const char* filename = NULL;
 
     // Check arguments
-    if (argc < 2) {
-        printf("Usage: %s <somfile>\n", argv[0]);
-        vm_cleanup();
+    gc_get_config(&config);
+
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--heap-", 7) == 0 || strncmp(argv[i], "--gc-", 5) == 0) {
+            if (!parse_gc_option(argv[i], &config)) {
+                fprintf(stderr, "Invalid option: %s\n", argv[i]);
+                print_usage(argv[0]);
+                return 1;
+            }
+        } else if (strncmp(argv[i], "--stack-size=", 13) == 0) {
+            size_t bytes;
+            if (!parse_size(argv[i] + 13, &bytes) || !vm_set_stack_size(bytes / sizeof(Value))) {
+                fprintf(stderr, "Invalid option: %s\n", argv[i]);
+                print_usage(argv[0]);
+                return 1;
+            }
+        } else if (filename == NULL) {
+            filename = argv[i];
+        }
+    }
+
+    if (filename == NULL) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    if (!gc_configure(&config)) {
+        fprintf(stderr, "Invalid heap configuration\n");
         return 1;
     }
 
+    // Initialize VM
+    vm_init();
+
     // Load SOM file and run
-    const char* filename = argv[1];
 
     // If no SOM parser is available or for testing, use this fallback
     if (strstr(filename, "--test-hello") != NULL) {
-        // Create test main class
-        Value main_class = make_object(class_new("Main", vm->class_Object, 0));
-        vm->globals[0] = main_class;
+        // Build the test class like the compiler would, with the GC held off
+        gc_disable();
 
-        // Create "run" method
-        Method* run_method = method_new("run", 0, 0);
-        run_method->holder = main_class;
+        // Create test main class
+        Value main_class = make_object((Object*)class_new("Main", vm->class_Object, 0));
+        vm_define_global(symbol_for("Main"), main_class);
 
         // Add simple bytecode to print "Hello, World!"
         uint8_t bytecodes[] = {
@@ -431,24 +778,21 @@ int main(int argc, char** argv) {
             BC_RETURN_LOCAL        // Return nil
         };
 
-        // Copy bytecodes to method
-        memcpy(run_method->bytecode, bytecodes, sizeof(bytecodes));
-        run_method->bytecode_count = sizeof(bytecodes);
+        // Create "run" method
+        Method* run_method = method_new("run", 0, 0, bytecodes, sizeof(bytecodes));
+        run_method->holder = main_class;
 
         // Set up literals
-        vm->literals[0] = string_new("Hello, Kristofer From POPLAR2!");
+        Value literals = array_new(1);
+        array_at_put(literals, 0, string_new("Hello, Kristofer From POPLAR2!"));
+        run_method->literals = literals;
 
         // Add method to class
-        Class* class_obj = (Class*)as_object(main_class);
-        Value methods = class_obj->methods;
-
-        // Convert methods to an array with the run method
-        Value new_methods = array_new(1);
-        array_at_put(new_methods, 0, make_object((Object*)run_method));
-        class_obj->methods = new_methods;
+        class_add_method(main_class, make_object((Object*)run_method));
 
         // Create main instance
         Value main_instance = make_object(object_new(main_class, 0));
+        gc_enable();
 
         // Invoke "run" method
         vm_invoke_method(main_instance, "run", NULL, 0);
@@ -457,6 +801,11 @@ int main(int argc, char** argv) {
         vm_load_and_run(filename);
     }
 
+    if (DBUG) {
+        vm_print_stats();
+        vm_dump_inline_caches();
+    }
+
     // Clean up
     vm_cleanup();
 
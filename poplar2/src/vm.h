@@ -5,62 +5,221 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include "value.h"
 
+// Debug output (parser traces, statistics at exit); the regression tests
+// compare program output, so they build with POPLAR2_NO_DEBUG
+#ifdef POPLAR2_NO_DEBUG
+#define DBUG 0
+#else
 #define DBUG 1
+#endif
 
 // Memory limits and configuration for Agon Light 2
 #define HEAP_START          0x020000
-#define HEAP_SIZE           0x060000  // 384KB heap
-#define STACK_SIZE          256       // VM execution stack size
-#define FRAME_STACK_SIZE    64        // Max number of frames
-#define MAX_LITERALS        32 //1024      // Global literals table size
-#define MAX_GLOBALS         16 //1024      // Global variables table size
-// Define a maximum bytecode size (add this to vm.h)
-#define MAX_BYTECODE_SIZE 256  // Or whatever size is appropriate for your VM
-
-// Object flags
+#define HEAP_SIZE           0x060000  // 384KB heap (initial size, see GcConfig)
+#define HEAP_MAX_SIZE       0x1000000 // 16MB: the heap grows while malloc allows
+#define HEAP_GROWTH_PERCENT 200       // Grow the heap 2x at a time
+#define HEAP_TARGET_LIVE    50        // Percent of old space live after a full GC
+#define GC_PAUSE_BUDGET_US  1000      // Longest incremental marking step
+#define GC_PAUSE_BUCKETS    16        // GC pause histogram buckets (powers of two)
+#define NURSERY_SIZE        0x010000  // 64KB of the heap for new objects
+#define STACK_SIZE          16384     // Default frame stack size in Values (frames + locals + operands)
+#define STACK_MIN_SIZE      256       // Smallest frame stack vm_set_stack_size accepts
+#define DEFAULT_MAX_STACK   16        // Operand stack depth reserved per method by default
+#define METHOD_CACHE_SETS   128       // Global method cache sets (2 ways each, power of two)
+#define IC_PIC_SIZE         4         // Entries in a polymorphic inline cache
+
+// Interpreter dispatch: direct-threaded (labels-as-values) where the compiler
+// supports it, plain switch loop otherwise. Build with
+// -DPOPLAR2_SWITCH_DISPATCH to force the switch loop.
+#if defined(__GNUC__) && !defined(POPLAR2_SWITCH_DISPATCH)
+#define USE_THREADED_DISPATCH 1
+#else
+#define USE_THREADED_DISPATCH 0
+#endif
+
+// Full collections compact the heap in place; build with
+// -DPOPLAR2_GC_EVACUATE to copy into a second old space instead, or with
+// -DPOPLAR2_GC_MARK_SWEEP for a non-moving heap of segregated free lists
+// with no nursery.
+#if defined(POPLAR2_GC_MARK_SWEEP)
+#define USE_FREE_LISTS 1
+#define USE_MARK_COMPACT 0
+#elif defined(POPLAR2_GC_EVACUATE)
+#define USE_FREE_LISTS 0
+#define USE_MARK_COMPACT 0
+#else
+#define USE_FREE_LISTS 0
+#define USE_MARK_COMPACT 1
+#endif
+
+// Object formats: which fields hold Values
+#define FORMAT_NONE         0         // Not an object: the header holds an address (GC only)
+#define FORMAT_POINTERS     1         // Every field is a Value
+#define FORMAT_BYTES        2         // Raw data, no Values (String, Symbol, LargeInteger)
+#define FORMAT_METHOD       3         // Method's Value fields, then raw counts and bytecode
+
+// Object flags (GC bits)
 #define FLAG_GC_MARK        0x01
-#define FLAG_ARRAY          0x02
-#define FLAG_CLASS          0x04
-#define FLAG_METHOD         0x08
-#define FLAG_SYMBOL         0x10
-#define FLAG_CONTEXT        0x20
-#define FLAG_PRIMITIVE      0x40
+#define FLAG_REMEMBERED     0x02      // Old object in the GC's remembered set
+
+// Class table indices of the core classes, registered in this order by
+// vm_bootstrap_core_classes
+enum {
+    CLASS_INDEX_NONE = 0,    // No class yet (Class itself, during bootstrap)
+    CLASS_INDEX_CLASS,
+    CLASS_INDEX_OBJECT,
+    CLASS_INDEX_METHOD,
+    CLASS_INDEX_ARRAY,
+    CLASS_INDEX_STRING,
+    CLASS_INDEX_SYMBOL,
+    CLASS_INDEX_INTEGER,
+    CLASS_INDEX_BLOCK,
+    CLASS_INDEX_STRING_BUILDER,
+    CLASS_INDEX_LARGE_INTEGER,
+    CLASS_INDEX_CONTEXT,
+    CLASS_INDEX_ASSOCIATION
+};
 
 // Forward declarations
 typedef struct Method Method;
 typedef struct Frame Frame;
 
 // Basic object header
+//
+// Where pointers are 32 bits or narrower (the Agon's are 24), the header is
+// packed into one word. That limits objects to 16383 fields and the class
+// table to 256 classes, which is plenty for 512KB of memory. 64-bit hosts
+// give the size a word of its own, and the class index the bits it frees.
+#if UINTPTR_MAX > 0xFFFFFFFFu
+#define OBJECT_WIDE_HEADER  1
+#else
+#define OBJECT_WIDE_HEADER  0
+#endif
+
 struct Object {
-    Value class;       // Pointer to class
-    uint8_t hash;      // Object hash
-    uint8_t flags;     // Object flags
-    uint16_t size;     // Number of fields
+    union {
+        uint32_t header;                // First word (an address while the GC moves the object)
+        struct {
+            uint32_t format : 2;        // Which fields are Values (FORMAT_*)
+            uint32_t flags : 2;         // GC bits (FLAG_*)
+#if OBJECT_WIDE_HEADER
+            uint32_t class_index : 12;  // Class, as an index into vm->class_table
+            uint32_t hash : 6;          // Object hash (0 until computed)
+#else
+            uint32_t class_index : 8;   // Class, as an index into vm->class_table
+            uint32_t hash : 6;          // Object hash (0 until computed)
+            uint32_t size : 14;         // Number of fields
+#endif
+        };
+    };
+#if OBJECT_WIDE_HEADER
+    uint32_t size;                      // Number of fields
+#endif
     Value fields[];    // Variable-sized array of fields
 };
 
+// Most fields an object may have (the GC counts them in 16 bits), and the
+// class table size the header's class index allows
+#if OBJECT_WIDE_HEADER
+#define MAX_OBJECT_FIELDS   0xFFFF
+#define MAX_CLASSES         4096
+#else
+#define MAX_OBJECT_FIELDS   0x3FFF
+#define MAX_CLASSES         256
+#endif
+
+// Most fields a string or symbol may have. The GC never counts the fields
+// of byte objects, so a wide header only has to keep their sizes
+// SmallIntegers.
+#if OBJECT_WIDE_HEADER
+#define MAX_BYTE_OBJECT_FIELDS (SMALL_INT_MAX / sizeof(Value))
+#else
+#define MAX_BYTE_OBJECT_FIELDS MAX_OBJECT_FIELDS
+#endif
+
 // Class object
 typedef struct Class {
     Object object;         // Base object header
     Value name;           // Symbol object with class name
     Value superclass;     // Pointer to superclass
-    Value methods;        // Array of methods
+    Value methods;        // Array of methods, nil past method_count
+    Value method_count;   // Methods in use in 'methods' (integer)
     Value instance_size;  // Size of instances (excluding header)
+    Value method_dict;    // Selector -> method hash table (see class_add_method)
+    Value index;          // Position in vm->class_table (integer)
 } Class;
 
+// Fields of a class object
+#define CLASS_FIELDS ((sizeof(Class) - sizeof(Object)) / sizeof(Value))
+
+// String object (Symbols share the layout)
+//
+// Strings are byte-indexed: 'length' counts the bytes in 'chars', which may
+// include NULs. A NUL always follows the last byte, for C callers only.
+typedef struct String {
+    Object object;         // Base object header
+    uint32_t length;      // Number of bytes
+    uint32_t hash;        // string_hash of the bytes (0 until computed)
+    char chars[];         // Variable-sized array of bytes
+} String;
+
+// Fields of a string of 'length' bytes, and the longest string there may be
+// (about 64KB with a packed header; with a wide one, the heap is the limit)
+#define STRING_FIELDS(length) \
+    ((offsetof(String, chars) - sizeof(Object) + (length) + sizeof(Value)) / sizeof(Value))
+#define STRING_MAX_LENGTH   (MAX_BYTE_OBJECT_FIELDS * sizeof(Value) - (offsetof(String, chars) - sizeof(Object)) - 1)
+
+// String builder object
+//
+// Appends copy into 'buffer', a String holding the bytes appended so far
+// with spare room after them (up to what its size allows), replacing it with
+// one twice as big when full; asString copies out the used bytes.
+typedef struct StringBuilder {
+    Object object;         // Base object header
+    Value buffer;         // String of the bytes appended so far, or nil
+} StringBuilder;
+
+#define STRING_BUILDER_FIELDS ((sizeof(StringBuilder) - sizeof(Object)) / sizeof(Value))
+#define STRING_BUILDER_MIN_CAPACITY 32
+
+// Integer too big for a SmallInteger (see integer.h)
+typedef struct LargeInteger {
+    Object object;         // Base object header
+    uint16_t negative;    // Nonzero if the value is below zero
+    uint16_t count;       // Number of digits (the most significant is nonzero)
+    uint16_t digits[];    // Magnitude in base 65536, least significant first
+} LargeInteger;
+
 // Method object
 typedef struct Method {
     Object object;         // Base object header
     Value name;           // Symbol object with method name
     Value holder;         // Class that holds this method
+    Value send_caches;    // Inline caches, two slots per send site (see inline_cache.h)
+    Value literals;       // Array of the constants, selectors, global names and blocks the bytecode indexes, or nil
     uint8_t num_args;     // Number of arguments
-    uint8_t num_locals;   // Number of local variables
+    uint16_t num_locals;  // Number of local variables
     uint16_t bytecode_count; // Number of bytecodes
+    uint16_t max_stack;   // Maximum operand stack depth
+    uint32_t cache_epoch; // VM cache epoch the inline caches were filled in
     uint8_t bytecode[];   // Variable-sized array of bytecodes
 } Method;
 
+// Fields of a method with 'count' bytes of bytecode, and the most bytecode
+// a method may have: what the header's size field can describe, but no
+// more than bytecode_count and jump offsets can address
+#define METHOD_FIELDS(count) \
+    ((offsetof(Method, bytecode) - sizeof(Object) + (count) + sizeof(Value) - 1) / sizeof(Value))
+#define METHOD_MAX_OBJECT_BYTECODE (MAX_OBJECT_FIELDS * sizeof(Value) - (offsetof(Method, bytecode) - sizeof(Object)))
+#define METHOD_MAX_BYTECODE (METHOD_MAX_OBJECT_BYTECODE < UINT16_MAX ? METHOD_MAX_OBJECT_BYTECODE : UINT16_MAX)
+
+// Most locals a method may have, so that a Context can hold its arguments
+// and locals
+#define MAX_LOCALS          (MAX_OBJECT_FIELDS - CONTEXT_FIELDS(UINT8_MAX))
+
 // Bytecodes
 enum {
     // Stack operations
@@ -71,6 +230,8 @@ enum {
     BC_PUSH_CONSTANT,        // Push constant
     BC_PUSH_GLOBAL,          // Push global
     BC_PUSH_SPECIAL,         // Push special value (nil, true, false)
+    BC_PUSH_OUTER,           // Push variable of an enclosing frame (level, slot)
+    BC_PUSH_CONTEXT,         // Push the current frame's Context (thisContext)
 
     // Stack manipulation
     BC_POP = 0x10,           // Pop and discard top of stack
@@ -82,12 +243,13 @@ enum {
     BC_STORE_ARGUMENT,       // Store into argument
     BC_STORE_FIELD,          // Store into field
     BC_STORE_GLOBAL,         // Store into global
+    BC_STORE_OUTER,          // Store into variable of an enclosing frame (level, slot)
 
     // Send operations
-    BC_SEND = 0x30,          // Send message
-    BC_SUPER_SEND,           // Send message to super
+    BC_SEND = 0x30,          // Send message (selector, argument count, cache site)
+    BC_SUPER_SEND,           // Send message to super (same operands)
     BC_RETURN_LOCAL,         // Return from method with value
-    BC_RETURN_NON_LOCAL,     // Return from block
+    BC_RETURN_NON_LOCAL,     // Return from a block's home method
 
     // Control operations
     BC_JUMP = 0x40,          // Jump
@@ -95,33 +257,114 @@ enum {
     BC_JUMP_IF_FALSE,        // Jump if false
 
     // Primitive operations
-    BC_PRIMITIVE = 0x50     // Call primitive
+    BC_PRIMITIVE = 0x50,     // Call primitive
+
+    // Prefix: the next instruction's variable, literal and send site
+    // operands are two bytes (big-endian) instead of one
+    BC_EXTEND = 0x58,
+
+    // Special sends: the binary selector vm->special_selectors[op - BC_ADD]
+    // sent to the top two stack values, done inline for SmallIntegers
+    BC_ADD = 0x60,           // +
+    BC_SUB,                  // -
+    BC_MUL,                  // *
+    BC_DIV,                  // /
+    BC_MOD,                  // \\ (remainder)
+    BC_LT,                   // <
+    BC_GT,                   // >
+    BC_LE,                   // <=
+    BC_GE,                   // >=
+    BC_EQ,                   // =
+    BC_NE,                   // ~=
+
+    // Superinstructions: frequent pairs fused by the compiler's peephole
+    // pass, never with wide operands
+    BC_STORE_LOCAL_POP = 0x70, // STORE_LOCAL, POP
+    BC_RETURN_SELF,          // PUSH_THIS, RETURN_LOCAL
+    BC_PUSH_FIELD_RETURN,    // PUSH_FIELD, RETURN_LOCAL
+    BC_PUSH_LOCAL_SEND       // PUSH_LOCAL, SEND (local, selector, argument count, site)
 };
 
+#define SPECIAL_SELECTOR_COUNT (BC_NE - BC_ADD + 1)
+
+// Block closure (see context.h)
+typedef struct Block {
+    Object object;         // Base object header
+    Value method;         // Method compiled from the block's body
+    Value receiver;       // self of the method the block was created in
+    Value outer;          // Context of the frame the block was created in, or nil
+} Block;
+
+#define BLOCK_FIELDS ((sizeof(Block) - sizeof(Object)) / sizeof(Value))
+
+// Context of a frame whose variables blocks refer to (see context.h)
+//
+// While the frame runs the context only points at it, and the variables
+// stay in the frame; when the frame returns they are copied into 'slots'.
+typedef struct Context {
+    Object object;         // Base object header
+    Value frame;          // Frame's offset in the frame stack (integer), nil once it returned
+    Value outer;          // Context of the frame's block's creator, nil for a method frame
+    Value slots[];        // Arguments, then locals (filled in when the frame returns)
+} Context;
+
+#define CONTEXT_FIELDS(slot_count) ((sizeof(Context) - sizeof(Object)) / sizeof(Value) + (slot_count))
+
+// Global variable: the cell vm->globals maps its name to, and that compiled
+// code refers to from its literal frame
+typedef struct Association {
+    Object object;         // Base object header
+    Value key;            // Symbol naming the global
+    Value value;          // Current value (nil until defined)
+} Association;
+
+#define ASSOCIATION_FIELDS ((sizeof(Association) - sizeof(Object)) / sizeof(Value))
+
 // Execution frame
+//
+// Frames are bump-allocated on the frame stack directly above the sender's
+// operand stack. The receiver and arguments the sender pushed for the send
+// stay where they are and are reached through 'arguments', so activating a
+// method copies nothing:
+//
+//   sender: ... | receiver | arg 0 .. arg n-1 |
+//   frame:                                    | Frame | locals | operands |
+//
+// A block's frame has the block in the receiver slot and the block's
+// receiver in 'receiver'.
 typedef struct Frame {
     Method* method;          // Current method being executed
     uint16_t bytecode_index; // Current bytecode index
     Value* stack_pointer;    // Current stack position
+    Value* stack_limit;      // End of this frame's operand stack
+    Value* arguments;        // Arguments, in the sender's operand stack
     Value receiver;          // Message receiver
     struct Frame* sender;    // Sender frame
     bool is_block_invocation;// Whether this is a block invocation
-    Value context;           // Block context (for non-local returns)
-    Value stack[];           // Variable-sized value stack
+    Value context;           // Context blocks created here refer to, or nil
+    Value stack[];           // Locals followed by the operand stack
 } Frame;
 
 // VM state
 typedef struct {
     // Memory management
-    void* heap_start;        // Start of heap
-    void* heap_next;         // Next free location on heap
-    void* heap_end;          // End of heap
+    void* heap_start;        // Start of old space
+    void* heap_next;         // Next free location in old space
+    void* heap_end;          // End of old space
+    void* nursery_start;     // Start of the nursery (new objects)
+    void* nursery_end;       // End of the nursery
 
     // Execution
     Frame* current_frame;    // Current execution frame
-    Frame* frames;           // Frame stack (pre-allocated)
-    Value globals[MAX_GLOBALS]; // Global variables
-    Value literals[MAX_LITERALS]; // Literals table
+    Value* stack_base;       // Frame stack (pre-allocated)
+    Value* stack_limit;      // End of the frame stack
+    Value globals;           // Name -> Association hash table (see vm_global_association)
+    Value class_table[MAX_CLASSES]; // Every class, by the index in its instances' headers
+    Value special_selectors[SPECIAL_SELECTOR_COUNT]; // Selectors of BC_ADD..BC_NE
+    uint16_t class_count;    // Entries used in class_table (index 0 is nil)
+    uint16_t global_count;   // Associations in globals
+    uint32_t cache_epoch;    // Bumped when a method is installed; stales inline caches
+    Frame* return_target;    // Home frame a non-local return is unwinding to, or NULL
 
     // Core classes
     Value class_Object;
@@ -132,6 +375,13 @@ typedef struct {
     Value class_Symbol;
     Value class_Integer;
     Value class_Block;
+    Value class_StringBuilder;
+    Value class_LargeInteger;
+    Value class_Context;
+    Value class_Association;
+    Value class_Nil;         // Classes of the special values, which
+    Value class_True;        // messages to nil, true and false are
+    Value class_False;       // looked up in
 
     // Special constants
     Value nil;
@@ -139,21 +389,37 @@ typedef struct {
     Value false_obj;
 
     // Statistics
-    uint32_t gc_count;       // Number of GC runs
+    uint32_t gc_count;       // Number of full (major) GC runs
+    uint32_t gc_minor_count; // Number of nursery scavenges
+    uint32_t gc_marked_objects; // Objects marked by full GCs
+    uint32_t gc_marked_bytes;   // Bytes marked by full GCs
+    uint32_t gc_mark_time_us;   // Time spent marking (CPU microseconds)
+    uint32_t gc_mark_overflows; // Heap rescans after the mark stack filled up
+    uint32_t gc_heap_grows;     // Times old space was enlarged
+    uint32_t gc_pauses[GC_PAUSE_BUCKETS]; // Pauses shorter than 1, 2, 4, ... us (last: longer)
+    uint32_t gc_pause_max_us;   // Longest pause
+    bool gc_marking;            // Incremental marking in progress
     uint32_t allocated;      // Total bytes allocated
+    uint32_t method_cache_hits;   // Global method cache hits
+    uint32_t method_cache_misses; // Global method cache misses (full lookups)
+    uint32_t inline_cache_hits;   // Sends answered by a send site's inline cache
+    uint32_t inline_cache_misses; // Sends that fell through to the method cache
 } VM;
 
 // VM initialization and execution
 void vm_init();
+bool vm_set_stack_size(size_t size);  // Before vm_init; false if too small
 void vm_cleanup();
 Value vm_execute_method(Method* method, Value receiver, Value* arguments, int arg_count);
-Frame* vm_push_frame(Method* method, Value receiver);
+Frame* vm_push_frame(Method* method, Value receiver, Value* arguments);
 void vm_pop_frame();
 void vm_bootstrap_core_classes();
 void register_global(const char* name, Value value);
+Value vm_global_association(Value name);
+void vm_define_global(Value name, Value value);
 
 // Memory management
-Object* vm_allocate_object(Value class, uint16_t size);
+Object* vm_allocate_object(Value class, uint32_t size);
 void vm_collect_garbage();
 
 // External interface
@@ -162,10 +428,19 @@ Value vm_find_class(const char* name);
 Method* vm_find_method(Value class, const char* name);
 Value vm_invoke_method(Value receiver, const char* name, Value* arguments, int arg_count);
 
+// Statistics
+void vm_print_stats();
+void vm_dump_inline_caches();
+
 // Error handling
 void vm_error(const char* format, ...);
 
 // Global VM instance
 extern VM* vm;
 
+// Class of a heap object
+static inline Value object_class(Object* object) {
+    return vm->class_table[object->class_index];
+}
+
 #endif /* POPLAR2_VM_H */
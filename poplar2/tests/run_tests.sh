@@ -0,0 +1,62 @@
+#!/bin/sh
+# run_tests.sh - Regression tests for Poplar2
+#
+# Usage: run_tests.sh VM...
+#
+# Each VM has to start up without reporting errors, then runs every
+# tests/*.som program twice, with the default heap and with a small one
+# that makes it collect often. A program passes if it prints exactly its
+# tests/*.expected and reports no VM errors.
+
+tests=$(dirname "$0")
+small_heap=--heap-size=128K
+failures=0
+count=0
+
+out=$(mktemp)
+err=$(mktemp)
+trap 'rm -f "$out" "$err"' EXIT
+
+# Run a VM; fail if it crashes or reports errors, or (given an expected
+# output file) prints anything else
+check() {
+    label=$1
+    expected=$2
+    shift 2
+    count=$((count + 1))
+
+    "$@" >"$out" 2>"$err"
+    status=$?
+
+    if [ $status -ne 0 ]; then
+        echo "FAIL $label: exit status $status"
+    elif grep -q "VM Error" "$err"; then
+        echo "FAIL $label: VM errors"
+    elif [ -n "$expected" ] && ! cmp -s "$expected" "$out"; then
+        echo "FAIL $label: unexpected output"
+        diff "$expected" "$out" | head -20
+    else
+        return 0
+    fi
+
+    head -20 "$err"
+    failures=$((failures + 1))
+}
+
+for vm in "$@"; do
+    case $vm in
+        */*) ;;
+        *) vm=./$vm ;;
+    esac
+    check "$vm startup" "" "$vm" --test-hello
+
+    for program in "$tests"/*.som; do
+        [ -f "$program" ] || continue
+        name=$(basename "$program" .som)
+        check "$vm $name" "$tests/$name.expected" "$vm" "$program"
+        check "$vm $name ($small_heap)" "$tests/$name.expected" "$vm" "$small_heap" "$program"
+    done
+done
+
+echo "$((count - failures)) of $count tests passed"
+[ $failures -eq 0 ]
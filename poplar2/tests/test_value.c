@@ -42,9 +42,9 @@ int main() {
     printf("Is true true? %s\n", is_true(true_val) ? "yes" : "no");
     printf("Is false false? %s\n\n", is_false(false_val) ? "yes" : "no");
     
-    // Test object values
+    // Test object values (static, so that the address fits a Value)
     printf("Testing object values:\n");
-    TestObject obj = {0};
+    static TestObject obj = {0};
     obj.hash = 123;
     obj.flags = 7;
     obj.size = 16;
@@ -53,7 +53,9 @@ int main() {
     printf("Object: "); value_print(obj_val); printf("\n");
     printf("Is object? %s\n", is_object(obj_val) ? "yes" : "no");
     
-    Object* extracted_obj = as_object(obj_val);
+    // Object is opaque outside the VM, so look through the mock's layout
+    TestObject* extracted_obj = (TestObject*)as_object(obj_val);
+    printf("Same object? %s\n", extracted_obj == &obj ? "yes" : "no");
     printf("Object hash: %d\n", extracted_obj->hash);
     printf("Object flags: %d\n", extracted_obj->flags);
     printf("Object size: %d\n\n", extracted_obj->size);
@@ -68,7 +70,7 @@ int main() {
     printf("true equals true? %s\n", value_equals(true_val, true_val) ? "yes" : "no");
     printf("true equals false? %s\n", value_equals(true_val, false_val) ? "yes" : "no");
     
-    TestObject obj2 = {0};
+    static TestObject obj2 = {0};
     Value obj_val2 = make_object((Object*)&obj2);
     printf("obj1 equals obj2 (different objects)? %s\n", value_equals(obj_val, obj_val2) ? "yes" : "no");
     